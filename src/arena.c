@@ -0,0 +1,96 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "arena.h"
+
+/*
+ * Preallocated memory arena.
+ *
+ * With a memory limit, the command buffer, the tar extraction buffer and
+ * the file buffers of the writer threads are carved out of a single mapping
+ * that is populated up front.  Running short of memory is then detected
+ * before anything is extracted, instead of getting the update, or the
+ * application, OOM-killed half way through.  Hashing uses a stack buffer
+ * of its own, and does not allocate from the arena.
+ *
+ * Buffers are allocated for the lifetime of the process, and freeing them
+ * is a no-op.  Without an arena, allocations go straight to malloc.
+ */
+
+#define ARENA_ALIGN			64
+
+static char *arena;
+static size_t arena_size;
+static size_t arena_pos;
+
+int arena_init(size_t size)
+{
+	arena = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+	if (arena == MAP_FAILED) {
+		PERROR("mmap", errno);
+		arena = NULL;
+		return errno;
+	}
+
+	arena_size = size;
+	arena_pos = 0;
+
+	return 0;
+}
+
+void *arena_alloc(size_t size)
+{
+	void *ptr;
+
+	if (!arena)
+		return malloc(size);
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size > arena_size - arena_pos) {
+		ERROR("%zu bytes exceeds memory arena (%zu of %zu used)",
+		      size, arena_pos, arena_size);
+		return NULL;
+	}
+
+	ptr = arena + arena_pos;
+	arena_pos += size;
+
+	return ptr;
+}
+
+void arena_free(void *ptr)
+{
+	if (arena && (char *)ptr >= arena && (char *)ptr < arena + arena_size)
+		return;
+
+	free(ptr);
+}
+
+size_t arena_used(void)
+{
+	return arena_pos;
+}
@@ -0,0 +1,593 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "common.h"
+#include "journal.h"
+#include "cache.h"
+#include "throttle.h"
+
+/*
+ * Content-addressed extraction cache.
+ *
+ * The cache directory holds
+ *
+ *   objects/<sha256>-<mode>-<uid>-<gid>-<mtime>
+ *			File contents and attributes, named by their digest
+ *			and the attributes
+ *   images/<sha256>	Extracted tree of an image, named by image digest,
+ *			with all files hard linked to objects
+ *
+ * so files shared between cached images are only stored once.  As a hard
+ * link shares the attributes of the object, these are part of its name, and
+ * files of the same content but with different attributes get objects of
+ * their own.  Owner (when run as root), mode and times of every entry are
+ * restored when an image is loaded from the cache.  When an image
+ * is found in the cache, its tree is reflinked (or copied, if the filesystem
+ * does not support reflinks) into the workdir instead of extracting the image
+ * again.  Files in the workdir never share an inode with an object, as the
+ * image command may modify them in place.  The mtime of the image tree is
+ * updated on each use, and least recently used trees are evicted when the
+ * objects exceed the size budget.
+ */
+
+#define OBJECTS_DIR			"objects"
+#define IMAGES_DIR			"images"
+#define COPY_CHUNK			(4 * 1024 * 1024)
+
+struct cache_member {
+	char *name;
+	unsigned char digest[SHA256_DIGEST_LEN];
+};
+
+struct cache {
+	char *dir;
+	unsigned long long budget;
+	struct cache_member *members;
+	size_t num_members;
+	size_t max_members;
+};
+
+/* nftw() callbacks have no private data */
+static struct cache *walk_cache;
+static const char *walk_dst;
+static size_t walk_root_len;
+
+static char *cache_path(struct cache *c, const char *sub, const char *name)
+{
+	static char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/%s", c->dir, sub, name);
+	return path;
+}
+
+/* Owner before mode, as chown clears the set-user-ID and set-group-ID bits */
+static int copy_attrs(int fd, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	if (geteuid() == 0 && fchown(fd, st->st_uid, st->st_gid) == -1) {
+		PERROR("fchown", errno);
+		return errno;
+	}
+
+	if (fchmod(fd, st->st_mode & 07777) == -1 ||
+	    futimens(fd, times) == -1) {
+		PERROR("fchmod", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+/* As copy_attrs(), for directories, symlinks and other nodes */
+static int set_attrs(const char *path, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	if (geteuid() == 0 &&
+	    lchown(path, st->st_uid, st->st_gid) == -1) {
+		PERROR("lchown", errno);
+		return errno;
+	}
+
+	if (!S_ISLNK(st->st_mode) && chmod(path, st->st_mode & 07777) == -1) {
+		PERROR("chmod", errno);
+		return errno;
+	}
+
+	if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) == -1) {
+		PERROR("utimensat", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Make dst a copy of src, sharing its data with a reflink if supported.
+ * Never a hard link, as a change to one must not show up in the other.
+ */
+static int clone_file(const char *src, const char *dst, const struct stat *st)
+{
+	int in, out, err = 0;
+	ssize_t n;
+
+	in = open(src, O_RDONLY|O_CLOEXEC);
+	if (in == -1) {
+		PERROR(src, errno);
+		return errno;
+	}
+
+	out = open(dst, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+	if (out == -1) {
+		PERROR(dst, errno);
+		close(in);
+		return errno;
+	}
+
+	if (ioctl(out, FICLONE, in) == 0) {
+		err = copy_attrs(out, st);
+		goto out;
+	}
+
+	/* No reflinks, so copy the data (in-kernel if possible) */
+	while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+		throttle_io(n, 0);
+	if (n == -1) {
+		if (errno != EXDEV && errno != EINVAL &&
+		    errno != EOPNOTSUPP && errno != ENOSYS) {
+			PERROR("copy_file_range", errno);
+			err = errno;
+			goto out;
+		}
+		/* Across filesystems on older kernels, or not supported */
+		err = copy_stream(in, out);
+		if (err)
+			goto out;
+	}
+	err = copy_attrs(out, st);
+
+out:
+	close(out);
+	close(in);
+	/* A partial copy must not pass for an object */
+	if (err)
+		unlink(dst);
+	return err;
+}
+
+static int make_node(const char *src, const char *dst, const struct stat *st)
+{
+	char target[PATH_MAX];
+	ssize_t len;
+
+	if (S_ISLNK(st->st_mode)) {
+		len = readlink(src, target, sizeof(target) - 1);
+		if (len == -1) {
+			PERROR("readlink", errno);
+			return errno;
+		}
+		target[len] = '\0';
+		if (symlink(target, dst) == -1) {
+			PERROR("symlink", errno);
+			return errno;
+		}
+		return set_attrs(dst, st);
+	}
+
+	if (mknod(dst, st->st_mode, st->st_rdev) == -1) {
+		PERROR("mknod", errno);
+		return errno;
+	}
+
+	return set_attrs(dst, st);
+}
+
+/* Apply attributes of directories once their contents are in place */
+static int dir_attrs_entry(const char *fpath, const struct stat *st,
+			   int type, struct FTW *ftw)
+{
+	const char *rel = fpath + walk_root_len;
+	char dst[PATH_MAX];
+
+	if (*rel == '/')
+		rel++;
+	if (type != FTW_DP || *rel == '\0')
+		return 0;
+
+	snprintf(dst, sizeof(dst), "%s/%s", walk_dst, rel);
+	return set_attrs(dst, st);
+}
+
+static char *object_name(struct cache *c, const char *hex,
+			 const struct stat *st)
+{
+	char name[NAME_MAX + 1];
+
+	snprintf(name, sizeof(name), "%s-%o-%u-%u-%lld.%09ld", hex,
+		 st->st_mode & 07777, st->st_uid, st->st_gid,
+		 (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+	return cache_path(c, OBJECTS_DIR, name);
+}
+
+static int compare_members(const void *a, const void *b)
+{
+	return strcmp(((const struct cache_member *)a)->name,
+		      ((const struct cache_member *)b)->name);
+}
+
+static int member_digest(struct cache *c, const char *fpath, const char *rel,
+			 unsigned char *digest)
+{
+	struct cache_member key = { .name = (char *)rel }, *m;
+
+	m = bsearch(&key, c->members, c->num_members, sizeof(*m),
+		    compare_members);
+	if (m) {
+		memcpy(digest, m->digest, SHA256_DIGEST_LEN);
+		return 0;
+	}
+
+	return sha256_file(fpath, digest);
+}
+
+static int store_entry(const char *fpath, const struct stat *st, int type,
+		       struct FTW *ftw)
+{
+	struct cache *c = walk_cache;
+	const char *rel = fpath + walk_root_len;
+	unsigned char digest[SHA256_DIGEST_LEN];
+	char hex[SHA256_HEX_LEN];
+	char dst[PATH_MAX], *object;
+	struct stat ost;
+	int err;
+
+	if (*rel == '/')
+		rel++;
+	if (*rel == '\0' || strcmp(rel, JOURNAL_FILE) == 0)
+		return 0;
+
+	snprintf(dst, sizeof(dst), "%s/%s", walk_dst, rel);
+
+	switch (type) {
+	case FTW_D:
+		if (mkdir(dst, (st->st_mode & 07777) | S_IRWXU) == -1) {
+			PERROR("mkdir", errno);
+			return errno;
+		}
+		return 0;
+	case FTW_F:
+		if (!S_ISREG(st->st_mode))
+			return make_node(fpath, dst, st);
+		break;
+	case FTW_SL:
+		return make_node(fpath, dst, st);
+	default:
+		ERROR("cannot cache %s", fpath);
+		return EINVAL;
+	}
+
+	err = member_digest(c, fpath, rel, digest);
+	if (err)
+		return err;
+	sha256_hex(digest, hex);
+
+	object = object_name(c, hex, st);
+	if (stat(object, &ost) == -1) {
+		err = clone_file(fpath, object, st);
+		if (err)
+			return err;
+	}
+
+	if (link(object, dst) == -1) {
+		PERROR("link", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+static int load_entry(const char *fpath, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	const char *rel = fpath + walk_root_len;
+	char dst[PATH_MAX];
+
+	if (*rel == '/')
+		rel++;
+	if (*rel == '\0')
+		return 0;
+
+	snprintf(dst, sizeof(dst), "%s/%s", walk_dst, rel);
+
+	switch (type) {
+	case FTW_D:
+		/* Writable until filled, see dir_attrs_entry() */
+		if (mkdir(dst, (st->st_mode & 07777) | S_IRWXU) == -1 &&
+		    errno != EEXIST) {
+			PERROR("mkdir", errno);
+			return errno;
+		}
+		return 0;
+	case FTW_F:
+		if (S_ISREG(st->st_mode))
+			return clone_file(fpath, dst, st);
+		/* fall through */
+	case FTW_SL:
+		return make_node(fpath, dst, st);
+	default:
+		ERROR("cannot load %s from cache", fpath);
+		return EINVAL;
+	}
+}
+
+static int remove_entry(const char *fpath, const struct stat *st, int type,
+			struct FTW *ftw)
+{
+	if (remove(fpath) == -1) {
+		PERROR(fpath, errno);
+		return errno;
+	}
+	return 0;
+}
+
+static int remove_tree(const char *path)
+{
+	return nftw(path, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+}
+
+/* Remove objects no longer used by any image, and return the size of the
+ * remaining */
+static unsigned long long sweep_objects(struct cache *c)
+{
+	unsigned long long size = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(cache_path(c, OBJECTS_DIR, ""));
+	if (!dir) {
+		PERROR("opendir", errno);
+		return 0;
+	}
+
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd(dir), de->d_name, &st, 0) == -1)
+			continue;
+		if (st.st_nlink == 1)
+			unlinkat(dirfd(dir), de->d_name, 0);
+		else
+			size += st.st_blocks * 512;
+	}
+
+	closedir(dir);
+	return size;
+}
+
+static int find_lru_image(struct cache *c, const char *keep, char *name)
+{
+	time_t oldest = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	name[0] = '\0';
+
+	dir = opendir(cache_path(c, IMAGES_DIR, ""));
+	if (!dir) {
+		PERROR("opendir", errno);
+		return errno;
+	}
+
+	while ((de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0 ||
+		    strcmp(de->d_name, keep) == 0)
+			continue;
+		if (fstatat(dirfd(dir), de->d_name, &st, 0) == -1)
+			continue;
+		if (!name[0] || st.st_mtime < oldest) {
+			oldest = st.st_mtime;
+			snprintf(name, NAME_MAX + 1, "%s", de->d_name);
+		}
+	}
+
+	closedir(dir);
+	return 0;
+}
+
+static void evict(struct cache *c, const char *keep)
+{
+	char name[NAME_MAX + 1];
+	unsigned long long size;
+
+	while ((size = sweep_objects(c)) > c->budget && c->budget) {
+		if (find_lru_image(c, keep, name) || !name[0])
+			break;
+		INFO("cache: evicting %s", name);
+		remove_tree(cache_path(c, IMAGES_DIR, name));
+	}
+}
+
+int cache_open(struct cache **cache, const char *dir,
+	       unsigned long long budget)
+{
+	struct cache *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c || !(c->dir = strdup(dir))) {
+		PERROR("calloc", ENOMEM);
+		free(c);
+		return ENOMEM;
+	}
+	c->budget = budget;
+
+	if ((mkdir(dir, S_IRWXU) == -1 && errno != EEXIST) ||
+	    (mkdir(cache_path(c, OBJECTS_DIR, ""), S_IRWXU) == -1 &&
+	     errno != EEXIST) ||
+	    (mkdir(cache_path(c, IMAGES_DIR, ""), S_IRWXU) == -1 &&
+	     errno != EEXIST)) {
+		PERROR("mkdir", errno);
+		cache_close(c);
+		return errno;
+	}
+
+	*cache = c;
+	return 0;
+}
+
+int cache_lookup(struct cache *c, const unsigned char *image_digest,
+		 const char *workdir)
+{
+	char hex[SHA256_HEX_LEN];
+	char *tree;
+	int err;
+
+	sha256_hex(image_digest, hex);
+	tree = strdup(cache_path(c, IMAGES_DIR, hex));
+	if (!tree)
+		return ENOMEM;
+
+	if (access(tree, F_OK) == -1) {
+		free(tree);
+		return ENOENT;
+	}
+
+	INFO("cache: using %s", tree);
+
+	/* Mark as recently used */
+	utimensat(AT_FDCWD, tree, NULL, 0);
+
+	walk_dst = workdir;
+	walk_root_len = strlen(tree);
+	err = nftw(tree, load_entry, 16, FTW_PHYS);
+	if (!err)
+		err = nftw(tree, dir_attrs_entry, 16, FTW_PHYS|FTW_DEPTH);
+	free(tree);
+
+	return err;
+}
+
+int cache_member(struct untar_member *m, void *priv)
+{
+	struct cache *c = priv;
+	struct cache_member *p;
+
+	if (m->type != '0' && m->type != '\0' && m->type != '7' &&
+	    m->type != 'S')
+		return 0;
+
+	if (c->num_members == c->max_members) {
+		c->max_members = c->max_members ? 2 * c->max_members : 256;
+		p = realloc(c->members, c->max_members * sizeof(*p));
+		if (!p) {
+			PERROR("realloc", ENOMEM);
+			return ENOMEM;
+		}
+		c->members = p;
+	}
+
+	p = &c->members[c->num_members];
+	p->name = strdup(m->name);
+	if (!p->name)
+		return ENOMEM;
+	memcpy(p->digest, m->digest, sizeof(p->digest));
+	c->num_members++;
+
+	return 0;
+}
+
+int cache_store(struct cache *c, const unsigned char *image_digest,
+		const char *workdir)
+{
+	char hex[SHA256_HEX_LEN];
+	char *tmp, *tree;
+	int err;
+
+	sha256_hex(image_digest, hex);
+
+	tree = strdup(cache_path(c, IMAGES_DIR, hex));
+	tmp = strdup(cache_path(c, IMAGES_DIR, ".tmp-XXXXXX"));
+	if (!tree || !tmp) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (!mkdtemp(tmp)) {
+		PERROR("mkdtemp", errno);
+		err = errno;
+		goto out;
+	}
+
+	qsort(c->members, c->num_members, sizeof(*c->members),
+	      compare_members);
+
+	walk_cache = c;
+	walk_dst = tmp;
+	walk_root_len = strlen(workdir);
+	err = nftw(workdir, store_entry, 16, FTW_PHYS);
+	if (!err)
+		err = nftw(workdir, dir_attrs_entry, 16, FTW_PHYS|FTW_DEPTH);
+	if (err) {
+		ERROR("could not add %s to cache", hex);
+		remove_tree(tmp);
+		goto out;
+	}
+
+	if (rename(tmp, tree) == -1) {
+		/* Already cached by someone else */
+		remove_tree(tmp);
+	}
+
+	evict(c, hex);
+
+out:
+	free(tmp);
+	free(tree);
+	return err;
+}
+
+void cache_close(struct cache *c)
+{
+	size_t i;
+
+	for (i = 0 ; i < c->num_members ; i++)
+		free(c->members[i].name);
+	free(c->members);
+	free(c->dir);
+	free(c);
+}
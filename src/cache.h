@@ -0,0 +1,36 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "untar.h"
+
+struct cache;
+
+int cache_open(struct cache **cache, const char *dir,
+	       unsigned long long budget);
+int cache_lookup(struct cache *cache, const unsigned char *image_digest,
+		 const char *workdir);
+int cache_member(struct untar_member *member, void *cache);
+int cache_store(struct cache *cache, const unsigned char *image_digest,
+		const char *workdir);
+void cache_close(struct cache *cache);
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1,605 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "throttle.h"
+#include "chunk.h"
+
+/*
+ * Content-defined chunk store.
+ *
+ * Files are cut into chunks where a buzhash over the last CHUNK_WINDOW bytes
+ * hits a fixed pattern, as done by casync and desync, so that an insertion or
+ * removal only changes the chunks around it, and the same content is cut the
+ * same way whatever version it is part of.  Chunks are stored by the SHA-256
+ * digest of their contents as
+ *
+ *   <dir>/<first 4 hex digits>/<sha256>.chunk
+ *
+ * The store is seeded from the installed system with --chunk-seed, and an
+ * image then only needs to carry the chunks the store is missing.  A file of
+ * such an image is replaced by an index, <file>.chunks, with a line
+ *
+ *   <sha256> <size>
+ *
+ * per chunk, and the chunks missing from the store are carried in
+ * .dupdate-chunks/<sha256>.  After extraction, the carried chunks are added
+ * to the store, and each file is assembled from its index.  Every chunk is
+ * verified against its digest when read, so a damaged store fails the
+ * update instead of installing garbage.
+ */
+
+#define CHUNK_WINDOW			48
+#define CHUNK_SUFFIX			".chunk"
+
+struct chunk_store {
+	char *dir;
+	unsigned char *buf;	/* CHUNK_MAX bytes */
+	unsigned long chunks;	/* Chunks seen, by seed or assemble */
+	unsigned long added;	/* Chunks not already in the store */
+};
+
+static uint32_t buzhash_table[256];
+
+/* Any fixed random table will do, as long as every build uses the same */
+static void init_buzhash(void)
+{
+	uint32_t x = 0x2545f491;
+	int i;
+
+	if (buzhash_table[0])
+		return;
+
+	for (i = 0 ; i < 256 ; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buzhash_table[i] = x;
+	}
+}
+
+static inline uint32_t rol32(uint32_t v, unsigned n)
+{
+	n &= 31;
+	return n ? (v << n) | (v >> (32 - n)) : v;
+}
+
+/* Length of the first chunk of the len bytes at p */
+static size_t find_cut(const unsigned char *p, size_t len)
+{
+	uint32_t h = 0;
+	size_t i;
+
+	if (len <= CHUNK_MIN)
+		return len;
+
+	for (i = CHUNK_MIN - CHUNK_WINDOW ; i < CHUNK_MIN ; i++)
+		h = rol32(h, 1) ^ buzhash_table[p[i]];
+
+	for (i = CHUNK_MIN ; i < len ; i++) {
+		if ((h & (CHUNK_AVG - 1)) == CHUNK_AVG - 1)
+			return i;
+		h = rol32(h, 1) ^ buzhash_table[p[i]] ^
+			rol32(buzhash_table[p[i - CHUNK_WINDOW]],
+			      CHUNK_WINDOW);
+	}
+
+	/* Only short of CHUNK_MAX at the end of the file */
+	return len;
+}
+
+static int read_full(int fd, unsigned char *buf, size_t len, size_t *got)
+{
+	ssize_t n;
+
+	for (*got = 0 ; *got < len ; *got += n) {
+		n = read(fd, buf + *got, len - *got);
+		if (n == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			PERROR("read", errno);
+			return errno;
+		}
+		if (n == 0)
+			break;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("write", errno);
+			return errno;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int chunk_split(int fd, chunk_fn fn, void *priv)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+	struct sha256 ctx;
+	unsigned char *buf;
+	size_t len = 0, got, cut;
+	int eof = 0, err = 0;
+
+	init_buzhash();
+
+	buf = malloc(CHUNK_MAX);
+	if (!buf) {
+		ERROR("out of memory");
+		return ENOMEM;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for (;;) {
+		if (!eof) {
+			err = read_full(fd, buf + len, CHUNK_MAX - len, &got);
+			if (err)
+				break;
+			len += got;
+			eof = len < CHUNK_MAX;
+		}
+		if (!len)
+			break;
+
+		cut = find_cut(buf, len);
+		sha256_init(&ctx);
+		sha256_update(&ctx, buf, cut);
+		sha256_final(&ctx, digest);
+
+		err = fn(buf, cut, digest, priv);
+		if (err)
+			break;
+
+		len -= cut;
+		memmove(buf, buf + cut, len);
+	}
+
+	free(buf);
+	return err;
+}
+
+static char *chunk_path(struct chunk_store *store,
+			const unsigned char *digest)
+{
+	static char path[PATH_MAX];
+	char hex[SHA256_HEX_LEN];
+
+	sha256_hex(digest, hex);
+	snprintf(path, sizeof(path), "%s/%.4s/%s" CHUNK_SUFFIX, store->dir,
+		 hex, hex);
+	return path;
+}
+
+int chunk_store_open(struct chunk_store **store, const char *dir)
+{
+	struct chunk_store *s;
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		PERROR(dir, errno);
+		return errno;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s || !(s->dir = strdup(dir)) || !(s->buf = malloc(CHUNK_MAX))) {
+		ERROR("out of memory");
+		if (s)
+			free(s->dir);
+		free(s);
+		return ENOMEM;
+	}
+
+	*store = s;
+	return 0;
+}
+
+void chunk_store_close(struct chunk_store *store)
+{
+	if (!store)
+		return;
+
+	free(store->buf);
+	free(store->dir);
+	free(store);
+}
+
+int chunk_store_has(struct chunk_store *store, const unsigned char *digest)
+{
+	return access(chunk_path(store, digest), F_OK) == 0;
+}
+
+int chunk_store_add(struct chunk_store *store, const void *data, size_t len,
+		    const unsigned char *digest)
+{
+	char tmp[PATH_MAX], *path, *p;
+	int fd, err;
+
+	store->chunks++;
+	path = chunk_path(store, digest);
+	if (access(path, F_OK) == 0)
+		return 0;
+
+	/* Written aside and renamed, so a chunk is complete once it exists */
+	p = strrchr(path, '/');
+	snprintf(tmp, sizeof(tmp), "%.*s", (int)(p - path), path);
+	if (mkdir(tmp, 0755) == -1 && errno != EEXIST) {
+		PERROR(tmp, errno);
+		return errno;
+	}
+	strcat(tmp, "/.tmp.XXXXXX");
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd == -1) {
+		PERROR(tmp, errno);
+		return errno;
+	}
+	err = write_full(fd, data, len);
+	close(fd);
+	if (!err && rename(tmp, path) == -1) {
+		PERROR("rename", errno);
+		err = errno;
+	}
+	if (err) {
+		unlink(tmp);
+		return err;
+	}
+
+	throttle_io(len, 1);
+	store->added++;
+
+	return 0;
+}
+
+static int seed_chunk(const void *data, size_t len,
+		      const unsigned char *digest, void *priv)
+{
+	return chunk_store_add(priv, data, len, digest);
+}
+
+static int seed_file(struct chunk_store *store, const char *path)
+{
+	int fd, err;
+
+	fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1) {
+		PERROR(path, errno);
+		return errno;
+	}
+
+	err = chunk_split(fd, seed_chunk, store);
+	if (err) {
+		ERROR("%s: seeding failed", path);
+	}
+
+	close(fd);
+	return err;
+}
+
+/* nftw() callbacks have no private data */
+static struct chunk_store *walk_store;
+
+static int seed_entry(const char *fpath, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	return seed_file(walk_store, fpath);
+}
+
+/* Add the chunks of a file, block device or directory tree to the store */
+int chunk_seed(struct chunk_store *store, const char *path)
+{
+	struct stat st;
+	int err;
+
+	if (stat(path, &st) == -1) {
+		PERROR(path, errno);
+		return errno;
+	}
+
+	store->chunks = store->added = 0;
+	if (S_ISDIR(st.st_mode)) {
+		walk_store = store;
+		err = nftw(path, seed_entry, 16, FTW_PHYS|FTW_MOUNT);
+		if (err == -1) {
+			PERROR("nftw", errno);
+			err = errno;
+		}
+	} else {
+		err = seed_file(store, path);
+	}
+
+	if (!err) {
+		INFO("seeded %s: %lu chunks, %lu new", path, store->chunks,
+		     store->added);
+	}
+
+	return err;
+}
+
+/* Read a chunk of at most CHUNK_MAX bytes, and check its digest */
+static int read_chunk(struct chunk_store *store, const char *path,
+		      const unsigned char *digest, size_t *len)
+{
+	unsigned char actual[SHA256_DIGEST_LEN];
+	struct sha256 ctx;
+	size_t got;
+	int fd, err;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return errno;
+
+	err = read_full(fd, store->buf, CHUNK_MAX, len);
+	if (!err && *len == CHUNK_MAX &&
+	    !read_full(fd, actual, 1, &got) && got)
+		err = EFBIG;
+	close(fd);
+	if (err)
+		return err;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, store->buf, *len);
+	sha256_final(&ctx, actual);
+	if (memcmp(actual, digest, SHA256_DIGEST_LEN) != 0)
+		return EBADMSG;
+
+	return 0;
+}
+
+static int parse_digest(const char *hex, unsigned char *digest)
+{
+	unsigned i;
+
+	if (strspn(hex, "0123456789abcdef") != SHA256_HEX_LEN - 1)
+		return EINVAL;
+
+	for (i = 0 ; i < SHA256_DIGEST_LEN ; i++)
+		sscanf(hex + 2 * i, "%2hhx", &digest[i]);
+
+	return 0;
+}
+
+/* Add the chunks carried in the image to the store */
+int chunk_import(struct chunk_store *store, const char *dir)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+	char path[PATH_MAX];
+	struct dirent *de;
+	unsigned long count = 0;
+	size_t len;
+	DIR *d;
+	int err = 0;
+
+	snprintf(path, sizeof(path), "%s/" CHUNK_DIR, dir);
+	d = opendir(path);
+	if (!d) {
+		if (errno == ENOENT)
+			return 0;
+		PERROR(path, errno);
+		return errno;
+	}
+
+	while (!err && (de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/" CHUNK_DIR "/%s", dir,
+			 de->d_name);
+		err = parse_digest(de->d_name, digest);
+		if (!err)
+			err = read_chunk(store, path, digest, &len);
+		if (err) {
+			ERROR("%s: invalid chunk: %s", path, strerror(err));
+			break;
+		}
+
+		err = chunk_store_add(store, store->buf, len, digest);
+		if (!err && unlink(path) == -1) {
+			PERROR(path, errno);
+			err = errno;
+		}
+		count++;
+	}
+	closedir(d);
+
+	if (err)
+		return err;
+
+	snprintf(path, sizeof(path), "%s/" CHUNK_DIR, dir);
+	if (rmdir(path) == -1) {
+		PERROR(path, errno);
+		return errno;
+	}
+
+	INFO("added %lu chunks carried in the image", count);
+	return 0;
+}
+
+/*
+ * Give the assembled file the owner, mode and mtime of its index, as
+ * extracted from the image, and have it on disk before the index is gone.
+ */
+static int finish_file(int fd, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	if (geteuid() == 0 && fchown(fd, st->st_uid, st->st_gid) == -1) {
+		PERROR("chown", errno);
+		return errno;
+	}
+
+	if (fchmod(fd, st->st_mode & 07777) == -1) {
+		PERROR("fchmod", errno);
+		return errno;
+	}
+
+	if (futimens(fd, times) == -1) {
+		PERROR("futimens", errno);
+	}
+
+	if (fsync(fd) == -1) {
+		PERROR("fsync", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+/* Write the file of index, from the chunks listed in it */
+static int assemble_file(struct chunk_store *store, const char *index,
+			 const struct stat *st)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+	char path[PATH_MAX], hex[SHA256_HEX_LEN], *line = NULL;
+	size_t size = 0, len, want;
+	int lineno = 0, fd, err = 0;
+	FILE *f;
+
+	f = fopen(index, "re");
+	if (!f) {
+		PERROR(index, errno);
+		return errno;
+	}
+
+	snprintf(path, sizeof(path), "%.*s", (int)(strlen(index) -
+		 strlen(CHUNK_INDEX_SUFFIX)), index);
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC,
+		  st->st_mode & 07777);
+	if (fd == -1) {
+		PERROR(path, errno);
+		fclose(f);
+		return errno;
+	}
+
+	while (!err && getline(&line, &size, f) != -1) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "%64s %zu", hex, &want) != 2 ||
+		    parse_digest(hex, digest) || want > CHUNK_MAX) {
+			ERROR("%s line %d: invalid chunk", index, lineno);
+			err = EINVAL;
+			break;
+		}
+
+		err = read_chunk(store, chunk_path(store, digest), digest,
+				 &len);
+		if (!err && len != want)
+			err = EBADMSG;
+		if (err) {
+			ERROR("%s: chunk %s %s", path, hex,
+			      err == ENOENT ? "missing from the store" :
+			      strerror(err));
+			break;
+		}
+
+		err = write_full(fd, store->buf, len);
+		if (!err)
+			throttle_io(len, 0);
+		store->chunks++;
+	}
+
+	if (!err)
+		err = finish_file(fd, st);
+
+	free(line);
+	fclose(f);
+	close(fd);
+
+	if (err) {
+		unlink(path);
+		return err;
+	}
+
+	if (unlink(index) == -1) {
+		PERROR(index, errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+static int assemble_entry(const char *fpath, const struct stat *st, int type,
+			  struct FTW *ftw)
+{
+	size_t len = strlen(fpath);
+
+	if (type != FTW_F || !S_ISREG(st->st_mode) ||
+	    len <= strlen(CHUNK_INDEX_SUFFIX) ||
+	    strcmp(fpath + len - strlen(CHUNK_INDEX_SUFFIX),
+		   CHUNK_INDEX_SUFFIX) != 0)
+		return 0;
+
+	return assemble_file(walk_store, fpath, st);
+}
+
+/* Assemble every file in dir which has been replaced by a chunk index */
+int chunk_assemble(struct chunk_store *store, const char *dir)
+{
+	int err;
+
+	store->chunks = 0;
+	walk_store = store;
+	err = nftw(dir, assemble_entry, 16, FTW_PHYS);
+	if (err == -1) {
+		PERROR("nftw", errno);
+		return errno;
+	}
+	if (err)
+		return err;
+
+	if (store->chunks)
+		INFO("assembled files from %lu chunks", store->chunks);
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _CHUNK_H_
+#define _CHUNK_H_
+
+#include <stddef.h>
+
+#include "sha256.h"
+
+/* Chunks carried in an image, to be added to the store */
+#define CHUNK_DIR			".dupdate-chunks"
+/* Index of chunks a file is made of, named after the file */
+#define CHUNK_INDEX_SUFFIX		".chunks"
+
+#define CHUNK_MIN			(16 * 1024)
+#define CHUNK_AVG			(64 * 1024)
+#define CHUNK_MAX			(256 * 1024)
+
+struct chunk_store;
+
+/* Called for each chunk of a file, in order */
+typedef int (*chunk_fn)(const void *data, size_t len,
+			const unsigned char *digest, void *priv);
+
+int chunk_split(int fd, chunk_fn fn, void *priv);
+
+int chunk_store_open(struct chunk_store **store, const char *dir);
+void chunk_store_close(struct chunk_store *store);
+int chunk_store_has(struct chunk_store *store, const unsigned char *digest);
+int chunk_store_add(struct chunk_store *store, const void *data, size_t len,
+		    const unsigned char *digest);
+
+int chunk_seed(struct chunk_store *store, const char *path);
+int chunk_import(struct chunk_store *store, const char *dir);
+int chunk_assemble(struct chunk_store *store, const char *dir);
+
+#endif /* _CHUNK_H_ */
@@ -18,13 +18,26 @@
  * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
 
 #include "common.h"
+#include "trace.h"
+
+/* renameat2(), which older C libraries lack a wrapper for */
+int rename2(const char *from, const char *to, unsigned flags)
+{
+	return syscall(SYS_renameat2, AT_FDCWD, from, AT_FDCWD, to, flags);
+}
 
 int strset(char **ptr, const char *str, size_t maxlen)
 {
@@ -44,21 +57,40 @@ int strset(char **ptr, const char *str, size_t maxlen)
 	return 0;
 }
 
-int _log_to_syslog = 0;
-
-void log_to_syslog(int enable)
+/*
+ * Parse size with optional k, M or G suffix (powers of 1024).
+ */
+int parse_size(const char *str, unsigned long long *size)
 {
-	if (enable)
-		_log_to_syslog = 1;
-}
+	char *end;
 
-int run_shcmd(const char *cmd)
-{
-	int ret;
+	errno = 0;
+	*size = strtoull(str, &end, 10);
+	if (errno || end == str)
+		return EINVAL;
 
-	INFO("+ %s", cmd);
-	ret = system(cmd);
+	switch (*end) {
+	case 'G': case 'g':
+		*size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		*size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		*size <<= 10;
+		end++;
+		break;
+	}
 
+	if (*end != '\0')
+		return EINVAL;
+
+	return 0;
+}
+
+/* Error code of a command, from its wait status */
+static int cmd_status(const char *cmd, int ret)
+{
 	if (WIFSIGNALED(ret) && (WTERMSIG(ret) == SIGINT)) {
 		INFO("<SIGINT>\n");
 		exit(EINTR);
@@ -80,3 +112,127 @@ int run_shcmd(const char *cmd)
 
 	return WEXITSTATUS(ret);
 }
+
+int run_shcmd(const char *cmd)
+{
+	unsigned long long start;
+	int ret;
+
+	INFO("+ %s", cmd);
+	log_flush();
+	start = trace_now();
+	ret = system(cmd);
+	trace_span("sh", start, cmd, ret == -1 ? -1 : WIFEXITED(ret) ?
+		   WEXITSTATUS(ret) : 128 + WTERMSIG(ret));
+
+	return cmd_status(cmd, ret);
+}
+
+/* Run a program with the given arguments, without a shell in between */
+int run_prog(char *const argv[])
+{
+	static char cmd[SHCMD_MAX];
+	unsigned long long start;
+	size_t len = 0;
+	int i, ret;
+	pid_t pid;
+
+	for (i = 0 ; argv[i] && len < sizeof(cmd) ; i++)
+		len += snprintf(cmd + len, sizeof(cmd) - len, "%s%s",
+				i ? " " : "", argv[i]);
+
+	INFO("+ %s", cmd);
+	log_flush();
+	start = trace_now();
+
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork", errno);
+		return errno;
+	}
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	while (waitpid(pid, &ret, 0) == -1) {
+		if (errno != EINTR) {
+			PERROR("waitpid", errno);
+			ret = -1;
+			break;
+		}
+	}
+	trace_span("exec", start, cmd, ret == -1 ? -1 : WIFEXITED(ret) ?
+		   WEXITSTATUS(ret) : 128 + WTERMSIG(ret));
+
+	return cmd_status(cmd, ret);
+}
+
+/* Escape str for a JSON string, truncating it to fit in size */
+void json_escape(char *buf, size_t size, const char *str)
+{
+	size_t len = 0;
+	unsigned char c;
+
+	for ( ; (c = *str) && len + 7 < size ; str++) {
+		if (c == '"' || c == '\\') {
+			buf[len++] = '\\';
+			buf[len++] = c;
+		} else if (c < 0x20) {
+			len += sprintf(buf + len, "\\u%04x", c);
+		} else {
+			buf[len++] = c;
+		}
+	}
+	buf[len] = '\0';
+}
+
+#define COPY_CHUNK			(64 * 1024)
+
+/*
+ * Copy everything from in to out, until end of file.  Data is spliced when
+ * one of them is a pipe, so it is not copied through user space.
+ */
+int copy_stream(int in, int out)
+{
+	char buf[COPY_CHUNK];
+	ssize_t n, w;
+	char *p;
+
+	for (;;) {
+		n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+		if (n == 0)
+			return 0;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL)
+				break;
+			PERROR("splice", errno);
+			return errno;
+		}
+	}
+
+	/* Neither end is a pipe */
+	while ((n = read(in, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("read", errno);
+			return errno;
+		}
+		for (p = buf ; n ; p += w, n -= w) {
+			w = write(out, p, n);
+			if (w == -1) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				PERROR("write", errno);
+				return errno;
+			}
+		}
+	}
+
+	return 0;
+}
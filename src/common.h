@@ -24,36 +24,43 @@
 #include <stdio.h>
 #include <syslog.h>
 #include <string.h>
+#include <limits.h>
 
 #include "config.h"
 
 int strset(char **ptr, const char *str, size_t maxlen);
+int parse_size(const char *str, unsigned long long *size);
 
 extern int _log_to_syslog;
 void log_to_syslog(int);
+void log_start(void);
+void log_flush(void);
+void log_msg(int prio, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
 
 #define INFO(format, args...)						\
-	if (_log_to_syslog)						\
-		syslog(LOG_INFO, "" format "\n", ## args);		\
-	else								\
-		printf("" format "\n", ## args);
+	log_msg(LOG_INFO, "" format, ## args)
 
 #define ERROR(format, args...)						\
-	if (_log_to_syslog)						\
-		syslog(LOG_ERR, "%s: " format "\n", __func__,		\
-		       ## args);					\
-	else								\
-		fprintf(stderr, "%s: " format "\n", __func__,		\
-			## args);
+	log_msg(LOG_ERR, "%s: " format, __func__, ## args)
 
 #define PERROR(str, errnum)						\
-	if (_log_to_syslog)						\
-		syslog(LOG_ERR, "%s: %s: %s\n", __func__, str,		\
-		       strerror(errnum));				\
-	else								\
-		fprintf(stderr, "%s: %s: %s\n", __func__, str,		\
-			strerror(errnum));
+	log_msg(LOG_ERR, "%s: %s: %s", __func__, str, strerror(errnum))
 
+/* Longest command built, a few quoted paths */
+#define SHCMD_MAX			(4 * PATH_MAX)
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE		(1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE			(1 << 1)
+#endif
+
+int rename2(const char *from, const char *to, unsigned flags);
 int run_shcmd(const char *cmd);
+int run_prog(char *const argv[]);
+int copy_stream(int in, int out);
+void json_escape(char *buf, size_t size, const char *str);
 
 #endif /* _COMMON_H_ */
@@ -31,19 +31,96 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/inotify.h>
 #include <sys/param.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <libgen.h>
+#include <signal.h>
 
 #include "common.h"
+#include "sha256.h"
+#include "untar.h"
+#include "journal.h"
+#include "queue.h"
+#include "cache.h"
+#include "manifest.h"
+#include "throttle.h"
+#include "arena.h"
+#include "writer.h"
+#include "zip.h"
+#include "install.h"
+#include "treesync.h"
+#include "verify.h"
+#include "progress.h"
+#include "trace.h"
+#include "chunk.h"
 
 #define DEFAULT_WORKDIR			"/tmp/dupdate-XXXXXX"
+#define TARGET_WORKDIR_SUFFIX		".dupdate-XXXXXX"
 #define DEFAULT_CMDFILE			"run"
+#define DEFAULT_MANIFEST		"dupdate.manifest"
+#define DEFAULT_STAGEDIR		"/var/spool/dupdate"
+#define STAGE_MARKER			".dupdate-staged"
+#define ZIP_INDEX_FILE			".dupdate-zip-index"
+#define SPOOL_FILE			".dupdate-image.zip"
+
+/* Share of --memory-limit for each use */
+#define MEMORY_UNTAR_BUF_DIV		256
+#define MEMORY_UNTAR_BUF_MIN		(16 * 1024)
+#define MEMORY_UNTAR_BUF_MAX		(1024 * 1024)
+#define MEMORY_DECOMPRESSOR_DIV		2
+#define MEMORY_PER_JOB			(8 * 1024 * 1024)
+#define MEMORY_WRITER_DIV		16
+#define MEMORY_ARENA_SLACK		(64 * 1024)
+
+/* Not all libc/kernel headers define these */
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_SHIFT		13
+#define IOPRIO_PRIO_VALUE(class, data)	\
+	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS		1
+#define IOPRIO_CLASS_IDLE		3
+#endif
+#ifndef IOPRIO_CLASS_BE
+#define IOPRIO_CLASS_BE			2
+#endif
+
+enum dupdate_durability {
+	DUPDATE_DURABILITY_NONE,	/* Left to the kernel */
+	DUPDATE_DURABILITY_BATCHED,	/* One syncfs after extraction */
+	DUPDATE_DURABILITY_STRICT,	/* And fdatasync of each file */
+};
 
 struct dupdate_args {
 	char *workdir;		/* Working directory (mkdtemp template) */
+	char *target;		/* Where the command installs to */
+	char *install;		/* Tree to install the argument as */
+	char *rollback;		/* Installed tree to roll back */
+	char *sync;		/* Tree to sync the argument to */
 	char *tarcmd;		/* Command to execute in tar archives */
 	char *zipcmd;		/* Command to execute in zip archives*/
+	char *manifest;		/* Manifest of steps in tar archives */
+	int jobs;		/* Max. number of steps to run in parallel */
+	char *stagedir;		/* Directory holding staged updates */
+	char *queuedir;		/* Directory to queue images from */
+	char *cachedir;		/* Extraction cache directory */
+	char *chunkstore;	/* Chunk store directory */
+	unsigned long long cache_size;	/* Extraction cache size budget */
+	unsigned long long io_rate;	/* Max. bytes/s written, 0 is off */
+	unsigned long io_ops;	/* Max. file operations/s, 0 is off */
+	unsigned io_pressure;	/* Max. I/O stall percentage, 0 is off */
+	int ioprio;		/* I/O priority, -1 to leave unchanged */
+	char *cgroup;		/* cgroup v2 directory to run in */
+	unsigned io_weight;	/* io.weight of cgroup, 0 to leave */
+	unsigned long long memory_limit;	/* Memory budget, 0 is off */
+	enum writer_engine io_engine;	/* How small files are written */
+	enum dupdate_durability durability;	/* When data is synced */
+	unsigned long long stream_min;	/* Files to stream, 0 is none */
+	char *progress_socket;	/* Where to send progress events */
+	char *trace;		/* Where to append trace events */
 	int flags;		/* Configuration flags */
 };
 
@@ -51,6 +128,14 @@ struct dupdate_args {
 #define DUPDATE_FLAG_REMOVE_IMAGE	(1 << 1)
 #define DUPDATE_FLAG_REMOVE_WORKDIR	(1 << 2)
 #define DUPDATE_FLAG_COMPLETION		(1 << 3)
+#define DUPDATE_FLAG_STAGE		(1 << 4)
+#define DUPDATE_FLAG_COMMIT		(1 << 5)
+#define DUPDATE_FLAG_RESUME		(1 << 6)
+#define DUPDATE_FLAG_ZIP_STORED		(1 << 7)
+#define DUPDATE_FLAG_KEEP_OLD		(1 << 8)
+#define DUPDATE_FLAG_VERIFY_FOLLOW	(1 << 9)
+#define DUPDATE_FLAG_DROP_CACHE		(1 << 10)
+#define DUPDATE_FLAG_CHUNK_SEED		(1 << 11)
 
 static struct dupdate_args args;
 
@@ -60,29 +145,174 @@ enum dupdate_image_type {
 };
 
 static char *workdir;
+static int workdir_reused;	/* Left behind by an interrupted run */
 static char *image;		/* dupdate image file */
+static char *image_fullpath;
+static int image_fd = -1;	/* Image read as a stream, or -1 */
+static unsigned char image_head[UNTAR_HEAD_SIZE];	/* Read from image_fd */
+static size_t image_head_len;
+static unsigned char image_digest[SHA256_DIGEST_LEN];
+static int have_image_digest;
+static struct cache *cache;
 static enum dupdate_image_type image_type;
 static char *completion_file;
 static char *shcmd;
 static int shcmd_len;
 static const char *cwd;
 
+/*
+ * With --resume, the workdir is named after the image digest instead of
+ * being random, so that a restarted run finds the workdir (and journal) left
+ * behind by an interrupted one.
+ */
+static int get_image_digest(void)
+{
+	int err;
+
+	if (have_image_digest)
+		return 0;
+
+	/* Computed while the image arrived, if it was followed */
+	if (verify_lookup(image, image_digest) == 0) {
+		have_image_digest = 1;
+		return 0;
+	}
+
+	err = sha256_file(image, image_digest);
+	if (err)
+		return err;
+
+	have_image_digest = 1;
+	return 0;
+}
+
+/*
+ * Name the workdir by the full image digest, so only the same image resumes
+ * in it.  The journal in it is checked against the digest as well.
+ */
+static int resume_workdir(char *tmpdir)
+{
+	char hex[SHA256_HEX_LEN];
+	size_t len = strlen(tmpdir);
+	int err;
+
+	if (len < 6 || strcmp(tmpdir + len - 6, "XXXXXX") != 0) {
+		ERROR("invalid workdir template: %s", tmpdir);
+		return EINVAL;
+	}
+
+	err = get_image_digest();
+	if (err)
+		return err;
+
+	sha256_hex(image_digest, hex);
+	strcpy(tmpdir + len - 6, hex);
+
+	if (mkdir(tmpdir, S_IRWXU) == -1) {
+		if (errno != EEXIST) {
+			PERROR("mkdir", errno);
+			return errno;
+		}
+		INFO("reusing workdir %s", tmpdir);
+		workdir_reused = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Default workdir for a target DIR, as .<name>.dupdate-XXXXXX next to it,
+ * on the same filesystem but outside the tree installed to.
+ */
+static char *target_workdir(const char *target)
+{
+	size_t len = strlen(target), base;
+	char *workdir;
+
+	while (len > 1 && target[len - 1] == '/')
+		len--;
+	for (base = len ; base > 0 && target[base - 1] != '/' ; base--)
+		;
+
+	workdir = malloc(len + sizeof(TARGET_WORKDIR_SUFFIX) + 1);
+	if (!workdir)
+		return NULL;
+	sprintf(workdir, "%.*s.%.*s" TARGET_WORKDIR_SUFFIX, (int)base, target,
+		(int)(len - base), target + base);
+
+	return workdir;
+}
+
+/*
+ * Installing from a workdir on the filesystem of the target allows a
+ * rename() in place of a copy.
+ */
+static void check_target(void)
+{
+	struct stat st_workdir, st_target;
+
+	if (!args.target)
+		return;
+
+	if (stat(workdir, &st_workdir) == -1 ||
+	    stat(args.target, &st_target) == -1) {
+		PERROR(args.target, errno);
+		return;
+	}
+
+	if (st_workdir.st_dev != st_target.st_dev) {
+		INFO("workdir %s is not on the filesystem of %s", workdir,
+		     args.target);
+	}
+}
+
+/* Fail right away when the workdir cannot hold what is to be extracted */
+static int check_space(unsigned long long need)
+{
+	struct statvfs sv;
+	unsigned long long avail;
+
+	if (statvfs(workdir, &sv) == -1) {
+		PERROR("statvfs", errno);
+		return errno;
+	}
+
+	avail = (unsigned long long)sv.f_bavail * sv.f_frsize;
+	if (need > avail) {
+		ERROR("%s needs %llu bytes, but only %llu are available in %s",
+		      image, need, avail, workdir);
+		return ENOSPC;
+	}
+
+	return 0;
+}
+
 static int create_workdir(void)
 {
 	char *tmpdir;
+	int err;
 
-	tmpdir = strdup(args.workdir);
+	/* Room for the template to be replaced by the image digest */
+	tmpdir = malloc(strlen(args.workdir) + SHA256_HEX_LEN);
 	if (!tmpdir) {
-		PERROR("strdup", errno);
-		return errno;
+		PERROR("malloc", ENOMEM);
+		return ENOMEM;
 	}
+	strcpy(tmpdir, args.workdir);
 
-	if (!mkdtemp(tmpdir)) {
+	if (args.flags & DUPDATE_FLAG_RESUME) {
+		err = resume_workdir(tmpdir);
+		if (err) {
+			free(tmpdir);
+			return err;
+		}
+	} else if (!mkdtemp(tmpdir)) {
 		PERROR("mkdtemp", errno);
 		return errno;
 	}
 
 	workdir = tmpdir;
+	check_target();
 	return 0;
 }
 
@@ -110,7 +340,7 @@ static int remove_image(void)
 	int err;
 	struct stat st;
 
-	if (!(args.flags & DUPDATE_FLAG_REMOVE_IMAGE))
+	if (!(args.flags & DUPDATE_FLAG_REMOVE_IMAGE) || image_fd != -1)
 		return 0;
 
 	if (stat(image, &st) == -1) {
@@ -125,261 +355,1474 @@ static int remove_image(void)
 		PERROR("unlink", errno);
 		return errno;
 	}
+	verify_forget(image);
 
 	return 0;
 }
 
-static int process_zip_image(void)
+/*
+ * Make the extracted files durable, before the image they came from is
+ * removed or anything is run.
+ */
+static int sync_workdir(void)
 {
-	int err;
-	char *image_fullpath = NULL;
+	int fd, err = 0;
 
-	snprintf(shcmd, shcmd_len, "unzip -q -d \"%s\" \"%s\" \"%s\"",
-		 workdir, image, args.zipcmd);
-	if ((err = run_shcmd(shcmd))) {
-		PERROR(shcmd, err);
-		goto out;
-	}
+	if (args.durability == DUPDATE_DURABILITY_NONE)
+		return 0;
 
-	image_fullpath = realpath(image, NULL);
-	if (!image_fullpath) {
-		ERROR("could not find image file: %s", image);
-		err = ENOENT;
-		goto out;
+	fd = open(workdir, O_RDONLY|O_DIRECTORY);
+	if (fd == -1) {
+		PERROR("open", errno);
+		return errno;
 	}
 
-	err = chdir(workdir);
-	if (err == -1) {
-		PERROR("chdir", errno);
+	if (syncfs(fd) == -1) {
+		PERROR("syncfs", errno);
 		err = errno;
-		goto out;
 	}
+	close(fd);
 
-	err = chmod(args.zipcmd, S_IRUSR|S_IXUSR|S_IXGRP|S_IXOTH);
-	if (err == -1) {
-		PERROR("chmod", errno);
+	return err;
+}
+
+static int sync_dir_of(const char *path)
+{
+	char *copy;
+	int fd, err = 0;
+
+	copy = strdup(path);
+	if (!copy)
+		return ENOMEM;
+
+	fd = open(dirname(copy), O_RDONLY|O_DIRECTORY);
+	free(copy);
+	if (fd == -1) {
+		PERROR("open", errno);
+		return errno;
+	}
+
+	if (fsync(fd) == -1) {
+		PERROR("fsync", errno);
 		err = errno;
-		goto out;
 	}
+	close(fd);
 
-	snprintf(shcmd, shcmd_len, "\"./%s\" \"%s\"",
-		 args.zipcmd, image_fullpath);
-	if ((err = run_shcmd(shcmd))) {
-		PERROR(shcmd, err);
-		goto out;
+	return err;
+}
+
+/*
+ * Members stored without compression are extracted from the image by the
+ * kernel, or not at all: their offsets and lengths in the image are listed
+ * in the workdir, for the command to read straight from the image.
+ */
+static int extract_zip_stored(struct zip *z, int *cmd_done)
+{
+	struct zip_entry *e;
+	char path[PATH_MAX];
+	unsigned i;
+	int dirfd, err;
+
+	snprintf(path, sizeof(path), "%s/%s", workdir, ZIP_INDEX_FILE);
+	err = zip_write_index(z, path);
+	if (err)
+		return err;
+	setenv("DUPDATE_ZIP_INDEX", path, 1);
+
+	dirfd = open(workdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dirfd == -1) {
+		PERROR("open", errno);
+		return errno;
 	}
 
-out:
-	if (image_fullpath)
-		free(image_fullpath);
+	for (i = 0 ; i < z->num_entries && !err ; i++) {
+		e = &z->entries[i];
+		if (e->method != ZIP_METHOD_STORED || e->encrypted)
+			continue;
+		if (strcmp(e->name, args.zipcmd) == 0) {
+			err = zip_extract_stored(z, e, dirfd);
+			if (!err)
+				err = zip_check_crc(e, dirfd);
+			*cmd_done = !err;
+		} else if (args.flags & DUPDATE_FLAG_ZIP_STORED) {
+			err = zip_extract_stored(z, e, dirfd);
+		}
+	}
+
+	close(dirfd);
 	return err;
 }
 
-static int process_tar_image(void)
+static unsigned long long zip_extract_size(struct zip *z)
 {
-	int err;
+	struct zip_entry *e;
+	unsigned long long size = 0;
+	unsigned i;
+
+	for (i = 0 ; i < z->num_entries ; i++) {
+		e = &z->entries[i];
+		if (strcmp(e->name, args.zipcmd) == 0 ||
+		    ((args.flags & DUPDATE_FLAG_ZIP_STORED) &&
+		     e->method == ZIP_METHOD_STORED && !e->encrypted))
+			size += e->size;
+	}
 
-	snprintf(shcmd, shcmd_len, "tar -x -C \"%s\" -f \"%s\"",
-		 workdir, image);
-	if ((err = run_shcmd(shcmd))) {
-		PERROR(shcmd, err);
-		goto out;
+	return size;
+}
+
+/*
+ * The central directory of a zip file is at its end, so a zip image read as
+ * a stream is spooled to the workdir first.  It is removed with the workdir.
+ */
+static int spool_image(void)
+{
+	char *path;
+	int fd, err = 0;
+
+	path = malloc(strlen(workdir) + sizeof(SPOOL_FILE) + 1);
+	if (!path) {
+		PERROR("malloc", ENOMEM);
+		return ENOMEM;
 	}
+	sprintf(path, "%s/%s", workdir, SPOOL_FILE);
 
-	err = remove_image();
+	fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR|S_IWUSR);
+	if (fd == -1) {
+		PERROR("open", errno);
+		free(path);
+		return errno;
+	}
+
+	INFO("+ spool %s -> %s", image, path);
+	if (write(fd, image_head, image_head_len) != (ssize_t)image_head_len) {
+		PERROR("write", errno);
+		err = errno;
+	}
+	if (!err)
+		err = copy_stream(image_fd, fd);
+	if (close(fd) == -1 && !err) {
+		PERROR("close", errno);
+		err = errno;
+	}
 	if (err) {
-		PERROR("remove_image", err);
-		goto out;
+		free(path);
+		return err;
 	}
 
-	err = chdir(workdir);
+	free(image_fullpath);
+	image_fullpath = path;
+	return 0;
+}
+
+static int extract_zip_image(void)
+{
+	struct zip z;
+	int cmd_done = 0, err;
+
+	if (image_fd != -1) {
+		err = spool_image();
+		if (err)
+			return err;
+	}
+
+	/* Anything we can't handle ourselves is left to unzip */
+	if (zip_open(&z, image_fullpath) == 0) {
+		err = check_space(zip_extract_size(&z));
+		if (!err)
+			err = extract_zip_stored(&z, &cmd_done);
+		zip_close(&z);
+		if (err)
+			return err;
+	} else {
+		INFO("falling back to unzip");
+	}
+
+	if (!cmd_done) {
+		snprintf(shcmd, shcmd_len,
+			 "unzip -q -o -d \"%s\" \"%s\" \"%s\"",
+			 workdir, image_fullpath, args.zipcmd);
+		if ((err = run_shcmd(shcmd))) {
+			PERROR(shcmd, err);
+			return err;
+		}
+	}
+
+	snprintf(shcmd, shcmd_len, "%s/%s", workdir, args.zipcmd);
+	err = chmod(shcmd, S_IRUSR|S_IXUSR|S_IXGRP|S_IXOTH);
 	if (err == -1) {
-		PERROR("chdir", errno);
-		err = errno;
-		goto out;
+		PERROR("chmod", errno);
+		return errno;
 	}
 
-	snprintf(shcmd, shcmd_len, "\"./%s\"", args.tarcmd);
-	if ((err = run_shcmd(shcmd))) {
-		PERROR(shcmd, err);
-		goto out;
+	return sync_workdir();
+}
+
+static struct journal *journal;
+
+static size_t untar_buf_size(void)
+{
+	unsigned long long size = args.memory_limit / MEMORY_UNTAR_BUF_DIV;
+
+	if (size < MEMORY_UNTAR_BUF_MIN)
+		return MEMORY_UNTAR_BUF_MIN;
+	if (size > MEMORY_UNTAR_BUF_MAX)
+		return MEMORY_UNTAR_BUF_MAX;
+	return size;
+}
+
+static int member_done(struct untar_member *member, void *priv)
+{
+	int err;
+
+	if (journal) {
+		err = journal_add(member, journal);
+		if (err)
+			return err;
 	}
 
-out:
-	return err;
+	if (cache)
+		return cache_member(member, cache);
+
+	return 0;
 }
 
-static int init_completion_file(void)
+/*
+ * With --stream-min, the command is started as soon as the first file large
+ * enough to stream comes along, provided the command itself has been
+ * extracted by then.  It runs alongside the rest of the extraction, reading
+ * the streamed files from their FIFOs in archive order.
+ */
+static pid_t stream_pid;	/* Command started, -1 once it has exited */
+static int stream_status;
+
+static int stream_member(struct untar_member *member, void *priv)
 {
-	if (!(args.flags & DUPDATE_FLAG_COMPLETION))
+	char path[PATH_MAX];
+	pid_t pid;
+
+	if (stream_pid)
+		return stream_pid > 0;
+
+	/* A manifest runs its steps after extraction instead */
+	snprintf(path, sizeof(path), "%s/%s", workdir, args.manifest);
+	if (access(path, F_OK) == 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/%s", workdir, args.tarcmd);
+	if (access(path, X_OK) != 0)
 		return 0;
 
-	/* Allocate room for string "image.success" and "image.fail" */
-	completion_file = malloc(strlen(image) + 9);
-	if (completion_file == NULL)
-		return -ENOMEM;
+	snprintf(shcmd, shcmd_len, "\"./%s\"", args.tarcmd);
+	INFO("+ %s (streaming %s)", shcmd, member->name);
+	fflush(NULL);
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork", errno);
+		return 0;
+	}
 
-	return 0;
+	if (pid == 0) {
+		signal(SIGPIPE, SIG_DFL);
+		if (chdir(workdir) == -1)
+			_exit(127);
+		setenv("DUPDATE_STREAM", "1", 1);
+		execl("/bin/sh", "sh", "-c", shcmd, NULL);
+		_exit(127);
+	}
+
+	/* A command not reading all of a stream fails the write instead */
+	signal(SIGPIPE, SIG_IGN);
+	stream_pid = pid;
+
+	return 1;
 }
 
-static int remove_old_completion_files(void)
+static int stream_alive(void *priv)
 {
-	if (!(args.flags & DUPDATE_FLAG_COMPLETION))
+	if (stream_pid > 0 &&
+	    waitpid(stream_pid, &stream_status, WNOHANG) == stream_pid)
+		stream_pid = -1;
+
+	return stream_pid > 0;
+}
+
+/* Wait for a command started while extracting, killing it on failure */
+static int finish_stream(int failed)
+{
+	int err = 0;
+
+	if (!stream_pid)
 		return 0;
 
-	/* Cleanup existing completion files */
-	sprintf(completion_file, "%s.success", image);
-	unlink(completion_file);
-	sprintf(completion_file, "%s.fail", image);
-	unlink(completion_file);
+	if (stream_pid > 0) {
+		if (failed)
+			kill(stream_pid, SIGTERM);
+		if (waitpid(stream_pid, &stream_status, 0) == -1) {
+			PERROR("waitpid", errno);
+			err = errno;
+		}
+	}
+	signal(SIGPIPE, SIG_DFL);
 
-	return 0;
+	if (err || failed)
+		return err;
+
+	if (WIFSIGNALED(stream_status)) {
+		ERROR("%s terminated by signal %d", args.tarcmd,
+		      WTERMSIG(stream_status));
+		return EINTR;
+	}
+	if (WEXITSTATUS(stream_status) == 127)
+		return ENOENT;
+	return WEXITSTATUS(stream_status);
 }
 
-static void write_completion_file(int err)
+static unsigned long long extract_total;	/* Size of tar stream, or 0 */
+
+static void extract_progress(unsigned long long pos, void *priv)
 {
-	if (!(args.flags & DUPDATE_FLAG_COMPLETION))
-		return;
+	progress_bytes(pos, extract_total);
+}
 
+static int extract_tar_image(void)
+{
+	struct untar u;
+	struct untar_ops ops = {
+		.done = member_done,
+		.stream = stream_member,
+		.stream_alive = stream_alive,
+		.progress = extract_progress,
+	};
+	unsigned long long size;
+	int err, close_err;
+
+	extract_total = 0;
+	if (image_fd == -1) {
+		err = untar_size(image, &size);
+		if (err && err != ENODATA)
+			return err;
+		if (!err)
+			extract_total = size;
+	}
+
+	/* Streamed files take up no space, and a resumed extraction needs
+	 * less than all of it */
+	if (extract_total && !args.stream_min && !workdir_reused) {
+		err = check_space(extract_total);
+		if (err)
+			return err;
+	}
+
+	memset(&u, 0, sizeof(u));
+	u.engine = args.io_engine;
+	u.stream_min = args.stream_min;
+	if (args.durability == DUPDATE_DURABILITY_BATCHED)
+		u.flags |= UNTAR_FLAG_WRITEBACK;
+	else if (args.durability == DUPDATE_DURABILITY_STRICT)
+		u.flags |= UNTAR_FLAG_DATASYNC;
+	if (args.flags & DUPDATE_FLAG_DROP_CACHE)
+		u.flags |= UNTAR_FLAG_DROP_CACHE;
+	if (args.memory_limit) {
+		u.buf_size = untar_buf_size();
+		u.mem_limit = args.memory_limit / MEMORY_DECOMPRESSOR_DIV;
+		u.writer_mem = args.memory_limit / MEMORY_WRITER_DIV;
+	}
+
+	if (image_fd != -1) {
+		err = untar_open_fd(&u, image_fd, image_head, image_head_len,
+				    workdir);
+	} else {
+		err = untar_open(&u, image, workdir);
+	}
 	if (err)
-		sprintf(completion_file, "%s.fail", image);
-	else
-		sprintf(completion_file, "%s.success", image);
-	open(completion_file, O_WRONLY|O_CREAT,
-	     S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+		goto out;
+
+	u.ops = &ops;
+	if (cache)
+		u.flags |= UNTAR_FLAG_HASH;
+
+	if (args.flags & DUPDATE_FLAG_RESUME) {
+		err = journal_open(&journal, workdir, image_digest);
+		if (err)
+			goto out;
+		u.resume = journal_resume(journal);
+		u.flags |= UNTAR_FLAG_HASH;
+	}
+
+	INFO("+ untar %s -> %s", image, workdir);
+	err = untar_extract(&u);
+
+	if (!err && journal)
+		err = journal_commit(journal);
+	if (!err)
+		err = sync_workdir();
+
+out:
+	close_err = untar_close(&u);
+	if (!err)
+		err = close_err;
+	if (journal) {
+		journal_close(journal);
+		journal = NULL;
+	}
+	if (err) {
+		ERROR("extraction of %s failed", image);
+		finish_stream(1);
+		return err;
+	}
+
+	err = remove_image();
+	if (err) {
+		PERROR("remove_image", err);
+		return err;
+	}
+
+	return 0;
 }
 
-static int guess_image_type(void)
+static int extract_image_type(void)
+{
+	switch (image_type) {
+	case DUPDATE_IMAGE_TYPE_TAR:
+		return extract_tar_image();
+	case DUPDATE_IMAGE_TYPE_ZIP:
+		return extract_zip_image();
+	default:
+		ERROR("Unexpected image_type");
+		return -EINVAL;
+	}
+}
+
+/* Files carried as chunk indexes are assembled from the chunk store */
+static int assemble_chunks(void)
+{
+	struct chunk_store *store;
+	int err;
+
+	err = chunk_store_open(&store, args.chunkstore);
+	if (err)
+		return err;
+
+	err = chunk_import(store, workdir);
+	if (!err)
+		err = chunk_assemble(store, workdir);
+	if (!err)
+		err = sync_workdir();
+
+	chunk_store_close(store);
+	return err;
+}
+
+static int extract_image(void)
+{
+	int err;
+
+	progress_phase("extract");
+
+	/* Zip images only have the command extracted, so only tar images
+	 * are worth caching */
+	if (!args.cachedir || image_type != DUPDATE_IMAGE_TYPE_TAR) {
+		err = extract_image_type();
+		goto chunks;
+	}
+
+	err = get_image_digest();
+	if (err)
+		return err;
+
+	err = cache_open(&cache, args.cachedir, args.cache_size);
+	if (err)
+		return err;
+
+	err = cache_lookup(cache, image_digest, workdir);
+	if (err == ENOENT) {
+		err = extract_image_type();
+		/* The workdir is complete, whether cached or not */
+		if (!err && cache_store(cache, image_digest, workdir))
+			ERROR("continuing without caching %s", image);
+	} else if (!err) {
+		err = sync_workdir();
+		if (!err)
+			err = remove_image();
+	}
+
+	cache_close(cache);
+	cache = NULL;
+
+chunks:
+	if (!err && args.chunkstore && image_type == DUPDATE_IMAGE_TYPE_TAR)
+		err = assemble_chunks();
+
+	return err;
+}
+
+static int run_image(void)
+{
+	int err;
+
+	progress_phase("run");
+
+	err = chdir(workdir);
+	if (err == -1) {
+		PERROR("chdir", errno);
+		return errno;
+	}
+
+	switch (image_type) {
+	case DUPDATE_IMAGE_TYPE_TAR:
+		/* Already running since extraction */
+		if (stream_pid) {
+			err = finish_stream(0);
+			stream_pid = 0;
+			if (err) {
+				PERROR(args.tarcmd, err);
+			}
+			return err;
+		}
+		/* Manifest of steps replaces the single command */
+		if (access(args.manifest, F_OK) == 0)
+			return manifest_run(args.manifest, args.jobs);
+		snprintf(shcmd, shcmd_len, "\"./%s\"", args.tarcmd);
+		break;
+	case DUPDATE_IMAGE_TYPE_ZIP:
+		snprintf(shcmd, shcmd_len, "\"./%s\" \"%s\"",
+			 args.zipcmd, image_fullpath);
+		break;
+	default:
+		ERROR("Unexpected image_type");
+		return -EINVAL;
+	}
+
+	if ((err = run_shcmd(shcmd))) {
+		PERROR(shcmd, err);
+		return err;
+	}
+
+	return 0;
+}
+
+static int init_completion_file(void)
+{
+	if (!(args.flags & DUPDATE_FLAG_COMPLETION))
+		return 0;
+
+	/* Allocate room for string "image.success" and "image.fail" */
+	free(completion_file);
+	completion_file = malloc(strlen(image) + 9);
+	if (completion_file == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int remove_old_completion_files(void)
+{
+	if (!(args.flags & DUPDATE_FLAG_COMPLETION))
+		return 0;
+
+	/* Cleanup existing completion files */
+	sprintf(completion_file, "%s.success", image);
+	unlink(completion_file);
+	sprintf(completion_file, "%s.fail", image);
+	unlink(completion_file);
+
+	return 0;
+}
+
+static void write_completion_file(int err)
+{
+	int fd;
+
+	if (!(args.flags & DUPDATE_FLAG_COMPLETION))
+		return;
+
+	if (err)
+		sprintf(completion_file, "%s.fail", image);
+	else
+		sprintf(completion_file, "%s.success", image);
+	fd = open(completion_file, O_WRONLY|O_CREAT,
+		  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+	if (fd == -1) {
+		PERROR(completion_file, errno);
+		return;
+	}
+
+	/* The result must not be lost once it has been reported */
+	if (fsync(fd) == -1) {
+		PERROR("fsync", errno);
+	}
+	close(fd);
+	sync_dir_of(completion_file);
+}
+
+/*
+ * A stream can't be read twice, so what is read of it to tell its type is
+ * kept and passed on ahead of the rest.
+ */
+static int read_image_head(void)
+{
+	ssize_t n;
+
+	while (image_head_len < sizeof(image_head)) {
+		n = read(image_fd, image_head + image_head_len,
+			 sizeof(image_head) - image_head_len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("read", errno);
+			return errno;
+		}
+		if (n == 0)
+			break;
+		image_head_len += n;
+	}
+
+	if (image_head_len < 4) {
+		ERROR("partial archive head read: %zu", image_head_len);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int guess_image_type(void)
+{
+	int fd, ret;
+	char buf[4];
+
+	if (image_fd != -1) {
+		ret = read_image_head();
+		if (ret)
+			return ret;
+		memcpy(buf, image_head, sizeof(buf));
+		goto guess;
+	}
+
+	fd = open(image, O_RDONLY);
+	if (fd == -1) {
+		PERROR("open", errno);
+		return 1;
+	}
+
+	ret = read(fd, buf, sizeof(buf));
+	if (ret != sizeof(buf)) {
+		if (ret == -1) {
+			PERROR("read", errno);
+		}
+		else {
+			ERROR("partial archive head read: %d", ret);
+		}
+		if (close(fd) == -1) {
+			PERROR("close", errno);
+		}
+		return 1;
+	}
+
+	if (close(fd) == -1) {
+		PERROR("close", errno);
+	}
+
+guess:
+	if (buf[0]==0x50 && buf[1]==0x4b && buf[2]==0x03 && buf[3]==0x04)
+		image_type = DUPDATE_IMAGE_TYPE_ZIP;
+	else
+		/* Tar-balls does not have a single header to look for.
+		 * Compressed tarballs are simply compressed files, which
+		 * happens to be a tar file, so you will fx. not be able to
+		 * differentiate between a tar.gz and any other gzip
+		 * compressed file without actually decompressing the file,
+		 * and looking of the header of the decompressed file.
+		 *
+		 * So we simply assume that anything that is not a zip file is
+		 * a tar-ball, and let the tar command (try to) handle it. */
+		image_type = DUPDATE_IMAGE_TYPE_TAR;
+
+	return 0;
+}
+
+static int prepare_image(void)
+{
+	int err;
+
+	progress_phase("prepare");
+
+	if (image_fd != -1)
+		return guess_image_type();
+
+	err = verify_lookup(image, image_digest);
+	if (err == EBADMSG) {
+		ERROR("%s failed verification while it arrived", image);
+		return err;
+	}
+	if (!err)
+		have_image_digest = 1;
+
+	err = guess_image_type();
+	if (err)
+		return err;
+
+	image_fullpath = realpath(image, NULL);
+	if (!image_fullpath) {
+		ERROR("could not find image file: %s", image);
+		return ENOENT;
+	}
+
+	return 0;
+}
+
+/* Run one phase of the update as a span of the trace */
+static int traced(const char *name, int (*phase)(void))
+{
+	unsigned long long start = trace_now();
+	int err;
+
+	err = phase();
+	trace_span(name, start, image, err);
+
+	return err;
+}
+
+static int process_image(void)
+{
+	int err;
+
+	err = remove_old_completion_files();
+	if (err)
+		goto early_out;
+
+	err = create_workdir();
+	if (err) {
+		ERROR("workdir creation failed");
+		goto create_workdir_failed;
+	}
+
+	err = traced("prepare", prepare_image);
+	if (err)
+		goto out;
+
+	err = traced("extract", extract_image);
+	if (err)
+		goto out;
+
+	err = traced("run", run_image);
+
+	chdir(cwd);
+
+out:
+	remove_workdir();
+create_workdir_failed:
+	write_completion_file(err);
+early_out:
+	if (err) {
+		INFO("FAILURE: %s", image);
+	} else {
+		INFO("SUCCESS: %s", image);
+	}
+
+	remove_image();
+
+	return err;
+}
+
+/*
+ * Staged updates are kept in a directory named after the image file, so that
+ * a later --commit of the same image can find it again.
+ */
+static char *staged_path(void)
+{
+	const char *name;
+	char *path;
+
+	name = strrchr(image, '/');
+	name = name ? name + 1 : image;
+
+	path = malloc(strlen(args.stagedir) + strlen(name) + 2);
+	if (!path) {
+		PERROR("malloc", ENOMEM);
+		return NULL;
+	}
+	sprintf(path, "%s/%s", args.stagedir, name);
+
+	return path;
+}
+
+static void set_ioprio(int ioprio)
+{
+	/* Inherited by tar, unzip and the commands run, so they don't
+	 * compete with the foreground I/O */
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) == -1) {
+		PERROR("ioprio_set", errno);
+	}
+}
+
+static int write_stage_marker(void)
+{
+	FILE *f;
+
+	snprintf(shcmd, shcmd_len, "%s/%s", workdir, STAGE_MARKER);
+	f = fopen(shcmd, "w");
+	if (!f) {
+		PERROR("fopen", errno);
+		return errno;
+	}
+
+	fprintf(f, "%s\n%s\n",
+		image_type == DUPDATE_IMAGE_TYPE_ZIP ? "zip" : "tar",
+		image_fullpath);
+
+	if (fsync(fileno(f)) == -1 || fclose(f) == EOF) {
+		PERROR("fclose", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+static int read_stage_marker(void)
+{
+	FILE *f;
+	char type[4];
+	int err = 0;
+
+	snprintf(shcmd, shcmd_len, "%s/%s", workdir, STAGE_MARKER);
+	f = fopen(shcmd, "r");
+	if (!f) {
+		ERROR("no staged update found in %s", workdir);
+		return ENOENT;
+	}
+
+	image_fullpath = malloc(PATH_MAX);
+	if (!image_fullpath) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (fscanf(f, "%3s\n%4095[^\n]", type, image_fullpath) != 2) {
+		ERROR("invalid stage marker in %s", workdir);
+		err = EINVAL;
+		goto out;
+	}
+
+	if (strcmp(type, "zip") == 0)
+		image_type = DUPDATE_IMAGE_TYPE_ZIP;
+	else
+		image_type = DUPDATE_IMAGE_TYPE_TAR;
+
+out:
+	fclose(f);
+	return err;
+}
+
+/*
+ * Swap the new tree into place, replacing any previously staged update of
+ * the same image, which is only removed afterwards.  At any point, the
+ * staging directory holds either the old or the new tree.
+ */
+static int publish_stagedir(char *path)
+{
+	int exists, err = 0;
+
+	exists = access(path, F_OK) == 0;
+	if (rename2(workdir, path, exists ? RENAME_EXCHANGE :
+		    RENAME_NOREPLACE) == -1) {
+		PERROR("renameat2", errno);
+		return errno;
+	}
+
+	if (args.durability != DUPDATE_DURABILITY_NONE)
+		err = sync_dir_of(path);
+
+	/* The old tree is where the new one was extracted */
+	if (exists) {
+		snprintf(shcmd, shcmd_len, "rm -rf \"%s\"", workdir);
+		if (run_shcmd(shcmd))
+			ERROR("failed to remove old %s", workdir);
+	}
+
+	free(workdir);
+	workdir = path;
+
+	return err;
+}
+
+/*
+ * Extract the image into the staging directory, without running anything.
+ * Extraction is done into a temporary directory next to the final staging
+ * directory and renamed into place when complete, so --commit never sees a
+ * half-extracted tree.
+ */
+static int stage_image(void)
+{
+	char *path = NULL;
+	int err;
+
+	err = remove_old_completion_files();
+	if (err)
+		goto early_out;
+
+	path = staged_path();
+	if (!path) {
+		err = ENOMEM;
+		goto failed;
+	}
+
+	if (mkdir(args.stagedir, S_IRWXU) == -1 && errno != EEXIST) {
+		PERROR("mkdir", errno);
+		err = errno;
+		goto failed;
+	}
+
+	args.workdir = malloc(strlen(path) + 9);
+	if (!args.workdir) {
+		err = ENOMEM;
+		goto failed;
+	}
+	sprintf(args.workdir, "%s.XXXXXX", path);
+
+	err = create_workdir();
+	if (err) {
+		ERROR("workdir creation failed");
+		goto failed;
+	}
+
+	if (args.ioprio == -1)
+		set_ioprio(IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+
+	err = traced("prepare", prepare_image);
+	if (err)
+		goto out;
+
+	err = traced("extract", extract_image);
+	if (err)
+		goto out;
+
+	err = write_stage_marker();
+	if (err)
+		goto out;
+
+	err = publish_stagedir(path);
+
+out:
+	if (err) {
+		chdir(cwd);
+		remove_workdir();
+	}
+failed:
+	/* Success is only reported when the staged update is committed */
+	if (err) {
+		write_completion_file(err);
+		if (path != workdir)
+			free(path);
+	}
+early_out:
+	if (err) {
+		INFO("STAGING FAILURE: %s", image);
+	} else {
+		INFO("STAGED: %s", image);
+	}
+
+	/* Zip images are needed again by the command when committing */
+	if (err || image_type != DUPDATE_IMAGE_TYPE_ZIP)
+		remove_image();
+
+	return err;
+}
+
+/*
+ * Run the install command of a previously staged image.
+ */
+static int commit_image(void)
+{
+	int err;
+
+	err = remove_old_completion_files();
+	if (err)
+		goto early_out;
+
+	workdir = staged_path();
+	if (!workdir) {
+		err = ENOMEM;
+		goto failed;
+	}
+
+	err = read_stage_marker();
+	if (err)
+		goto failed;
+
+	err = traced("run", run_image);
+
+	chdir(cwd);
+
+	remove_workdir();
+failed:
+	write_completion_file(err);
+early_out:
+	if (err) {
+		INFO("FAILURE: %s", image);
+	} else {
+		INFO("SUCCESS: %s", image);
+	}
+
+	remove_image();
+
+	return err;
+}
+
+static int seed_chunks(void)
+{
+	struct chunk_store *store;
+	int err;
+
+	err = chunk_store_open(&store, args.chunkstore);
+	if (err)
+		return err;
+
+	err = chunk_seed(store, image);
+
+	chunk_store_close(store);
+	return err;
+}
+
+static int get_sysconf(void)
+{
+	shcmd_len = sysconf(_SC_ARG_MAX);
+	if (shcmd_len == -1) {
+		PERROR("sysconf", errno);
+		return errno;
+	}
+
+	if (shcmd_len > SHCMD_MAX)
+		shcmd_len = SHCMD_MAX;
+
+	shcmd = arena_alloc(shcmd_len);
+	if (!shcmd) {
+		PERROR("arena_alloc", ENOMEM);
+		return ENOMEM;
+	}
+
+	cwd = get_current_dir_name();
+
+	return 0;
+}
+
+static void report_memory(void)
+{
+	struct rusage self, children;
+
+	if (getrusage(RUSAGE_SELF, &self) == -1 ||
+	    getrusage(RUSAGE_CHILDREN, &children) == -1) {
+		PERROR("getrusage", errno);
+		return;
+	}
+
+	INFO("peak memory: %ld kB, commands %ld kB, arena %zu kB used",
+	     self.ru_maxrss, children.ru_maxrss, arena_used() / 1024);
+	if ((unsigned long long)self.ru_maxrss * 1024 > args.memory_limit) {
+		ERROR("memory limit of %llu kB exceeded",
+		      args.memory_limit / 1024);
+	}
+}
+
+/*
+ * Fit buffers and parallelism within --memory-limit, and allocate what
+ * dupdate itself needs up front.
+ */
+static int setup_memory(void)
+{
+	size_t writer_mem;
+	int max_jobs;
+
+	if (!args.memory_limit)
+		return 0;
+
+	max_jobs = args.memory_limit / MEMORY_PER_JOB;
+	if (max_jobs < 1)
+		max_jobs = 1;
+	if (args.jobs > max_jobs)
+		args.jobs = max_jobs;
+
+	/* The writer needs a few whole buffers, or it is not worth having */
+	writer_mem = args.memory_limit / MEMORY_WRITER_DIV;
+	if (args.io_engine != WRITER_ENGINE_SYNC &&
+	    writer_mem < writer_min_mem()) {
+		INFO("memory limit too low for background writes");
+		args.io_engine = WRITER_ENGINE_SYNC;
+	}
+	if (args.io_engine == WRITER_ENGINE_SYNC)
+		writer_mem = 0;
+
+	return arena_init(SHCMD_MAX + untar_buf_size() + writer_mem +
+			  MEMORY_ARENA_SLACK);
+}
+
+/* Look up "<key> <value>" or "<key>: <value> kB" in a stats file */
+static int read_stat(const char *path, const char *key,
+		     unsigned long long *value)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t size = 0, len = strlen(key);
+	int err = ENOENT;
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno;
+
+	while (getline(&line, &size, f) != -1) {
+		if (strncmp(line, key, len) == 0 &&
+		    (line[len] == ' ' || line[len] == ':')) {
+			*value = strtoull(line + len + 1, NULL, 10);
+			err = 0;
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	return err;
+}
+
+/*
+ * Page cache taken up over an update, to tell how much of the working set
+ * of everything else it pushed out.  In a cgroup, the file pages charged to
+ * it are dupdate's own footprint.
+ */
+static unsigned long long pagecache_before;
+
+static void report_pagecache(void)
+{
+	unsigned long long after, file;
+
+	if (read_stat("/proc/meminfo", "Cached", &after))
+		return;
+
+	if (args.cgroup) {
+		snprintf(shcmd, shcmd_len, "%s/memory.stat", args.cgroup);
+		if (read_stat(shcmd, "file", &file) == 0) {
+			INFO("page cache: %llu kB before, %llu kB after, "
+			     "%llu kB in cgroup", pagecache_before, after,
+			     file / 1024);
+			return;
+		}
+	}
+
+	INFO("page cache: %llu kB before, %llu kB after", pagecache_before,
+	     after);
+}
+
+static int handle_image(void)
+{
+	unsigned long long start;
+	int err;
+
+	progress_begin(image);
+	trace_flow(0);
+	start = trace_now();
+
+	read_stat("/proc/meminfo", "Cached", &pagecache_before);
+
+	if (args.flags & DUPDATE_FLAG_STAGE)
+		err = stage_image();
+	else if (args.flags & DUPDATE_FLAG_COMMIT)
+		err = commit_image();
+	else
+		err = process_image();
+
+	progress_result(err);
+	trace_span("dupdate", start, image, err);
+	throttle_report();
+	report_pagecache();
+	if (args.memory_limit)
+		report_memory();
+
+	return err;
+}
+
+static int queue_process(const char *path)
+{
+	image = strdup(path);
+	if (!image || init_completion_file())
+		return ENOMEM;
+
+	return handle_image();
+}
+
+static void queue_cancel(const char *path, const char *reason)
+{
+	free(image);
+	image = strdup(path);
+	if (!image || init_completion_file())
+		return;
+
+	remove_old_completion_files();
+	write_completion_file(ECANCELED);
+	progress_begin(image);
+	progress_result(ECANCELED);
+	remove_image();
+}
+
+static const struct queue_ops queue_ops = {
+	.process = queue_process,
+	.cancel = queue_cancel,
+};
+
+static int write_cgroup_file(const char *name, const char *value)
 {
-	int fd, ret;
-	char buf[4];
-
-	fd = open(image, O_RDONLY);
-	if (fd == -1) {
-		PERROR("open", errno);
-		return 1;
-	}
+	FILE *f;
 
-	ret = read(fd, buf, sizeof(buf));
-	if (ret != sizeof(buf)) {
-		if (ret == -1) {
-			PERROR("read", errno);
-		}
-		else {
-			ERROR("partial archive head read: %d", ret);
-		}
-		if (close(fd) == -1) {
-			PERROR("close", errno);
-		}
-		return 1;
+	snprintf(shcmd, shcmd_len, "%s/%s", args.cgroup, name);
+	f = fopen(shcmd, "w");
+	if (!f) {
+		PERROR(shcmd, errno);
+		return errno;
 	}
 
-	if (close(fd) == -1) {
-		PERROR("close", errno);
+	if (fputs(value, f) == EOF || fclose(f) == EOF) {
+		PERROR(shcmd, errno);
+		return errno;
 	}
 
-	if (buf[0]==0x50 && buf[1]==0x4b && buf[2]==0x03 && buf[3]==0x04)
-		image_type = DUPDATE_IMAGE_TYPE_ZIP;
-	else
-		/* Tar-balls does not have a single header to look for.
-		 * Compressed tarballs are simply compressed files, which
-		 * happens to be a tar file, so you will fx. not be able to
-		 * differentiate between a tar.gz and any other gzip
-		 * compressed file without actually decompressing the file,
-		 * and looking of the header of the decompressed file.
-		 *
-		 * So we simply assume that anything that is not a zip file is
-		 * a tar-ball, and let the tar command (try to) handle it. */
-		image_type = DUPDATE_IMAGE_TYPE_TAR;
-
 	return 0;
 }
 
-static int process_image(void)
+/*
+ * Move dupdate, and thereby everything it runs, into a cgroup, so the
+ * I/O controller can weigh it against the foreground workload.
+ */
+static int join_cgroup(void)
 {
+	char value[32];
 	int err;
 
-	err = remove_old_completion_files();
-	if (err)
-		goto early_out;
-
-	err = create_workdir();
-	if (err) {
-		ERROR("workdir creation failed");
-		goto create_workdir_failed;
+	if (mkdir(args.cgroup, 0755) == -1 && errno != EEXIST) {
+		PERROR("mkdir", errno);
+		return errno;
 	}
 
-	err = guess_image_type();
-	if (err)
-		goto out;
+	if (args.io_weight) {
+		sprintf(value, "default %u", args.io_weight);
+		err = write_cgroup_file("io.weight", value);
+		if (err)
+			return err;
+	}
 
-	switch (image_type) {
-	case DUPDATE_IMAGE_TYPE_TAR:
-		err = process_tar_image();
-		break;
-	case DUPDATE_IMAGE_TYPE_ZIP:
-		err = process_zip_image();
-		break;
-	default:
-		ERROR("Unexpected image_type");
-		err = -EINVAL;
-		goto out;
+	/* Reclaim, rather than OOM-kill, beyond the budget */
+	if (args.memory_limit) {
+		sprintf(value, "%llu", args.memory_limit);
+		err = write_cgroup_file("memory.high", value);
+		if (err)
+			return err;
 	}
 
-	chdir(cwd);
+	sprintf(value, "%d", getpid());
+	return write_cgroup_file("cgroup.procs", value);
+}
 
-out:
-	remove_workdir();
-create_workdir_failed:
-	write_completion_file(err);
-early_out:
-	if (err) {
-		INFO("FAILURE: %s", image);
-	} else {
-		INFO("SUCCESS: %s", image);
+static int setup_io(void)
+{
+	int err;
+
+	if (args.cgroup) {
+		err = join_cgroup();
+		if (err)
+			return err;
 	}
 
-	remove_image();
+	if (args.ioprio != -1)
+		set_ioprio(args.ioprio);
 
-	return err;
+	return throttle_init(args.io_rate, args.io_ops, args.io_pressure);
 }
 
-static int get_sysconf(void)
+static int parse_ioprio(const char *str)
 {
-	shcmd_len = sysconf(_SC_ARG_MAX);
-	if (shcmd_len == -1) {
-		PERROR("sysconf", errno);
-		return errno;
+	char *end;
+	long level = 4;
+
+	if (strncmp(str, "idle", 4) == 0 && !str[4])
+		return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+
+	if (strncmp(str, "be", 2) != 0 || (str[2] && str[2] != ':'))
+		return -1;
+	if (str[2]) {
+		level = strtol(str + 3, &end, 10);
+		if (*end || end == str + 3 || level < 0 || level > 7)
+			return -1;
 	}
 
-	shcmd = malloc(shcmd_len);
-	if (!shcmd) {
-		PERROR("malloc", ENOMEM);
-		return ENOMEM;
-	}
+	return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level);
+}
 
-	cwd = get_current_dir_name();
+static int parse_io_engine(const char *str)
+{
+	if (strcmp(str, "sync") == 0)
+		args.io_engine = WRITER_ENGINE_SYNC;
+	else if (strcmp(str, "io_uring") == 0)
+		args.io_engine = WRITER_ENGINE_IO_URING;
+	else if (strcmp(str, "threads") == 0)
+		args.io_engine = WRITER_ENGINE_THREADS;
+	else
+		return EINVAL;
+
+	return 0;
+}
+
+static int parse_durability(const char *str)
+{
+	if (strcmp(str, "none") == 0)
+		args.durability = DUPDATE_DURABILITY_NONE;
+	else if (strcmp(str, "batched") == 0)
+		args.durability = DUPDATE_DURABILITY_BATCHED;
+	else if (strcmp(str, "strict") == 0)
+		args.durability = DUPDATE_DURABILITY_STRICT;
+	else
+		return EINVAL;
 
 	return 0;
 }
 
 static const char *usage  = "\
-Usage: %s [OPTIONS] <FILE>\n\n\
+Usage: %s [OPTIONS] <FILE>\n\
+       %s [OPTIONS] --queue=<DIR>\n\n\
 Arguments:\n\
-  <IMAGE>               Process dupdate IMAGE file\n\
+  <IMAGE>               Process dupdate IMAGE file, or - to read it from\n\
+			standard input\n\
 Options:\n\
   -d, --workdir=<TEMPLATE>  Create temporary directory based on TEMPLATE and\n\
 			use it as working directory \n\
 			[default: /tmp/dupdate-XXXXXX]\n\
+  --target=<DIR>        Directory the command installs to, passed to it as\n\
+			$DUPDATE_TARGET.  Unless given a --workdir, the\n\
+			workdir is created next to DIR, as\n\
+			.<name>.dupdate-XXXXXX, so that files can be\n\
+			renamed into place instead of copied\n\
   -x, --tarcmd=<FILE>   FILE in tar archives to execute [default: run]\n\
   -z, --zipcmd=<FILE>   FILE in zip archives to execute [default: run]\n\
+  --manifest=<FILE>     Manifest of steps in tar archives, to run instead\n\
+			of tarcmd when present [default: dupdate.manifest]\n\
+  --jobs=<N>            Number of manifest steps to run in parallel\n\
+			[default: number of CPUs]\n\
   -l, --syslog          Output syslog instead of stdout/stderr\n\
   -R, --no-remove       Don't remove image after unpacking\n\
   -C, --no-cleanup      Don't remove unpacked files when done\n\
   -c, --completion      Create completion file when done\n\
+  --stage               Only extract IMAGE to staging directory, with idle\n\
+			I/O priority\n\
+  --commit              Run command of previously staged IMAGE\n\
+  --stagedir=<DIR>      Directory for staged updates\n\
+			[default: /var/spool/dupdate]\n\
+  --resume              Journal extraction progress, and resume an\n\
+			interrupted extraction of the same image\n\
+  --cache=<DIR>         Keep extracted images in DIR, and reuse them when\n\
+			the same image is processed again.  Files are\n\
+			reflinked from DIR if supported, and copied\n\
+			otherwise\n\
+  --cache-size=<SIZE>   Size budget of cache [default: unlimited]\n\
+  --chunk-store=<DIR>   Assemble files of tar images replaced by an index\n\
+			of content-defined chunks (<FILE>.chunks) from\n\
+			the chunks in DIR, after adding those carried in\n\
+			the image (.dupdate-chunks/)\n\
+  --chunk-seed          Instead of processing an image, add the chunks of\n\
+			the file, block device or directory given as\n\
+			argument to --chunk-store\n\
+  --io-rate=<SIZE>      Limit extraction to writing SIZE bytes per second\n\
+  --io-ops=<N>          Limit extraction to creating N files per second\n\
+  --io-pressure=<PCT>   Slow down extraction while tasks are stalled on\n\
+			I/O more than PCT percent of the time, as reported\n\
+			in /proc/pressure/io\n\
+  --ionice=<CLASS>      I/O priority of dupdate and the commands it runs,\n\
+			either idle or be[:<LEVEL>]\n\
+  --durability=<LEVEL>  Sync extracted files before removing the image and\n\
+			running it: none, batched (writeback started per\n\
+			file, one syncfs at the end) or strict (fdatasync\n\
+			of each file, overlapped with extraction)\n\
+			[default: none]\n\
+  --pagecache=<MODE>    What tar extraction leaves in the page cache: keep\n\
+			(the image and files, as with any other I/O) or\n\
+			drop (each once read or written back, so the\n\
+			working set of other applications stays cached)\n\
+			[default: keep]\n\
+  --io-engine=<ENGINE>  How small files in tar images are written: sync,\n\
+			io_uring (batched, falls back to threads when not\n\
+			available) or threads [default: sync]\n\
+  --stream-min=<SIZE>   Feed files of at least SIZE bytes in tar images to\n\
+			the command through FIFOs instead of extracting\n\
+			them.  The command is started with $DUPDATE_STREAM\n\
+			set when the first such file is reached, and must\n\
+			read them in archive order\n\
+  --install=<DIR>       Instead of processing an image, install the directory\n\
+			given as argument as DIR, replacing the tree there\n\
+			in a single atomic rename.  The argument is moved,\n\
+			or copied when on another filesystem\n\
+  --keep-old            Keep the tree replaced by --install as\n\
+			DIR.dupdate-old instead of removing it\n\
+  --rollback=<DIR>      Swap DIR back with DIR.dupdate-old\n\
+  --sync=<DIR>          Instead of processing an image, make DIR a copy of\n\
+			the directory given as argument, only writing files\n\
+			that differ and removing those not in it.\n\
+			Directories are synced in parallel, up to --jobs\n\
+  --verify-follow       Instead of processing the image, follow it while it\n\
+			is being written, and hash and check it as it\n\
+			arrives.  A later run on the complete image uses the\n\
+			result instead of reading it again\n\
+  --fd=<N>              Read the image from file descriptor N instead of a\n\
+			file.  Tar images are extracted as they are read,\n\
+			zip images are spooled to the workdir first\n\
+  --zip-extract-stored  Extract all members stored uncompressed in zip\n\
+			images, not just the command.  Their offsets in the\n\
+			image are always listed in the file named by\n\
+			$DUPDATE_ZIP_INDEX\n\
+  --cgroup=<DIR>        Run in cgroup v2 DIR, created if needed\n\
+  --memory-limit=<SIZE> Fit buffers and number of jobs within SIZE bytes,\n\
+			and report the peak memory used.  With --cgroup,\n\
+			also sets memory.high of the cgroup\n\
+  --io-weight=<N>       Set io.weight of cgroup to N (1-10000)\n\
+  --queue=<DIR>         Keep running, and process *.dupdate images in DIR\n\
+			one at a time, lowest version first, skipping\n\
+			superseded and duplicate images\n\
+  --progress-socket=<PATH>  Send progress and the result as JSON datagrams\n\
+			to the Unix socket bound at PATH\n\
+			[default: $DUPDATE_PROGRESS_SOCKET]\n\
+  --trace=<FILE>        Append phases and commands run as Chrome trace\n\
+			events to FILE [default: $DUPDATE_TRACE]\n\
   --help                Display help\n\
 ";
 
+/* Long-only options */
+enum {
+	OPT_STAGE = 256,
+	OPT_COMMIT,
+	OPT_STAGEDIR,
+	OPT_RESUME,
+	OPT_QUEUE,
+	OPT_CACHE,
+	OPT_CACHE_SIZE,
+	OPT_CHUNK_STORE,
+	OPT_CHUNK_SEED,
+	OPT_MANIFEST,
+	OPT_JOBS,
+	OPT_IO_RATE,
+	OPT_IO_OPS,
+	OPT_IO_PRESSURE,
+	OPT_IONICE,
+	OPT_CGROUP,
+	OPT_IO_WEIGHT,
+	OPT_MEMORY_LIMIT,
+	OPT_IO_ENGINE,
+	OPT_DURABILITY,
+	OPT_ZIP_EXTRACT_STORED,
+	OPT_STREAM_MIN,
+	OPT_TARGET,
+	OPT_INSTALL,
+	OPT_ROLLBACK,
+	OPT_KEEP_OLD,
+	OPT_SYNC,
+	OPT_VERIFY_FOLLOW,
+	OPT_FD,
+	OPT_PAGECACHE,
+	OPT_PROGRESS_SOCKET,
+	OPT_TRACE,
+};
+
 static const struct option longopts[] = {
 	{"workdir",	required_argument,	NULL, 'd'},
 	{"tarcmd",	required_argument,	NULL, 'x'},
@@ -388,17 +1831,81 @@ static const struct option longopts[] = {
 	{"no-remove",	no_argument,		NULL, 'R'},
 	{"no-cleanup",	no_argument,		NULL, 'C'},
 	{"completion",	no_argument,		NULL, 'c'},
+	{"stage",	no_argument,		NULL, OPT_STAGE},
+	{"commit",	no_argument,		NULL, OPT_COMMIT},
+	{"stagedir",	required_argument,	NULL, OPT_STAGEDIR},
+	{"resume",	no_argument,		NULL, OPT_RESUME},
+	{"queue",	required_argument,	NULL, OPT_QUEUE},
+	{"cache",	required_argument,	NULL, OPT_CACHE},
+	{"chunk-store",	required_argument,	NULL, OPT_CHUNK_STORE},
+	{"chunk-seed",	no_argument,		NULL, OPT_CHUNK_SEED},
+	{"cache-size",	required_argument,	NULL, OPT_CACHE_SIZE},
+	{"manifest",	required_argument,	NULL, OPT_MANIFEST},
+	{"jobs",	required_argument,	NULL, OPT_JOBS},
+	{"io-rate",	required_argument,	NULL, OPT_IO_RATE},
+	{"io-ops",	required_argument,	NULL, OPT_IO_OPS},
+	{"io-pressure",	required_argument,	NULL, OPT_IO_PRESSURE},
+	{"ionice",	required_argument,	NULL, OPT_IONICE},
+	{"cgroup",	required_argument,	NULL, OPT_CGROUP},
+	{"io-weight",	required_argument,	NULL, OPT_IO_WEIGHT},
+	{"memory-limit", required_argument,	NULL, OPT_MEMORY_LIMIT},
+	{"io-engine",	required_argument,	NULL, OPT_IO_ENGINE},
+	{"durability",	required_argument,	NULL, OPT_DURABILITY},
+	{"zip-extract-stored", no_argument,	NULL, OPT_ZIP_EXTRACT_STORED},
+	{"stream-min",	required_argument,	NULL, OPT_STREAM_MIN},
+	{"target",	required_argument,	NULL, OPT_TARGET},
+	{"install",	required_argument,	NULL, OPT_INSTALL},
+	{"rollback",	required_argument,	NULL, OPT_ROLLBACK},
+	{"keep-old",	no_argument,		NULL, OPT_KEEP_OLD},
+	{"sync",	required_argument,	NULL, OPT_SYNC},
+	{"verify-follow", no_argument,		NULL, OPT_VERIFY_FOLLOW},
+	{"fd",		required_argument,	NULL, OPT_FD},
+	{"pagecache",	required_argument,	NULL, OPT_PAGECACHE},
+	{"progress-socket", required_argument,	NULL, OPT_PROGRESS_SOCKET},
+	{"trace",	required_argument,	NULL, OPT_TRACE},
 	{"help",	no_argument,		NULL, 'h'},
 	{NULL,		0,			NULL,  0 }
 };
 
 static const char *optstring = "d:x:z:lRCch";
 
+/*
+ * An image read as a stream has no name to be found by again, nor to place
+ * completion files next to, and is read exactly once.
+ */
+static void check_stream_args(void)
+{
+	char name[32];
+
+	if (args.queuedir || args.rollback || args.install || args.sync ||
+	    args.cachedir ||
+	    args.flags & (DUPDATE_FLAG_STAGE|DUPDATE_FLAG_COMMIT|
+			  DUPDATE_FLAG_RESUME|DUPDATE_FLAG_COMPLETION|
+			  DUPDATE_FLAG_VERIFY_FOLLOW)) {
+		ERROR("images read from a stream can only be processed "
+		      "right away");
+		exit(EXIT_FAILURE);
+	}
+
+	/* For log messages */
+	if (image_fd == STDIN_FILENO)
+		strcpy(name, "<stdin>");
+	else
+		sprintf(name, "<fd %d>", image_fd);
+	free(image);
+	image = strdup(name);
+	if (!image) {
+		PERROR("strdup", ENOMEM);
+		exit(EXIT_FAILURE);
+	}
+}
+
 static void parse_args(int argc, char *argv[])
 {
 	int opt, longindex, err;
 
 	args.flags = DUPDATE_FLAG_REMOVE_IMAGE | DUPDATE_FLAG_REMOVE_WORKDIR;
+	args.ioprio = -1;
 
 	/* Parse argument using getopt_long */
 	while ((opt = getopt_long(argc, argv, optstring, longopts,
@@ -444,8 +1951,207 @@ static void parse_args(int argc, char *argv[])
 			args.flags |= DUPDATE_FLAG_COMPLETION;
 			break;
 
+		case OPT_STAGE:
+			args.flags |= DUPDATE_FLAG_STAGE;
+			break;
+
+		case OPT_COMMIT:
+			args.flags |= DUPDATE_FLAG_COMMIT;
+			break;
+
+		case OPT_RESUME:
+			args.flags |= DUPDATE_FLAG_RESUME;
+			break;
+
+		case OPT_QUEUE:
+			err = strset(&args.queuedir, optarg,
+				     PATH_MAX - NAME_MAX);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_CACHE:
+			err = strset(&args.cachedir, optarg,
+				     PATH_MAX - NAME_MAX - 16);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_CACHE_SIZE:
+			err = parse_size(optarg, &args.cache_size);
+			if (err) {
+				PERROR("parse_size", err);
+			}
+			break;
+
+		case OPT_CHUNK_STORE:
+			err = strset(&args.chunkstore, optarg,
+				     PATH_MAX - NAME_MAX - 16);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_CHUNK_SEED:
+			args.flags |= DUPDATE_FLAG_CHUNK_SEED;
+			break;
+
+		case OPT_MANIFEST:
+			err = strset(&args.manifest, optarg, NAME_MAX);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_JOBS:
+			args.jobs = atoi(optarg);
+			if (args.jobs < 1)
+				err = EINVAL;
+			break;
+
+		case OPT_IO_RATE:
+			err = parse_size(optarg, &args.io_rate);
+			if (err) {
+				PERROR("parse_size", err);
+			}
+			break;
+
+		case OPT_IO_OPS:
+			args.io_ops = strtoul(optarg, NULL, 10);
+			if (!args.io_ops)
+				err = EINVAL;
+			break;
+
+		case OPT_IO_PRESSURE:
+			args.io_pressure = atoi(optarg);
+			if (args.io_pressure < 1 || args.io_pressure > 100)
+				err = EINVAL;
+			break;
+
+		case OPT_IONICE:
+			args.ioprio = parse_ioprio(optarg);
+			if (args.ioprio == -1)
+				err = EINVAL;
+			break;
+
+		case OPT_CGROUP:
+			err = strset(&args.cgroup, optarg,
+				     PATH_MAX - NAME_MAX);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_IO_WEIGHT:
+			args.io_weight = atoi(optarg);
+			if (args.io_weight < 1 || args.io_weight > 10000)
+				err = EINVAL;
+			break;
+
+		case OPT_MEMORY_LIMIT:
+			err = parse_size(optarg, &args.memory_limit);
+			if (err) {
+				PERROR("parse_size", err);
+			}
+			break;
+
+		case OPT_IO_ENGINE:
+			err = parse_io_engine(optarg);
+			break;
+
+		case OPT_DURABILITY:
+			err = parse_durability(optarg);
+			break;
+
+		case OPT_PROGRESS_SOCKET:
+			err = strset(&args.progress_socket, optarg, 0);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_TRACE:
+			err = strset(&args.trace, optarg, 0);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_PAGECACHE:
+			if (strcmp(optarg, "drop") == 0)
+				args.flags |= DUPDATE_FLAG_DROP_CACHE;
+			else if (strcmp(optarg, "keep") == 0)
+				args.flags &= ~DUPDATE_FLAG_DROP_CACHE;
+			else
+				err = EINVAL;
+			break;
+
+		case OPT_ZIP_EXTRACT_STORED:
+			args.flags |= DUPDATE_FLAG_ZIP_STORED;
+			break;
+
+		case OPT_INSTALL:
+			err = strset(&args.install, optarg, PATH_MAX - 32);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_ROLLBACK:
+			err = strset(&args.rollback, optarg, PATH_MAX - 32);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_VERIFY_FOLLOW:
+			args.flags |= DUPDATE_FLAG_VERIFY_FOLLOW;
+			break;
+
+		case OPT_FD:
+			image_fd = atoi(optarg);
+			if (image_fd < 0 || fcntl(image_fd, F_GETFD) == -1)
+				err = EBADF;
+			break;
+
+		case OPT_SYNC:
+			err = strset(&args.sync, optarg, PATH_MAX);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_KEEP_OLD:
+			args.flags |= DUPDATE_FLAG_KEEP_OLD;
+			break;
+
+		case OPT_TARGET:
+			err = strset(&args.target, optarg, PATH_MAX -
+				     sizeof(TARGET_WORKDIR_SUFFIX) - 2);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_STREAM_MIN:
+			err = parse_size(optarg, &args.stream_min);
+			if (err) {
+				PERROR("parse_size", err);
+			}
+			break;
+
+		case OPT_STAGEDIR:
+			err = strset(&args.stagedir, optarg,
+				     PATH_MAX - NAME_MAX - 8);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
 		case 'h':
-			printf(usage, argv[0]);
+			printf(usage, argv[0], argv[0]);
 			exit(EXIT_SUCCESS);
 			break;
 
@@ -469,32 +2175,92 @@ static void parse_args(int argc, char *argv[])
 		}
 	}
 
-	if (optind >= argc) {
+	if (args.queuedir || args.rollback || image_fd != -1) {
+		if (optind < argc) {
+			ERROR("no file argument allowed with --%s",
+			      args.queuedir ? "queue" :
+			      args.rollback ? "rollback" : "fd");
+			exit(EXIT_FAILURE);
+		}
+	} else if (optind >= argc) {
 		ERROR("file argument missing");
 		exit(EXIT_FAILURE);
 	} else if ((argc - optind) > 1) {
 		ERROR("too many arguments");
 		exit(EXIT_FAILURE);
-	}
+	} else {
+		err = strset(&image, argv[optind], PATH_MAX);
+		if (err) {
+			PERROR("strset", err);
+			exit(EXIT_FAILURE);
+		}
 
-	err = strset(&image, argv[optind], PATH_MAX);
-	if (err) {
-		PERROR("strset", err);
-		exit(EXIT_FAILURE);
+		err = init_completion_file();
+		if (err) {
+			PERROR("init_completion_file", err);
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	err = init_completion_file();
-	if (err) {
-		PERROR("init_completion_file", err);
-		exit(EXIT_FAILURE);
+	if (args.target) {
+		/* Commands find it in the environment */
+		setenv("DUPDATE_TARGET", args.target, 1);
+		if (!args.workdir) {
+			args.workdir = target_workdir(args.target);
+			if (!args.workdir) {
+				PERROR("malloc", ENOMEM);
+				exit(EXIT_FAILURE);
+			}
+		}
 	}
-
 	if (!args.workdir)
 		args.workdir = DEFAULT_WORKDIR;
+	if (!args.progress_socket)
+		args.progress_socket = getenv("DUPDATE_PROGRESS_SOCKET");
+	if (!args.trace)
+		args.trace = getenv("DUPDATE_TRACE");
 	if (!args.tarcmd)
 		args.tarcmd = DEFAULT_CMDFILE;
 	if (!args.zipcmd)
 		args.zipcmd = DEFAULT_CMDFILE;
+	if (!args.stagedir)
+		args.stagedir = DEFAULT_STAGEDIR;
+	if (!args.manifest)
+		args.manifest = DEFAULT_MANIFEST;
+	if (!args.jobs)
+		args.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (args.jobs < 1)
+		args.jobs = 1;
+
+	if ((args.flags & DUPDATE_FLAG_STAGE) &&
+	    (args.flags & DUPDATE_FLAG_COMMIT)) {
+		ERROR("--stage and --commit are mutually exclusive");
+		exit(EXIT_FAILURE);
+	}
+
+	if (args.stream_min &&
+	    (args.flags & (DUPDATE_FLAG_STAGE|DUPDATE_FLAG_RESUME) ||
+	     args.cachedir || args.chunkstore)) {
+		ERROR("--stream-min cannot be used with --stage, --resume, "
+		      "--cache or --chunk-store");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((args.flags & DUPDATE_FLAG_CHUNK_SEED) && !args.chunkstore) {
+		ERROR("--chunk-seed requires --chunk-store");
+		exit(EXIT_FAILURE);
+	}
+
+	if (args.io_weight && !args.cgroup) {
+		ERROR("--io-weight requires --cgroup");
+		exit(EXIT_FAILURE);
+	}
+
+	if (image && strcmp(image, "-") == 0 && !args.install && !args.sync &&
+	    !(args.flags & DUPDATE_FLAG_CHUNK_SEED))
+		image_fd = STDIN_FILENO;
+	if (image_fd != -1)
+		check_stream_args();
 }
 
 int main(int argc, char *argv[])
@@ -503,9 +2269,40 @@ int main(int argc, char *argv[])
 
 	if (args.flags & DUPDATE_FLAG_SYSLOG)
 		log_to_syslog(1);
+	log_start();
+
+	if (setup_memory())
+		exit(EXIT_FAILURE);
 
 	if (get_sysconf())
 		exit(EXIT_FAILURE);
 
-	return process_image();
+	if (setup_io())
+		exit(EXIT_FAILURE);
+
+	if (args.progress_socket && *args.progress_socket &&
+	    progress_open(args.progress_socket))
+		exit(EXIT_FAILURE);
+
+	if (args.trace && *args.trace && trace_open(args.trace, "dupdate"))
+		exit(EXIT_FAILURE);
+
+	if (args.queuedir)
+		return queue_run(args.queuedir, &queue_ops);
+
+	/* Install primitives, for commands to call */
+	if (args.install)
+		return install_tree(image, args.install,
+				    args.flags & DUPDATE_FLAG_KEEP_OLD ?
+				    INSTALL_FLAG_KEEP_OLD : 0);
+	if (args.rollback)
+		return install_rollback(args.rollback);
+	if (args.sync)
+		return treesync_run(image, args.sync, args.jobs);
+	if (args.flags & DUPDATE_FLAG_VERIFY_FOLLOW)
+		return verify_follow(image);
+	if (args.flags & DUPDATE_FLAG_CHUNK_SEED)
+		return seed_chunks();
+
+	return handle_image();
 }
@@ -30,6 +30,8 @@
 #include <fcntl.h>
 #include <string.h>
 #include <getopt.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
@@ -39,6 +41,8 @@
 
 #include "common.h"
 #include "daemon.h"
+#include "progress.h"
+#include "trace.h"
 
 /*
  * This is a simple inotify daemon, compatible with inotifyd applet in
@@ -47,18 +51,59 @@
  *
  * When used with dupdate-inotifyd-agent, it should be a full replacement for
  * the old dupdate daemon.
+ *
+ * Each watch can have a handler of its own, given as FILE[:MASK]=HANDLER,
+ * with PROG as the default.  A handler is either a program, which is run
+ * directly with the event as arguments, or one of the built-in handlers,
+ * prefixed with '@':
+ *
+ *   @log			Log the event
+ *   @touch-stamp[:FILE]	Update the mtime of FILE, by default the
+ *				watched path with .stamp appended
+ *   @dupdate[:OPTIONS]		Run dupdate on *.dupdate files closed after
+ *				writing or moved in, with the comma
+ *				separated OPTIONS
+ *
+ * Events are routed to their handler by a table indexed by watch
+ * descriptor.
+ *
+ * Watches can also be read from a config file, one FILE[:MASK][=HANDLER] per
+ * line.  The config file is read again on SIGHUP, or when it is rewritten or
+ * moved in place, and only the watches that differ are added, changed or
+ * removed.  The remaining watches, and the events already queued on them,
+ * are left untouched, as the inotify instance is kept throughout.
  */
 
 #define DEFAULT_PIDFILE			"/var/run/inotifyd.pid"
+#define STAMP_SUFFIX			".stamp"
+#define DUPDATE_SUFFIX			".dupdate"
+#define HANDLER_ARGS_MAX		16
+
+struct inotifyd_watch_arg;
+
+struct inotifyd_handler {
+	const char *name;
+	int (*run)(struct inotifyd_watch_arg *watch, const char *events,
+		   const char *name);
+};
 
 struct inotifyd_watch_arg {
 	char * path;
 	uint32_t mask;
+	const struct inotifyd_handler *handler;
+	char * handler_arg;	/* Program, stamp file or dupdate options */
+	/* Watches read from config file */
+	char * spec;
+	int wd;
+	struct inotifyd_watch_arg *next;
 };
 
 struct inotifyd_args {
 	char * prog;
 	int flags;
+	char * progress_socket;
+	char * trace;
+	char * config;
 #ifdef HAVE_FORK
 	char * pidfile;
 #endif /* HAVE_FORK */
@@ -69,8 +114,6 @@ struct inotifyd_args {
 #define INOTIFYD_FLAG_DETACH		(1 << 0)
 #define INOTIFYD_FLAG_SYSLOG		(1 << 1)
 
-static char *shcmd;
-static int shcmd_len;
 static const char *cwd;
 
 struct inotify_event_type {
@@ -105,9 +148,271 @@ struct inotifyd_state {
 	int fd;
 	char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
 	ssize_t buf_len;
-	int wd[];
+	struct inotifyd_watch_arg **watch_by_wd;
+	int max_wd;
+	char *config;
+	char *prog;
+	int config_fd;
+	struct inotifyd_watch_arg *config_watches;
+};
+
+/* Written to by SIGHUP handler, to wake up the event loop */
+static int hup_pipe[2] = { -1, -1 };
+
+static int handle_prog(struct inotifyd_watch_arg *watch, const char *events,
+		       const char *name)
+{
+	char *argv[] = { watch->handler_arg, (char *)events, watch->path,
+			 (char *)name, NULL };
+
+	return run_prog(argv);
+}
+
+static int handle_log(struct inotifyd_watch_arg *watch, const char *events,
+		      const char *name)
+{
+	INFO("%s %s%s%s", events, watch->path, name ? "/" : "",
+	     name ? name : "");
+	return 0;
+}
+
+static int handle_touch_stamp(struct inotifyd_watch_arg *watch,
+			      const char *events, const char *name)
+{
+	int fd, err = 0;
+
+	fd = open(watch->handler_arg, O_WRONLY|O_CREAT|O_NOCTTY|O_CLOEXEC,
+		  0644);
+	if (fd == -1) {
+		PERROR(watch->handler_arg, errno);
+		return errno;
+	}
+	if (futimens(fd, NULL) == -1) {
+		PERROR("futimens", errno);
+		err = errno;
+	}
+	close(fd);
+
+	return err;
+}
+
+static int handle_dupdate(struct inotifyd_watch_arg *watch,
+			  const char *events, const char *name)
+{
+	char *argv[HANDLER_ARGS_MAX + 3], *opts, *opt, *save;
+	char path[PATH_MAX];
+	size_t len;
+	int argc = 0, err;
+
+	/* Only complete images, as the agent script does */
+	len = name ? strlen(name) : 0;
+	if (len <= strlen(DUPDATE_SUFFIX) ||
+	    strcmp(name + len - strlen(DUPDATE_SUFFIX), DUPDATE_SUFFIX) != 0 ||
+	    !strpbrk(events, "wy"))
+		return 0;
+
+	opts = strdup(watch->handler_arg ? watch->handler_arg : "");
+	if (!opts) {
+		ERROR("out of memory");
+		return ENOMEM;
+	}
+
+	argv[argc++] = "dupdate";
+	for (opt = strtok_r(opts, ",", &save) ;
+	     opt && argc <= HANDLER_ARGS_MAX ;
+	     opt = strtok_r(NULL, ",", &save))
+		argv[argc++] = opt;
+	snprintf(path, sizeof(path), "%s/%s", watch->path, name);
+	argv[argc++] = path;
+	argv[argc] = NULL;
+
+	err = run_prog(argv);
+	free(opts);
+
+	return err;
+}
+
+static const struct inotifyd_handler prog_handler = { NULL, handle_prog };
+
+static const struct inotifyd_handler builtin_handlers[] = {
+	{ "log",		handle_log },
+	{ "touch-stamp",	handle_touch_stamp },
+	{ "dupdate",		handle_dupdate },
+	{ NULL, NULL }
 };
 
+/* Set the handler of watch from "PROG" or "@BUILTIN[:ARG]" */
+static int parse_handler(struct inotifyd_watch_arg *watch, char *str)
+{
+	const struct inotifyd_handler *h;
+	char *arg;
+
+	if (*str != '@') {
+		watch->handler = &prog_handler;
+		watch->handler_arg = strdup(str);
+		if (!watch->handler_arg)
+			return ENOMEM;
+		return 0;
+	}
+
+	str++;
+	arg = strchr(str, ':');
+	if (arg)
+		*arg++ = '\0';
+
+	for (h = builtin_handlers ; h->name ; h++)
+		if (strcmp(str, h->name) == 0)
+			break;
+	if (!h->name) {
+		ERROR("unknown handler @%s", str);
+		return EINVAL;
+	}
+
+	watch->handler = h;
+	watch->handler_arg = arg ? strdup(arg) : NULL;
+	if (arg && !watch->handler_arg)
+		return ENOMEM;
+
+	/* Next to the watched path, so touching it is not an event */
+	if (h->run == handle_touch_stamp && !arg) {
+		watch->handler_arg = malloc(strlen(watch->path) +
+					    strlen(STAMP_SUFFIX) + 1);
+		if (!watch->handler_arg)
+			return ENOMEM;
+		sprintf(watch->handler_arg, "%s" STAMP_SUFFIX, watch->path);
+	}
+
+	return 0;
+}
+
+/* Parse "FILE[:MASK][=HANDLER]", splitting spec in place */
+static int parse_watch(struct inotifyd_watch_arg *watch, char *spec,
+		       char *prog)
+{
+	struct inotify_event_type *event_type;
+	char *mask_arg, *handler_arg;
+	int err;
+
+	watch->path = spec;
+	watch->wd = -1;
+	handler_arg = strchr(spec, '=');
+	if (handler_arg)
+		*handler_arg++ = '\0';
+	mask_arg = strchr(spec, ':');
+	if (mask_arg) {
+		watch->mask = 0;
+		*mask_arg = '\0';
+		mask_arg++;
+		while (*mask_arg != '\0') {
+			event_type = maskable_events;
+			while (event_type->ch != '\0') {
+				if (*mask_arg == event_type->ch) {
+					watch->mask |= event_type->bm;
+					break;
+				}
+				event_type++;
+			}
+			mask_arg++;
+		}
+	} else {
+		watch->mask = IN_ALL_EVENTS;
+	}
+
+	if (!handler_arg && !prog) {
+		ERROR("%s: no handler, and no PROG given", watch->path);
+		return EINVAL;
+	}
+
+	err = parse_handler(watch, handler_arg ? handler_arg : prog);
+	if (err == ENOMEM)
+		ERROR("out of memory");
+	return err;
+}
+
+static void free_watches(struct inotifyd_watch_arg *watch)
+{
+	struct inotifyd_watch_arg *next;
+
+	for ( ; watch ; watch = next) {
+		next = watch->next;
+		free(watch->spec);
+		free(watch->handler_arg);
+		free(watch);
+	}
+}
+
+/* Read watches from config file, with paths relative to its directory */
+static int read_config(const char *path, char *prog,
+		       struct inotifyd_watch_arg **list)
+{
+	struct inotifyd_watch_arg *watch, *prev, **tail = list;
+	FILE *f;
+	char *line = NULL, *p, *end;
+	size_t size = 0;
+	int dir_len, lineno = 0, err = 0;
+
+	*list = NULL;
+	dir_len = strrchr(path, '/') - path;
+
+	f = fopen(path, "r");
+	if (!f) {
+		PERROR(path, errno);
+		return errno;
+	}
+
+	while (getline(&line, &size, f) != -1) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		for (p = line ; *p == ' ' || *p == '\t' ; p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+		for (end = p + strlen(p) ; end[-1] == ' ' || end[-1] == '\t' ;
+		     end--)
+			;
+		*end = '\0';
+
+		watch = calloc(1, sizeof(*watch));
+		if (!watch ||
+		    asprintf(&watch->spec, "%.*s%s%s", *p == '/' ? 0 : dir_len,
+			     path, *p == '/' ? "" : "/", p) == -1) {
+			ERROR("out of memory");
+			free(watch);
+			err = ENOMEM;
+			break;
+		}
+		*tail = watch;
+		tail = &watch->next;
+
+		err = parse_watch(watch, watch->spec, prog);
+		if (err) {
+			ERROR("%s line %d: invalid watch", path, lineno);
+			break;
+		}
+
+		for (prev = *list ; prev != watch ; prev = prev->next) {
+			if (strcmp(prev->path, watch->path) == 0) {
+				ERROR("%s line %d: %s is already watched",
+				      path, lineno, watch->path);
+				err = EINVAL;
+				break;
+			}
+		}
+		if (err)
+			break;
+	}
+
+	free(line);
+	fclose(f);
+
+	if (err) {
+		free_watches(*list);
+		*list = NULL;
+	}
+
+	return err;
+}
+
 static struct inotify_event * get_inotify_event(struct inotifyd_state *state)
 {
 	struct inotify_event *event;
@@ -146,17 +451,276 @@ static struct inotify_event * get_inotify_event(struct inotifyd_state *state)
 	return event;
 }
 
+static int set_watch_wd(struct inotifyd_state *state, int wd,
+			struct inotifyd_watch_arg *watch)
+{
+	struct inotifyd_watch_arg **by_wd;
+	int max_wd;
+
+	if (wd > state->max_wd) {
+		max_wd = wd > 2 * state->max_wd ? wd : 2 * state->max_wd;
+		by_wd = realloc(state->watch_by_wd,
+				(max_wd + 1) * sizeof(*by_wd));
+		if (!by_wd)
+			return ENOMEM;
+		memset(by_wd + state->max_wd + 1, 0,
+		       (max_wd - state->max_wd) * sizeof(*by_wd));
+		state->watch_by_wd = by_wd;
+		state->max_wd = max_wd;
+	}
+
+	state->watch_by_wd[wd] = watch;
+	return 0;
+}
+
+static struct inotifyd_watch_arg *
+watch_of_wd(struct inotifyd_state *state, int wd)
+{
+	if (wd < 0 || wd > state->max_wd)
+		return NULL;
+	return state->watch_by_wd[wd];
+}
+
+/* Remove an old config watch, unless its wd was taken over */
+static void drop_watch(struct inotifyd_state *state,
+		       struct inotifyd_watch_arg *watch)
+{
+	if (watch->wd != -1 && watch_of_wd(state, watch->wd) == watch) {
+		inotify_rm_watch(state->fd, watch->wd);
+		state->watch_by_wd[watch->wd] = NULL;
+	}
+	watch->next = NULL;
+	free_watches(watch);
+}
+
+static int same_handler(struct inotifyd_watch_arg *a,
+			struct inotifyd_watch_arg *b)
+{
+	if (a->handler != b->handler)
+		return 0;
+	if (!a->handler_arg || !b->handler_arg)
+		return a->handler_arg == b->handler_arg;
+	return strcmp(a->handler_arg, b->handler_arg) == 0;
+}
+
+/*
+ * Replace the config watches with the ones in list.  Watches on a path that
+ * is still watched with the same mask are kept as they are, and only the
+ * handler is switched.  A changed mask is replaced on the existing watch.
+ * Watches that cannot be added are retried on next reload.
+ */
+static void apply_config(struct inotifyd_state *state,
+			 struct inotifyd_watch_arg *list)
+{
+	struct inotifyd_watch_arg *watch, *old, **pp;
+	int added = 0, changed = 0, removed = 0, failed = 0;
+
+	for (watch = list ; watch ; watch = watch->next) {
+		old = NULL;
+		for (pp = &state->config_watches ; *pp ; pp = &(*pp)->next) {
+			if (strcmp((*pp)->path, watch->path) == 0) {
+				old = *pp;
+				*pp = old->next;
+				break;
+			}
+		}
+
+		if (old && old->wd != -1 && old->mask == watch->mask) {
+			watch->wd = old->wd;
+		} else {
+			watch->wd = inotify_add_watch(state->fd, watch->path,
+						      watch->mask);
+			if (watch->wd == -1)
+				PERROR(watch->path, errno);
+		}
+		if (watch->wd != -1 && set_watch_wd(state, watch->wd, watch)) {
+			ERROR("out of memory");
+			inotify_rm_watch(state->fd, watch->wd);
+			watch->wd = -1;
+		}
+
+		if (watch->wd == -1)
+			failed++;
+		else if (!old)
+			added++;
+		else if (old->wd != watch->wd || old->mask != watch->mask ||
+			 !same_handler(old, watch))
+			changed++;
+
+		if (old)
+			drop_watch(state, old);
+	}
+
+	while ((old = state->config_watches) != NULL) {
+		state->config_watches = old->next;
+		if (old->wd != -1)
+			removed++;
+		drop_watch(state, old);
+	}
+
+	state->config_watches = list;
+
+	INFO("%s: %d watches added, %d changed, %d removed, %d failed",
+	     state->config, added, changed, removed, failed);
+}
+
+static void reload_config(struct inotifyd_state *state)
+{
+	struct inotifyd_watch_arg *list;
+
+	trace_new_id();
+	trace_instant("reload", state->config);
+
+	if (read_config(state->config, state->prog, &list)) {
+		ERROR("keeping watches of previous %s", state->config);
+		return;
+	}
+
+	apply_config(state, list);
+}
+
+/* Check for the config file being rewritten or moved in place */
+static int config_changed(struct inotifyd_state *state)
+{
+	char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	struct inotify_event *event;
+	const char *name = strrchr(state->config, '/') + 1;
+	ssize_t len;
+	char *p;
+	int changed = 0;
+
+	while ((len = read(state->config_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf ; p < buf + len ;
+		     p += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)p;
+			if (event->mask & IN_Q_OVERFLOW ||
+			    (event->len && strcmp(event->name, name) == 0))
+				changed = 1;
+		}
+	}
+	if (len == -1 && errno != EAGAIN)
+		PERROR("read", errno);
+
+	return changed;
+}
+
+static void sighup_handler(int sig)
+{
+	int saved_errno = errno;
+
+	if (write(hup_pipe[1], "", 1) == -1) {
+		/* A full pipe already has a reload pending */
+	}
+	errno = saved_errno;
+}
+
+static int config_init(struct inotifyd_state *state,
+		       struct inotifyd_args *args)
+{
+	struct sigaction sa;
+	struct inotifyd_watch_arg *list;
+	char *dir;
+	int err;
+
+	state->config = realpath(args->config, NULL);
+	if (!state->config) {
+		PERROR(args->config, errno);
+		return errno;
+	}
+	state->prog = args->prog;
+
+	err = read_config(state->config, state->prog, &list);
+	if (err)
+		return err;
+	apply_config(state, list);
+
+	/*
+	 * Watch the directory, as editors and package managers tend to
+	 * replace the file rather than write it.  In an inotify instance of
+	 * its own, to not interfere with the masks of watches on it.
+	 */
+	state->config_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (state->config_fd == -1) {
+		PERROR("inotify_init1", errno);
+		return errno;
+	}
+	dir = strndup(state->config, strrchr(state->config, '/') -
+		      state->config);
+	if (!dir) {
+		ERROR("out of memory");
+		return ENOMEM;
+	}
+	if (inotify_add_watch(state->config_fd, *dir ? dir : "/",
+			      IN_CLOSE_WRITE|IN_MOVED_TO) == -1) {
+		PERROR(dir, errno);
+		free(dir);
+		return errno;
+	}
+	free(dir);
+
+	if (pipe2(hup_pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+		PERROR("pipe2", errno);
+		return errno;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighup_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGHUP, &sa, NULL) == -1) {
+		PERROR("sigaction", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+/* Wait for inotify events, reloading the config file meanwhile */
+static int wait_events(struct inotifyd_state *state)
+{
+	struct pollfd pfd[3] = {
+		{ .fd = state->fd,		.events = POLLIN },
+		{ .fd = hup_pipe[0],		.events = POLLIN },
+		{ .fd = state->config_fd,	.events = POLLIN },
+	};
+	char buf[16];
+	int reload;
+
+	for (;;) {
+		if (poll(pfd, 3, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("poll", errno);
+			return errno;
+		}
+
+		reload = 0;
+		if (pfd[1].revents & POLLIN) {
+			while (read(hup_pipe[0], buf, sizeof(buf)) > 0)
+				;
+			reload = 1;
+		}
+		if (pfd[2].revents & POLLIN && config_changed(state))
+			reload = 1;
+		if (reload)
+			reload_config(state);
+
+		if (pfd[0].revents & POLLIN)
+			return 0;
+	}
+}
+
 static struct inotifyd_state * inotifyd_init(struct inotifyd_args *args)
 {
 	struct inotifyd_state *state;
-	int i;
+	int i, wd;
 
-	state = malloc(sizeof(*state) +
-		       sizeof(*state->wd) * args->num_watches);
+	state = calloc(1, sizeof(*state));
 	if (!state) {
 		ERROR("out of memory");
 		exit(EXIT_FAILURE);
 	}
+	state->max_wd = -1;
+	state->config_fd = -1;
 
 	/* Initialize inotify instance */
 	state->fd = inotify_init();
@@ -167,16 +731,23 @@ static struct inotifyd_state * inotifyd_init(struct inotifyd_args *args)
 
 	/* Add watches */
 	for (i = 0 ; i < args->num_watches ; i++) {
-		state->wd[i] = inotify_add_watch(
-			state->fd, args->watch[i].path, args->watch[i].mask);
-		if (state->wd[i] == -1) {
+		wd = inotify_add_watch(state->fd, args->watch[i].path,
+				       args->watch[i].mask);
+		if (wd == -1) {
 			PERROR("inotify_add_watch", errno);
 			exit(EXIT_FAILURE);
 		}
+		if (set_watch_wd(state, wd, &args->watch[i])) {
+			ERROR("out of memory");
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	state->buf_len = 0;
 
+	if (args->config && config_init(state, args))
+		exit(EXIT_FAILURE);
+
 	return state;
 }
 
@@ -186,11 +757,18 @@ static int inotifyd_event_loop(struct inotifyd_args *args,
 	struct inotify_event *event;
 	char events_buf[sizeof(maskable_events)/sizeof(*maskable_events) +
 			sizeof(unmaskable_events)/sizeof(*unmaskable_events)];
-	char *events, *watch;
+	char *events;
+	const char *name;
+	struct inotifyd_watch_arg *watch;
 	struct inotify_event_type *event_type;
-	int err, i;
+	int err;
 
-	while ((event = get_inotify_event(state)) != NULL) {
+	for (;;) {
+		if (state->buf_len == 0 && wait_events(state))
+			break;
+		event = get_inotify_event(state);
+		if (!event)
+			break;
 
 		/* Create string representing the event type */
 		events = events_buf;
@@ -209,22 +787,25 @@ static int inotifyd_event_loop(struct inotifyd_args *args,
 		*events = '\0';
 		events = events_buf;
 
-		/* Get name of watch */
-		watch = "<unknown>";
-		for (i = 0 ; i < args->num_watches ; i++)
-			if (event->wd == state->wd[i])
-				watch = args->watch[i].path;
-
-		if (event->len)
-			snprintf(shcmd, shcmd_len, "\"%s\" %s \"%s\" \"%s\"",
-				 args->prog, events, watch, event->name);
-		else
-			snprintf(shcmd, shcmd_len, "\"%s\" %s \"%s\"",
-				 args->prog, events, watch);
-		if ((err = run_shcmd(shcmd))) {
-			PERROR(args->prog, err);
+		watch = watch_of_wd(state, event->wd);
+		if (!watch) {
+			/* Queue overflow, or a watch already removed */
+			INFO("%s on unknown watch %d", events, event->wd);
+			free(event);
 			continue;
 		}
+		name = event->len ? event->name : NULL;
+
+		progress_dispatch(watch->path, events, name);
+		trace_new_id();
+		trace_instant("event", watch->path);
+		trace_flow(1);
+		err = watch->handler->run(watch, events, name);
+		progress_result(err);
+		if (err) {
+			PERROR(watch->handler->name ? watch->handler->name :
+			       watch->handler_arg, err);
+		}
 
 		free(event);
 	}
@@ -235,13 +816,26 @@ static int inotifyd_event_loop(struct inotifyd_args *args,
 }
 
 static const char *usage = "\
-Usage: %s [options] <PROG> <FILE1>[:MASK]...\n\n\
+Usage: %s [options] <PROG> <FILE1>[:MASK][=HANDLER]...\n\
+       %s [options] --config=<FILE> [<PROG> [<FILE1>[:MASK][=HANDLER]...]]\n\n\
 Arguments:\n\
-  <PROG>                Program to run on each event\n\
+  <PROG>                Handler of events on watches without their own\n\
   <FILEn>               File or directory to watch\n\
-  <MASK>                List of events to wait for\n\n\
+  <MASK>                List of events to wait for\n\
+  <HANDLER>             Program to run on each event, or a built-in:\n\
+			@log, @touch-stamp[:FILE] or @dupdate[:OPTIONS]\n\n\
 Options:\n\
   -l, --syslog          Output syslog instead of stdout/stderr\n\
+  --progress-socket=<PATH>  Send events dispatched to PROG and their result\n\
+			as JSON datagrams to the Unix socket bound at PATH,\n\
+			also passed on to dupdate as\n\
+			$DUPDATE_PROGRESS_SOCKET\n\
+  --trace=<FILE>        Append events and runs of PROG as Chrome trace\n\
+			events to FILE, shared with dupdate through\n\
+			$DUPDATE_TRACE [default: $DUPDATE_TRACE]\n\
+  --config=<FILE>       Read further watches from FILE, one\n\
+			<FILEn>[:MASK][=HANDLER] per line, and apply\n\
+			changes to it on SIGHUP or when it is rewritten\n\
 "
 #ifdef HAVE_FORK
 "\
@@ -267,12 +861,29 @@ If watching a directory:\n\
   y   File was moved into watched directory\n\
   n   File or directory created in watched directory\n\
   d   File or directory deleted from watched directory\n\n\
+Programs are run as HANDLER EVENTS FILE [NAME].  @touch-stamp updates\n\
+the mtime of FILE [default: <FILEn>.stamp].  @dupdate runs dupdate with\n\
+the comma separated OPTIONS on *.dupdate files closed after writing or\n\
+moved in.\n\
+Relative paths in the config file are relative to its directory, and\n\
+lines starting with '#' are ignored.  On reload, only watches that differ\n\
+are added, changed or removed, and a config file with errors is ignored.\n\
 PROG must not block, as inotifyd wait for it to exit.\n\
 When 'x' event is received for all watches, inotifyd exits.\n\
 ";
 
+/* Long-only options */
+enum {
+	OPT_PROGRESS_SOCKET = 256,
+	OPT_TRACE,
+	OPT_CONFIG,
+};
+
 static struct option longopts[] = {
 	{"syslog",	no_argument,		0, 'l'},
+	{"progress-socket", required_argument,	0, OPT_PROGRESS_SOCKET},
+	{"trace",	required_argument,	0, OPT_TRACE},
+	{"config",	required_argument,	0, OPT_CONFIG},
 #ifdef HAVE_FORK
 	{"detach",	no_argument,		0, 'd'},
 	{"pidfile",	required_argument,	0, 'p'},
@@ -291,8 +902,6 @@ struct inotifyd_args * parse_args(int argc, char *argv[])
 	int opt, longindex, err;
 	struct inotifyd_args *args;
 	int i;
-	struct inotify_event_type *event_type;
-	char *mask_arg;
 
 	args = malloc(sizeof(*args));
 	if (args == NULL) {
@@ -312,6 +921,27 @@ struct inotifyd_args * parse_args(int argc, char *argv[])
 			args->flags |= INOTIFYD_FLAG_SYSLOG;
 			break;
 
+		case OPT_PROGRESS_SOCKET:
+			err = strset(&args->progress_socket, optarg, 0);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_TRACE:
+			err = strset(&args->trace, optarg, 0);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
+		case OPT_CONFIG:
+			err = strset(&args->config, optarg, PATH_MAX);
+			if (err) {
+				PERROR("strset", err);
+			}
+			break;
+
 #ifdef HAVE_FORK
 		case 'p':
 			err = strset(&args->pidfile, optarg, PATH_MAX);
@@ -326,7 +956,7 @@ struct inotifyd_args * parse_args(int argc, char *argv[])
 #endif /* HAVE_FORK */
 
 		case 'h':
-			printf(usage, argv[0]);
+			printf(usage, argv[0], argv[0]);
 			exit(EXIT_SUCCESS);
 			break;
 
@@ -350,46 +980,32 @@ struct inotifyd_args * parse_args(int argc, char *argv[])
 		}
 	}
 
-	if ((argc - optind) < 2) {
+	/* With a config file, PROG and watches are optional */
+	if ((argc - optind) < (args->config ? 0 : 2)) {
 		ERROR("not enough arguments %d %d", argc, optind);
 		exit(EXIT_FAILURE);
 	}
 
-	err = strset(&args->prog, argv[optind], PATH_MAX);
-	if (err) {
-		PERROR("strset", err);
-		exit(EXIT_FAILURE);
+	if (argc > optind) {
+		err = strset(&args->prog, argv[optind], PATH_MAX);
+		if (err) {
+			PERROR("strset", err);
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	args->num_watches = argc - optind - 1;
+	args->num_watches = argc > optind ? argc - optind - 1 : 0;
 	args->watch = malloc(sizeof(*args->watch) * args->num_watches);
 	if (args->watch == NULL) {
 		ERROR("out of memory");
 		exit(EXIT_FAILURE);
 	}
 	memset(args->watch, 0, sizeof(*args->watch) * args->num_watches);
-	for (i = 0 ; i < (argc - optind - 1) ; i++) {
-		args->watch[i].path = argv[optind + 1 + i];
-		mask_arg = strchr(args->watch[i].path, ':');
-		if (mask_arg) {
-			args->watch[i].mask = 0;
-			*mask_arg = '\0';
-			mask_arg++;
-			while (*mask_arg != '\0') {
-				event_type = maskable_events;
-				while (event_type->ch != '\0') {
-					if (*mask_arg == event_type->ch) {
-						args->watch[i].mask |=
-							event_type->bm;
-						break;
-					}
-					event_type++;
-				}
-				mask_arg++;
-			}
-		} else {
-			args->watch[i].mask = IN_ALL_EVENTS;
-		}
+	for (i = 0 ; i < args->num_watches ; i++) {
+		err = parse_watch(&args->watch[i], argv[optind + 1 + i],
+				  args->prog);
+		if (err)
+			exit(EXIT_FAILURE);
 	}
 
 	if (args->flags & INOTIFYD_FLAG_DETACH && !args->pidfile)
@@ -400,18 +1016,6 @@ struct inotifyd_args * parse_args(int argc, char *argv[])
 
 static int get_sysconf(void)
 {
-	shcmd_len = sysconf(_SC_ARG_MAX);
-	if (shcmd_len == -1) {
-		PERROR("sysconf", errno);
-		return errno;
-	}
-
-	shcmd = malloc(shcmd_len);
-	if (!shcmd) {
-		PERROR("malloc", ENOMEM);
-		return ENOMEM;
-	}
-
 	cwd = get_current_dir_name();
 
 	return 0;
@@ -430,12 +1034,26 @@ int main (int argc, char *argv[])
 	if (get_sysconf())
 		exit(EXIT_FAILURE);
 
+	/* dupdate run by PROG reports to the same socket */
+	if (args->progress_socket) {
+		if (progress_open(args->progress_socket))
+			exit(EXIT_FAILURE);
+		setenv("DUPDATE_PROGRESS_SOCKET", args->progress_socket, 1);
+	}
+
 	state = inotifyd_init(args);
 	if (!state)
 		exit(EXIT_FAILURE);
 
 	if (args->flags & INOTIFYD_FLAG_DETACH)
 		daemonize(args->pidfile);
+	log_start();
+
+	if (!args->trace)
+		args->trace = getenv("DUPDATE_TRACE");
+	if (args->trace && *args->trace &&
+	    trace_open(args->trace, "inotifyd"))
+		exit(EXIT_FAILURE);
 
 	return inotifyd_event_loop(args, state);
 }
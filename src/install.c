@@ -0,0 +1,274 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
+
+#include "common.h"
+#include "install.h"
+
+/*
+ * Atomic tree install.
+ *
+ * The new tree is prepared as <target>.dupdate-new, next to the target and
+ * thus on the same filesystem.  The source is moved there if possible, and
+ * copied otherwise.  Once synced, it is swapped with the target in a single
+ * renameat2(RENAME_EXCHANGE), so the target is always either the complete
+ * old tree or the complete new one.  The old tree is then removed in the
+ * background, or kept as <target>.dupdate-old, to be swapped back by a
+ * rollback.
+ */
+
+#define NEW_SUFFIX			".dupdate-new"
+#define OLD_SUFFIX			".dupdate-old"
+#define TRASH_SUFFIX			".dupdate-trash"
+
+static char *sibling(const char *target, const char *suffix)
+{
+	char *path;
+	size_t len = strlen(target);
+
+	/* Trailing slashes would put the sibling inside the target */
+	while (len > 1 && target[len - 1] == '/')
+		len--;
+
+	path = malloc(len + strlen(suffix) + 16);
+	if (!path) {
+		PERROR("malloc", ENOMEM);
+		return NULL;
+	}
+	sprintf(path, "%.*s%s", (int)len, target, suffix);
+
+	return path;
+}
+
+static int remove_entry(const char *fpath, const struct stat *st, int type,
+			struct FTW *ftw)
+{
+	if (remove(fpath) == -1) {
+		PERROR(fpath, errno);
+		return errno;
+	}
+	return 0;
+}
+
+static int remove_tree(const char *path)
+{
+	if (access(path, F_OK) == -1)
+		return 0;
+	return nftw(path, remove_entry, 16, FTW_DEPTH|FTW_PHYS);
+}
+
+/* Remove a tree in a detached process, so the caller need not wait */
+static void remove_tree_background(const char *path)
+{
+	pid_t pid;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork", errno);
+		return;
+	}
+
+	if (pid == 0) {
+		if (fork() == 0)
+			_exit(remove_tree(path) ? EXIT_FAILURE : EXIT_SUCCESS);
+		_exit(EXIT_SUCCESS);
+	}
+
+	waitpid(pid, NULL, 0);
+}
+
+static int sync_path(const char *path, int whole_fs)
+{
+	int fd, ret;
+
+	fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1) {
+		PERROR(path, errno);
+		return errno;
+	}
+
+	ret = whole_fs ? syncfs(fd) : fsync(fd);
+	if (ret == -1) {
+		PERROR(whole_fs ? "syncfs" : "fsync", errno);
+		ret = errno;
+	}
+	close(fd);
+
+	return ret;
+}
+
+static int sync_parent(const char *path)
+{
+	char *parent;
+	int err;
+
+	parent = sibling(path, "/..");
+	if (!parent)
+		return ENOMEM;
+
+	err = sync_path(parent, 0);
+	free(parent);
+
+	return err;
+}
+
+static int prepare_tree(const char *src, const char *new)
+{
+	char *cmd;
+	int err;
+
+	err = remove_tree(new);
+	if (err)
+		return err;
+
+	if (rename(src, new) == 0)
+		return 0;
+	if (errno != EXDEV) {
+		PERROR("rename", errno);
+		return errno;
+	}
+
+	cmd = malloc(strlen(src) + strlen(new) + 16);
+	if (!cmd)
+		return ENOMEM;
+	sprintf(cmd, "cp -a \"%s\" \"%s\"", src, new);
+	err = run_shcmd(cmd);
+	if (err) {
+		PERROR(cmd, err);
+	}
+	free(cmd);
+
+	return err;
+}
+
+/* Get rid of the replaced tree, now found at old */
+static int retire_tree(const char *target, const char *old, int flags)
+{
+	char *keep, *trash;
+	int err = 0;
+
+	if (!(flags & INSTALL_FLAG_KEEP_OLD)) {
+		remove_tree_background(old);
+		return 0;
+	}
+
+	keep = sibling(target, OLD_SUFFIX);
+	trash = sibling(target, TRASH_SUFFIX);
+	if (!keep || !trash) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	/* The tree kept from the install before is of no use anymore */
+	if (access(keep, F_OK) == 0) {
+		sprintf(trash + strlen(trash), ".%d", (int)getpid());
+		if (rename(keep, trash) == -1) {
+			PERROR("rename", errno);
+			err = errno;
+			goto out;
+		}
+		remove_tree_background(trash);
+	}
+
+	if (rename(old, keep) == -1) {
+		PERROR("rename", errno);
+		err = errno;
+		goto out;
+	}
+	INFO("kept %s", keep);
+
+out:
+	free(keep);
+	free(trash);
+	return err;
+}
+
+int install_tree(const char *src, const char *target, int flags)
+{
+	char *new;
+	int err, exists;
+
+	new = sibling(target, NEW_SUFFIX);
+	if (!new)
+		return ENOMEM;
+
+	INFO("+ install %s -> %s", src, target);
+	err = prepare_tree(src, new);
+	if (err)
+		goto out;
+
+	err = sync_path(new, 1);
+	if (err)
+		goto out;
+
+	exists = access(target, F_OK) == 0;
+	if (rename2(new, target, exists ? RENAME_EXCHANGE :
+		    RENAME_NOREPLACE) == -1) {
+		PERROR("renameat2", errno);
+		err = errno;
+		goto out;
+	}
+
+	err = sync_parent(target);
+	if (err)
+		goto out;
+
+	if (exists)
+		err = retire_tree(target, new, flags);
+
+out:
+	free(new);
+	return err;
+}
+
+int install_rollback(const char *target)
+{
+	char *old;
+	int err;
+
+	old = sibling(target, OLD_SUFFIX);
+	if (!old)
+		return ENOMEM;
+
+	INFO("+ rollback %s <- %s", target, old);
+	if (rename2(old, target, RENAME_EXCHANGE) == -1) {
+		PERROR("renameat2", errno);
+		err = errno;
+	} else {
+		err = sync_parent(target);
+	}
+
+	free(old);
+	return err;
+}
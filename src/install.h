@@ -0,0 +1,29 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INSTALL_H_
+#define _INSTALL_H_
+
+/* Keep the replaced tree as <target>.dupdate-old for install_rollback() */
+#define INSTALL_FLAG_KEEP_OLD		(1 << 0)
+
+int install_tree(const char *src, const char *target, int flags);
+int install_rollback(const char *target);
+
+#endif /* _INSTALL_H_ */
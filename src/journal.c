@@ -0,0 +1,319 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "journal.h"
+
+/*
+ * Extraction progress journal.
+ *
+ * The journal is kept in the extraction directory, and starts with a line
+ * identifying the image by its SHA-256 digest.  Each following line records
+ * a completed member as
+ *
+ *   <offset> <end> <type> <sha256> <name>
+ *
+ * where offset and end are the positions of the member in the uncompressed
+ * tar stream.  Lines are only appended after the data of the members they
+ * describe has been synced, and this is done in batches to avoid a sync per
+ * file.  A restarted extraction can thus continue at the end of the last
+ * journaled member.
+ */
+
+#define JOURNAL_MAGIC			"dupdate-journal"
+#define JOURNAL_BATCH_BYTES		(16 * 1024 * 1024)
+#define JOURNAL_BATCH_COUNT		256
+
+struct journal {
+	int fd;
+	int dirfd;
+	unsigned long long resume;
+	char *pending;
+	size_t pending_len;
+	size_t pending_size;
+	unsigned pending_count;
+	unsigned long long pending_bytes;
+};
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("write", errno);
+			return errno;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int journal_reset(struct journal *j, const char *hex)
+{
+	char header[sizeof(JOURNAL_MAGIC) + SHA256_HEX_LEN + 1];
+	int err;
+
+	if (ftruncate(j->fd, 0) == -1) {
+		PERROR("ftruncate", errno);
+		return errno;
+	}
+
+	sprintf(header, "%s %s\n", JOURNAL_MAGIC, hex);
+	err = write_all(j->fd, header, strlen(header));
+	if (err)
+		return err;
+
+	if (fdatasync(j->fd) == -1 || fsync(j->dirfd) == -1) {
+		PERROR("fsync", errno);
+		return errno;
+	}
+
+	j->resume = 0;
+	return 0;
+}
+
+/* Check that the data of a journaled member actually made it to disk */
+static int verify_member(struct journal *j, char type, const char *hex,
+			 const char *name)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+	char file_hex[SHA256_HEX_LEN];
+	int fd, err;
+
+	if (type != '0' && type != '7')
+		return 1;
+
+	fd = openat(j->dirfd, name, O_RDONLY|O_NOFOLLOW);
+	if (fd == -1)
+		return 0;
+	err = sha256_fd(fd, digest);
+	close(fd);
+	if (err)
+		return 0;
+
+	sha256_hex(digest, file_hex);
+	return strcmp(hex, file_hex) == 0;
+}
+
+static int journal_load(struct journal *j, const char *hex)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	off_t line_start = 0, last_start = 0;
+	unsigned long long offset, end;
+	unsigned long long last_offset = 0, last_end = 0;
+	char type, last_type = 0;
+	char member_hex[SHA256_HEX_LEN], last_hex[SHA256_HEX_LEN];
+	char *last_name = NULL;
+	int n, fd, err = 0;
+
+	fd = dup(j->fd);
+	if (fd == -1 || !(f = fdopen(fd, "r"))) {
+		PERROR("fdopen", errno);
+		return errno;
+	}
+	rewind(f);
+
+	len = getline(&line, &line_size, f);
+	if (len <= 0 || strncmp(line, JOURNAL_MAGIC " ", 16) != 0 ||
+	    strncmp(line + 16, hex, SHA256_HEX_LEN - 1) != 0) {
+		fclose(f);
+		free(line);
+		return journal_reset(j, hex);
+	}
+	line_start = len;
+
+	while ((len = getline(&line, &line_size, f)) > 0) {
+		if (line[len - 1] != '\n')
+			break;
+		line[len - 1] = '\0';
+		if (sscanf(line, "%llu %llu %c %64s %n", &offset, &end,
+			   &type, member_hex, &n) != 4)
+			break;
+		last_start = line_start;
+		last_offset = offset;
+		last_end = end;
+		last_type = type;
+		strcpy(last_hex, member_hex);
+		free(last_name);
+		last_name = strdup(line + n);
+		line_start += len;
+	}
+	fclose(f);
+	free(line);
+
+	j->resume = last_end;
+	if (last_name && !verify_member(j, last_type, last_hex, last_name)) {
+		INFO("journaled member not intact: %s", last_name);
+		j->resume = last_offset;
+		line_start = last_start;
+	}
+	free(last_name);
+
+	/* Drop anything not fully journaled */
+	if (ftruncate(j->fd, line_start) == -1) {
+		PERROR("ftruncate", errno);
+		err = errno;
+	}
+
+	return err;
+}
+
+int journal_open(struct journal **journal, const char *dir,
+		 const unsigned char *image_digest)
+{
+	struct journal *j;
+	char hex[SHA256_HEX_LEN];
+	int err;
+
+	j = calloc(1, sizeof(*j));
+	if (!j) {
+		PERROR("calloc", ENOMEM);
+		return ENOMEM;
+	}
+	j->fd = -1;
+
+	j->dirfd = open(dir, O_RDONLY|O_DIRECTORY);
+	if (j->dirfd == -1) {
+		PERROR("open", errno);
+		err = errno;
+		goto err;
+	}
+
+	j->fd = openat(j->dirfd, JOURNAL_FILE,
+		       O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+	if (j->fd == -1) {
+		PERROR("open", errno);
+		err = errno;
+		goto err;
+	}
+
+	sha256_hex(image_digest, hex);
+	err = journal_load(j, hex);
+	if (err)
+		goto err;
+
+	if (j->resume) {
+		INFO("resuming extraction at offset %llu", j->resume);
+	}
+
+	*journal = j;
+	return 0;
+
+err:
+	journal_close(j);
+	return err;
+}
+
+unsigned long long journal_resume(struct journal *j)
+{
+	return j->resume;
+}
+
+int journal_add(struct untar_member *m, void *priv)
+{
+	struct journal *j = priv;
+	char hex[SHA256_HEX_LEN];
+	size_t need;
+	char *p;
+
+	need = 3 * 21 + SHA256_HEX_LEN + strlen(m->name) + 2;
+	if (j->pending_len + need > j->pending_size) {
+		p = realloc(j->pending, j->pending_size + need + 4096);
+		if (!p) {
+			PERROR("realloc", ENOMEM);
+			return ENOMEM;
+		}
+		j->pending = p;
+		j->pending_size += need + 4096;
+	}
+
+	sha256_hex(m->digest, hex);
+	j->pending_len += sprintf(j->pending + j->pending_len,
+				  "%llu %llu %c %s %s\n", m->offset, m->end,
+				  m->type ? m->type : '0', hex,
+				  strchr(m->name, '\n') ? "?" : m->name);
+	j->pending_count++;
+	j->pending_bytes += m->size;
+
+	if (j->pending_bytes >= JOURNAL_BATCH_BYTES ||
+	    j->pending_count >= JOURNAL_BATCH_COUNT)
+		return journal_commit(j);
+
+	return 0;
+}
+
+int journal_commit(struct journal *j)
+{
+	int err;
+
+	if (!j->pending_len)
+		return 0;
+
+	/* Member data must be on disk before the journal says so */
+	if (syncfs(j->dirfd) == -1) {
+		PERROR("syncfs", errno);
+		return errno;
+	}
+
+	err = write_all(j->fd, j->pending, j->pending_len);
+	if (err)
+		return err;
+
+	if (fdatasync(j->fd) == -1) {
+		PERROR("fdatasync", errno);
+		return errno;
+	}
+
+	j->pending_len = 0;
+	j->pending_count = 0;
+	j->pending_bytes = 0;
+
+	return 0;
+}
+
+void journal_close(struct journal *j)
+{
+	if (j->fd != -1)
+		close(j->fd);
+	if (j->dirfd != -1)
+		close(j->dirfd);
+	free(j->pending);
+	free(j);
+}
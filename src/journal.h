@@ -0,0 +1,36 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "untar.h"
+
+#define JOURNAL_FILE			".dupdate-journal"
+
+struct journal;
+
+int journal_open(struct journal **journal, const char *dir,
+		 const unsigned char *image_digest);
+unsigned long long journal_resume(struct journal *journal);
+int journal_add(struct untar_member *member, void *journal);
+int journal_commit(struct journal *journal);
+void journal_close(struct journal *journal);
+
+#endif /* _JOURNAL_H_ */
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "common.h"
+
+/*
+ * Logging.
+ *
+ * Once log_start() has been called, messages are formatted by the caller
+ * into a slot of a ring buffer, and written out by a background thread, so
+ * that neither extraction nor the inotifyd event loop waits for a slow
+ * syslog daemon or a blocked stdout pipe.  Slots are claimed lock-free, as
+ * in a bounded MPMC queue with a single consumer: each slot has a sequence
+ * number telling whether it is free for the producer at that position, or
+ * holds a message for the consumer.  When the ring is full, messages are
+ * dropped and counted instead of waiting.
+ *
+ * Messages too long for a slot are allocated instead.  Messages before
+ * log_start() and in forked children are written synchronously.  The ring
+ * is flushed at exit, before forking and running commands, so that their
+ * output comes in order, and what can be of it is written out on fatal
+ * signals.  Outside of syslog, messages are stamped with the time since
+ * logging started.
+ */
+
+#define LOG_SLOTS			256
+#define LOG_SLOT_SIZE			512
+#define LOG_FLUSH_POLL_NS		(1000 * 1000)
+
+struct log_slot {
+	unsigned long seq;
+	int prio;
+	struct timespec time;
+	char *big;			/* Message not fitting in msg */
+	char msg[LOG_SLOT_SIZE];
+};
+
+static struct {
+	struct log_slot slots[LOG_SLOTS];
+	unsigned long head;		/* Next slot to write out */
+	unsigned long tail;		/* Next slot to claim */
+	unsigned long dropped;
+	int wake;			/* Futex the writer sleeps on */
+	int sleeping;
+	int running;
+	struct timespec start;
+} ring;
+
+int _log_to_syslog = 0;
+
+void log_to_syslog(int enable)
+{
+	if (enable)
+		_log_to_syslog = 1;
+}
+
+static void write_msg(int prio, const struct timespec *time, const char *msg)
+{
+	struct timespec now, rel;
+	FILE *f = prio == LOG_INFO ? stdout : stderr;
+
+	if (_log_to_syslog) {
+		syslog(prio, "%s", msg);
+		return;
+	}
+
+	if (!time) {
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		time = &now;
+	}
+	if (!ring.start.tv_sec && !ring.start.tv_nsec)
+		ring.start = *time;
+
+	rel.tv_sec = time->tv_sec - ring.start.tv_sec;
+	rel.tv_nsec = time->tv_nsec - ring.start.tv_nsec;
+	if (rel.tv_nsec < 0) {
+		rel.tv_sec--;
+		rel.tv_nsec += 1000000000;
+	}
+	fprintf(f, "[%5ld.%03ld] %s\n", (long)rel.tv_sec,
+		rel.tv_nsec / 1000000, msg);
+}
+
+static void futex(int *uaddr, int op, int val)
+{
+	syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static struct log_slot *ready_slot(void)
+{
+	struct log_slot *s = &ring.slots[ring.head % LOG_SLOTS];
+
+	if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != ring.head + 1)
+		return NULL;
+
+	return s;
+}
+
+static void *writer(void *arg)
+{
+	unsigned long dropped, reported = 0;
+	struct log_slot *s;
+	char msg[64];
+	int wake;
+
+	for (;;) {
+		while ((s = ready_slot())) {
+			write_msg(s->prio, &s->time, s->big ? s->big : s->msg);
+			free(s->big);
+			s->big = NULL;
+			__atomic_store_n(&s->seq, ring.head + LOG_SLOTS,
+					 __ATOMIC_RELEASE);
+			__atomic_store_n(&ring.head, ring.head + 1,
+					 __ATOMIC_RELEASE);
+		}
+
+		dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+		if (dropped != reported) {
+			snprintf(msg, sizeof(msg), "log: %lu messages dropped",
+				 dropped - reported);
+			write_msg(LOG_ERR, NULL, msg);
+			reported = dropped;
+		}
+		fflush(stdout);
+
+		/*
+		 * Producers wake us when they see this, after publishing.
+		 * Either they see sleeping set or we see their slot: the
+		 * fences pair with the one in wake_writer().
+		 */
+		wake = __atomic_load_n(&ring.wake, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&ring.sleeping, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!ready_slot())
+			futex(&ring.wake, FUTEX_WAIT_PRIVATE, wake);
+		__atomic_store_n(&ring.sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+
+	return NULL;
+}
+
+/* Called after publishing a slot, which must be ordered before the load */
+static void wake_writer(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring.sleeping, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&ring.wake, 1, __ATOMIC_SEQ_CST);
+		futex(&ring.wake, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+void log_flush(void)
+{
+	struct timespec poll = { 0, LOG_FLUSH_POLL_NS };
+	unsigned long tail;
+
+	if (!ring.running)
+		return;
+
+	tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+	while (__atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) < tail) {
+		wake_writer();
+		nanosleep(&poll, NULL);
+	}
+
+	/* Not to be written twice by a forked child */
+	fflush(stdout);
+}
+
+/* Hand the ring to the parent, and log synchronously in children */
+static void forked(void)
+{
+	ring.running = 0;
+}
+
+/* Write out what is left, with nothing but write() */
+static void fatal(int sig)
+{
+	struct log_slot *s;
+	const char *msg;
+
+	while (ring.running && !_log_to_syslog && (s = ready_slot())) {
+		msg = s->big ? s->big : s->msg;
+		if (write(STDERR_FILENO, msg, strlen(msg)) == -1 ||
+		    write(STDERR_FILENO, "\n", 1) == -1)
+			break;
+		ring.head++;
+	}
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+void log_start(void)
+{
+	static const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE,
+					     SIGABRT };
+	static int once;
+	sigset_t all, old;
+	pthread_t thread;
+	unsigned i;
+	int err;
+
+	if (ring.running)
+		return;
+
+	for (i = 0 ; i < LOG_SLOTS ; i++) {
+		ring.slots[i].seq = i;
+		ring.slots[i].big = NULL;
+	}
+	ring.head = ring.tail = 0;
+	if (!ring.start.tv_sec && !ring.start.tv_nsec)
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ring.start);
+
+	if (!once) {
+		pthread_atfork(log_flush, NULL, forked);
+		atexit(log_flush);
+		for (i = 0 ; i < sizeof(fatal_signals) / sizeof(int) ; i++)
+			signal(fatal_signals[i], fatal);
+		once = 1;
+	}
+
+	/* Signals are for the threads doing the work */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&thread, NULL, writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		PERROR("pthread_create", err);
+		return;
+	}
+	pthread_detach(thread);
+
+	ring.running = 1;
+}
+
+void log_msg(int prio, const char *format, ...)
+{
+	struct log_slot *s;
+	unsigned long pos;
+	va_list ap;
+	int len;
+
+	if (!ring.running) {
+		char *msg;
+
+		va_start(ap, format);
+		len = vasprintf(&msg, format, ap);
+		va_end(ap);
+		if (len == -1)
+			return;
+		write_msg(prio, NULL, msg);
+		free(msg);
+		return;
+	}
+
+	pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+	for (;;) {
+		s = &ring.slots[pos % LOG_SLOTS];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos) {
+			/* Still holding a message from a lap before */
+			if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) < pos) {
+				__atomic_add_fetch(&ring.dropped, 1,
+						   __ATOMIC_RELAXED);
+				return;
+			}
+			pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&ring.tail, &pos, pos + 1, 0,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	s->prio = prio;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &s->time);
+	va_start(ap, format);
+	len = vsnprintf(s->msg, sizeof(s->msg), format, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(s->msg)) {
+		va_start(ap, format);
+		if (vasprintf(&s->big, format, ap) == -1)
+			s->big = NULL;
+		va_end(ap);
+	}
+
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	wake_writer();
+}
@@ -0,0 +1,421 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "manifest.h"
+#include "trace.h"
+
+/*
+ * Manifest of install steps.
+ *
+ * Each non-empty line of the manifest, except for comments starting with
+ * '#', describes a step as
+ *
+ *   <name> [after=<step>[,<step>...]] [device=<device>] : <command>
+ *
+ * The command is run with /bin/sh in the workdir, once all steps listed in
+ * after= have completed successfully.  Steps with the same device are run
+ * one at a time, in manifest order, while everything else may run in
+ * parallel, up to the given number of jobs.  When a step fails, no further
+ * steps are started, but those already running are allowed to complete.
+ */
+
+enum step_state {
+	STEP_PENDING,
+	STEP_RUNNING,
+	STEP_DONE,
+	STEP_FAILED,
+};
+
+struct step {
+	char *name;
+	char *device;
+	char *after;
+	char *cmd;
+	int *deps;
+	int num_deps;
+	enum step_state state;
+	pid_t pid;
+	struct timespec start;
+	unsigned long long trace_start;
+};
+
+struct manifest {
+	struct step *steps;
+	int num_steps;
+};
+
+static const char *state_names[] = {
+	[STEP_PENDING] = "not run",
+	[STEP_RUNNING] = "running",
+	[STEP_DONE] = "done",
+	[STEP_FAILED] = "failed",
+};
+
+static int find_step(struct manifest *m, const char *name)
+{
+	int i;
+
+	for (i = 0 ; i < m->num_steps ; i++)
+		if (strcmp(m->steps[i].name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+static void free_step(struct step *step)
+{
+	free(step->name);
+	free(step->device);
+	free(step->after);
+	free(step->cmd);
+	free(step->deps);
+}
+
+/* Set *field to a copy of str, which is given only once */
+static int set_field(char **field, const char *str, const char *attr,
+		     int lineno)
+{
+	if (*field) {
+		ERROR("manifest line %d: duplicate %s", lineno, attr);
+		return EINVAL;
+	}
+
+	*field = strdup(str);
+	if (!*field) {
+		ERROR("out of memory");
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+static int parse_line(struct manifest *m, char *line, int lineno)
+{
+	struct step *step, *steps;
+	char *cmd, *tok, *save;
+	int err = 0;
+
+	cmd = strchr(line, ':');
+	if (!cmd) {
+		ERROR("manifest line %d: missing command", lineno);
+		return EINVAL;
+	}
+	*cmd++ = '\0';
+	while (*cmd == ' ' || *cmd == '\t')
+		cmd++;
+
+	steps = realloc(m->steps, (m->num_steps + 1) * sizeof(*steps));
+	if (!steps) {
+		ERROR("out of memory");
+		return ENOMEM;
+	}
+	m->steps = steps;
+	step = &m->steps[m->num_steps];
+	memset(step, 0, sizeof(*step));
+
+	for (tok = strtok_r(line, " \t", &save) ; tok && !err ;
+	     tok = strtok_r(NULL, " \t", &save)) {
+		if (!step->name)
+			err = set_field(&step->name, tok, "name", lineno);
+		else if (strncmp(tok, "after=", 6) == 0)
+			err = set_field(&step->after, tok + 6, "after",
+					lineno);
+		else if (strncmp(tok, "device=", 7) == 0)
+			err = set_field(&step->device, tok + 7, "device",
+					lineno);
+		else {
+			ERROR("manifest line %d: unknown attribute %s",
+			      lineno, tok);
+			err = EINVAL;
+		}
+	}
+	if (err)
+		goto out;
+
+	if (!step->name || !*cmd) {
+		ERROR("manifest line %d: invalid step", lineno);
+		err = EINVAL;
+		goto out;
+	}
+	if (find_step(m, step->name) != -1) {
+		ERROR("manifest line %d: duplicate step %s", lineno,
+		      step->name);
+		err = EINVAL;
+		goto out;
+	}
+
+	err = set_field(&step->cmd, cmd, "command", lineno);
+	if (err)
+		goto out;
+	m->num_steps++;
+
+out:
+	/* Not counted in num_steps, so not freed with the manifest */
+	if (err)
+		free_step(step);
+	return err;
+}
+
+static int resolve_deps(struct manifest *m)
+{
+	struct step *step;
+	char *tok, *save;
+	int i, dep;
+
+	for (i = 0 ; i < m->num_steps ; i++) {
+		step = &m->steps[i];
+		if (!step->after)
+			continue;
+
+		step->deps = calloc(m->num_steps, sizeof(*step->deps));
+		if (!step->deps)
+			return ENOMEM;
+
+		for (tok = strtok_r(step->after, ",", &save) ; tok ;
+		     tok = strtok_r(NULL, ",", &save)) {
+			dep = find_step(m, tok);
+			if (dep == -1 || dep == i) {
+				ERROR("step %s: invalid dependency %s",
+				      step->name, tok);
+				return EINVAL;
+			}
+			step->deps[step->num_deps++] = dep;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_manifest(struct manifest *m, const char *path)
+{
+	FILE *f;
+	char *line = NULL, *p;
+	size_t size = 0;
+	int lineno = 0, err = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		PERROR(path, errno);
+		return errno;
+	}
+
+	while (getline(&line, &size, f) != -1) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		for (p = line ; *p == ' ' || *p == '\t' ; p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+		err = parse_line(m, p, lineno);
+		if (err)
+			break;
+	}
+
+	free(line);
+	fclose(f);
+
+	if (!err)
+		err = resolve_deps(m);
+
+	return err;
+}
+
+static void free_manifest(struct manifest *m)
+{
+	int i;
+
+	for (i = 0 ; i < m->num_steps ; i++)
+		free_step(&m->steps[i]);
+	free(m->steps);
+}
+
+static int step_ready(struct manifest *m, int i)
+{
+	struct step *step = &m->steps[i];
+	int j;
+
+	for (j = 0 ; j < step->num_deps ; j++)
+		if (m->steps[step->deps[j]].state != STEP_DONE)
+			return 0;
+
+	/* Only one step at a time per device, in manifest order */
+	if (step->device) {
+		for (j = 0 ; j < i ; j++) {
+			if (m->steps[j].device &&
+			    strcmp(m->steps[j].device, step->device) == 0 &&
+			    m->steps[j].state != STEP_DONE)
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int start_step(struct step *step)
+{
+	INFO("+ [%s] %s", step->name, step->cmd);
+	fflush(NULL);
+	step->pid = fork();
+	if (step->pid == -1) {
+		PERROR("fork", errno);
+		return errno;
+	}
+
+	if (step->pid == 0) {
+		setenv("DUPDATE_STEP", step->name, 1);
+		if (step->device)
+			setenv("DUPDATE_DEVICE", step->device, 1);
+		execl("/bin/sh", "sh", "-c", step->cmd, NULL);
+		_exit(127);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &step->start);
+	step->trace_start = trace_now();
+	step->state = STEP_RUNNING;
+
+	return 0;
+}
+
+static struct step *find_pid(struct manifest *m, pid_t pid)
+{
+	int i;
+
+	for (i = 0 ; i < m->num_steps ; i++)
+		if (m->steps[i].state == STEP_RUNNING &&
+		    m->steps[i].pid == pid)
+			return &m->steps[i];
+
+	return NULL;
+}
+
+static void finish_step(struct step *step, int status)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - step->start.tv_sec) +
+		(now.tv_nsec - step->start.tv_nsec) / 1e9;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		step->state = STEP_DONE;
+		INFO("step %s: done in %.1f s", step->name, secs);
+	} else {
+		step->state = STEP_FAILED;
+		if (WIFSIGNALED(status)) {
+			ERROR("step %s: terminated by signal %d after %.1f s",
+			      step->name, WTERMSIG(status), secs);
+		} else {
+			ERROR("step %s: failed with %d after %.1f s",
+			      step->name, WEXITSTATUS(status), secs);
+		}
+	}
+
+	trace_child_span(step->name, step->pid, step->trace_start, step->cmd,
+			 WIFEXITED(status) ? WEXITSTATUS(status) :
+			 128 + WTERMSIG(status));
+}
+
+static int run_steps(struct manifest *m, int jobs)
+{
+	struct step *step;
+	int running = 0, failed = 0, status, i, err = 0;
+	pid_t pid;
+
+	for (;;) {
+		for (i = 0 ; !failed && i < m->num_steps && running < jobs ;
+		     i++) {
+			step = &m->steps[i];
+			if (step->state != STEP_PENDING || !step_ready(m, i))
+				continue;
+			err = start_step(step);
+			if (err) {
+				failed = 1;
+				break;
+			}
+			running++;
+		}
+
+		if (!running)
+			break;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("waitpid", errno);
+			return errno;
+		}
+
+		step = find_pid(m, pid);
+		if (!step)
+			continue;
+		running--;
+		finish_step(step, status);
+		if (step->state == STEP_FAILED) {
+			failed = 1;
+			err = EIO;
+		}
+	}
+
+	for (i = 0 ; i < m->num_steps ; i++) {
+		if (m->steps[i].state == STEP_PENDING) {
+			if (!failed) {
+				ERROR("step %s: dependencies cannot be met",
+				      m->steps[i].name);
+				err = EINVAL;
+			}
+			INFO("step %s: %s", m->steps[i].name,
+			     state_names[m->steps[i].state]);
+		}
+	}
+
+	return err;
+}
+
+int manifest_run(const char *path, int jobs)
+{
+	struct manifest m = { .steps = NULL, .num_steps = 0 };
+	int err;
+
+	err = parse_manifest(&m, path);
+	if (err)
+		goto out;
+
+	INFO("running %d steps from %s with %d jobs", m.num_steps, path,
+	     jobs);
+	err = run_steps(&m, jobs);
+
+out:
+	free_manifest(&m);
+	return err;
+}
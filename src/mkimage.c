@@ -0,0 +1,1317 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+
+#include "common.h"
+#include "sha256.h"
+#include "chunk.h"
+
+/*
+ * Image builder.
+ *
+ * Packs a directory into a tar image laid out for dupdate to install fast:
+ *
+ *  - The tar stream is cut into frames, each compressed on its own by a
+ *    separate compressor process, up to --jobs at a time, and the frames
+ *    are concatenated.  Any frame can be decoded without the ones before
+ *    it.
+ *  - Members whose data does not compress are put in frames of their own,
+ *    which are stored as raw zstd frames (or compressed at the lowest xz
+ *    level), so neither side spends time on them.
+ *  - Directories come first, then the command and manifest, then files of
+ *    at least --stream-min bytes, largest first, so that dupdate
+ *    --stream-min can start the command on them early, then the rest.
+ *  - The first member, .dupdate-index, lists the stream offset, size and
+ *    SHA-256 of every member, for commands to check the files against.
+ *  - With --chunk-store, files are replaced by chunk indexes, and only the
+ *    chunks missing from the store are carried in the image.
+ *
+ * The install cost on the target is estimated from the bytes and files
+ * written, at the rates given for it.
+ */
+
+#define INDEX_NAME			".dupdate-index"
+#define BLOCK_SIZE			512
+#define SAMPLE_SIZE			(64 * 1024)
+#define STORED_MIN			(64 * 1024)
+#define STORED_ENTROPY			7.9	/* Bits per byte */
+#define ZSTD_BLOCK_MAX			(128 * 1024)
+#define DEFAULT_FRAME_SIZE		(4 * 1024 * 1024)
+#define DEFAULT_STREAM_MIN		(1024 * 1024)
+#define DEFAULT_CHUNK_MIN		(1024 * 1024)
+#define DEFAULT_TARGET_RATE		(20 * 1024 * 1024)
+#define DEFAULT_TARGET_OPS		1000
+
+enum compress {
+	COMPRESS_ZSTD,
+	COMPRESS_XZ,
+	COMPRESS_NONE,
+};
+
+static const char *compress_names[] = {
+	[COMPRESS_ZSTD] = "zstd",
+	[COMPRESS_XZ] = "xz",
+	[COMPRESS_NONE] = "none",
+};
+
+struct mkimage_args {
+	char *dir;		/* Tree to pack */
+	char *image;		/* Image to write */
+	enum compress compress;	/* Compressor of frames */
+	int level;		/* Compression level, 0 for default */
+	int jobs;		/* Frames compressed in parallel */
+	unsigned long long frame_size;	/* Uncompressed size of frames */
+	unsigned long long stream_min;	/* Files to put first */
+	char *tarcmd;		/* Command of the image */
+	char *manifest;		/* Manifest of steps of the image */
+	char *chunkstore;	/* Chunks the target has */
+	unsigned long long chunk_min;	/* Files to replace by chunks */
+	unsigned long long target_rate;	/* Bytes/s written on target */
+	unsigned long long target_ops;	/* Files/s created on target */
+};
+
+static struct mkimage_args args;
+
+/* Order of members in the image */
+enum member_class {
+	CLASS_INDEX,
+	CLASS_DIR,
+	CLASS_COMMAND,
+	CLASS_LARGE,
+	CLASS_OTHER,
+};
+
+struct member {
+	char *name;			/* Path in the image */
+	char *linkname;			/* Target of hard and symbolic links */
+	char type;			/* Tar typeflag */
+	struct stat st;
+	enum member_class class;
+	int stored;			/* Data does not compress */
+	char *src;			/* File the data is read from */
+	unsigned long long src_offset;
+	unsigned long long size;	/* Size of data */
+	char *data;			/* Data in memory, instead of src */
+	unsigned char digest[SHA256_DIGEST_LEN];
+	unsigned long long offset;	/* Stream offset of first header */
+};
+
+static struct member *members;
+static size_t num_members, max_members;
+
+static struct chunk_store *store;
+static unsigned char *carried;		/* Digests of chunks carried */
+static size_t num_carried, max_carried;
+static unsigned long chunks_total;
+
+/* Frames being compressed, oldest first */
+struct frame {
+	unsigned char *buf;
+	size_t len;
+	int stored;
+	pid_t pid;			/* Compressor, or 0 */
+	int out;			/* Its output */
+};
+
+static struct frame *frames;
+static unsigned frame_head, frame_count;
+static struct frame cur;		/* Frame being filled */
+static int image_fd = -1;
+
+static unsigned long long image_size;
+static unsigned num_frames, num_stored;
+
+static struct member *add_member(const char *name)
+{
+	struct member *m;
+
+	if (num_members == max_members) {
+		max_members = max_members ? 2 * max_members : 256;
+		m = realloc(members, max_members * sizeof(*m));
+		if (!m)
+			return NULL;
+		members = m;
+	}
+
+	m = &members[num_members];
+	memset(m, 0, sizeof(*m));
+	m->name = strdup(name);
+	if (!m->name)
+		return NULL;
+	m->class = CLASS_OTHER;
+	num_members++;
+
+	return m;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("write", errno);
+			return errno;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			PERROR("pread", errno);
+			return errno;
+		}
+		if (n == 0) {
+			ERROR("file shrunk while packing it");
+			return EIO;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/* Shannon entropy of a sample, in bits per byte */
+static double entropy(const unsigned char *buf, size_t len)
+{
+	unsigned long count[256] = { 0 };
+	double e = 0, p;
+	size_t i;
+
+	for (i = 0 ; i < len ; i++)
+		count[buf[i]]++;
+
+	for (i = 0 ; i < 256 ; i++) {
+		if (!count[i])
+			continue;
+		p = (double)count[i] / len;
+		e -= p * log2(p);
+	}
+
+	return e;
+}
+
+/* Hash the data of a regular file, and tell whether it compresses */
+static int scan_data(struct member *m)
+{
+	unsigned char *buf;
+	struct sha256 ctx;
+	ssize_t n;
+	int fd, err = 0, first = 1;
+
+	fd = open(m->src, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		PERROR(m->src, errno);
+		return errno;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	buf = malloc(SAMPLE_SIZE);
+	if (!buf) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	sha256_init(&ctx);
+	while ((n = read(fd, buf, SAMPLE_SIZE)) > 0) {
+		if (first && m->size >= STORED_MIN)
+			m->stored = entropy(buf, n) > STORED_ENTROPY;
+		first = 0;
+		sha256_update(&ctx, buf, n);
+	}
+	if (n == -1) {
+		PERROR(m->src, errno);
+		err = errno;
+	}
+	sha256_final(&ctx, m->digest);
+
+	free(buf);
+	close(fd);
+	return err;
+}
+
+/* Add digest to the sorted set of carried chunks, unless already there */
+static int carry(const unsigned char *digest, int *added)
+{
+	size_t lo = 0, hi = num_carried, mid;
+	unsigned char *p;
+	int cmp;
+
+	*added = 0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = memcmp(carried + mid * SHA256_DIGEST_LEN, digest,
+			     SHA256_DIGEST_LEN);
+		if (cmp == 0)
+			return 0;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (num_carried == max_carried) {
+		max_carried = max_carried ? 2 * max_carried : 256;
+		p = realloc(carried, max_carried * SHA256_DIGEST_LEN);
+		if (!p)
+			return ENOMEM;
+		carried = p;
+	}
+
+	p = carried + lo * SHA256_DIGEST_LEN;
+	memmove(p + SHA256_DIGEST_LEN, p,
+		(num_carried - lo) * SHA256_DIGEST_LEN);
+	memcpy(p, digest, SHA256_DIGEST_LEN);
+	num_carried++;
+	*added = 1;
+
+	return 0;
+}
+
+struct chunk_index {
+	size_t file;			/* Member being chunked */
+	char *text;			/* Index being built */
+	size_t len, size;
+	unsigned long long offset;	/* Of the next chunk in the file */
+};
+
+/* Add a chunk to the index, and carry it if the store does not have it */
+static int index_chunk(const void *data, size_t len,
+		       const unsigned char *digest, void *priv)
+{
+	struct chunk_index *ci = priv;
+	char hex[SHA256_HEX_LEN], name[PATH_MAX];
+	struct member *m;
+	int added = 0, err;
+	char *t;
+
+	sha256_hex(digest, hex);
+	if (ci->size - ci->len < SHA256_HEX_LEN + 24) {
+		ci->size = ci->size ? 2 * ci->size : 4096;
+		t = realloc(ci->text, ci->size);
+		if (!t)
+			return ENOMEM;
+		ci->text = t;
+	}
+	ci->len += sprintf(ci->text + ci->len, "%s %zu\n", hex, len);
+	chunks_total++;
+
+	if (!chunk_store_has(store, digest)) {
+		err = carry(digest, &added);
+		if (err)
+			return err;
+	}
+	if (added) {
+		snprintf(name, sizeof(name), CHUNK_DIR "/%s", hex);
+		m = add_member(name);
+		if (!m)
+			return ENOMEM;
+		m->type = '0';
+		m->st.st_mode = S_IFREG | 0644;
+		m->st.st_mtime = time(NULL);
+		m->src = strdup(members[ci->file].src);
+		if (!m->src)
+			return ENOMEM;
+		m->src_offset = ci->offset;
+		m->size = len;
+		memcpy(m->digest, digest, SHA256_DIGEST_LEN);
+	}
+
+	ci->offset += len;
+	return 0;
+}
+
+/* Replace the data of a file by an index of its chunks */
+static int chunk_file(size_t i)
+{
+	struct chunk_index ci = { .file = i };
+	struct sha256 ctx;
+	char *src, name[PATH_MAX];
+	struct member *m;
+	int fd, err;
+
+	src = members[i].src;
+	fd = open(src, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		PERROR(src, errno);
+		return errno;
+	}
+	err = chunk_split(fd, index_chunk, &ci);
+	close(fd);
+	if (err) {
+		free(ci.text);
+		return err;
+	}
+
+	/* The file becomes its index, named after it */
+	m = &members[i];
+	snprintf(name, sizeof(name), "%s" CHUNK_INDEX_SUFFIX, m->name);
+	free(m->name);
+	m->name = strdup(name);
+	free(m->src);
+	m->src = NULL;
+	m->data = ci.text ? ci.text : strdup("");
+	m->size = ci.len;
+	m->stored = 0;
+	m->class = CLASS_OTHER;
+	if (!m->name || !m->data)
+		return ENOMEM;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, m->data, m->size);
+	sha256_final(&ctx, m->digest);
+
+	return 0;
+}
+
+/* nftw() callbacks have no private data */
+static size_t walk_root_len;
+
+static int scan_entry(const char *fpath, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	const char *rel = fpath + walk_root_len;
+	char target[PATH_MAX];
+	struct member *m;
+	ssize_t len;
+
+	while (*rel == '/')
+		rel++;
+	if (*rel == '\0')
+		return 0;
+
+	m = add_member(rel);
+	if (!m) {
+		ERROR("out of memory");
+		return ENOMEM;
+	}
+	m->st = *st;
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFDIR:
+		m->type = '5';
+		m->class = CLASS_DIR;
+		break;
+	case S_IFREG:
+		m->type = '0';
+		m->size = st->st_size;
+		m->src = strdup(fpath);
+		if (!m->src)
+			return ENOMEM;
+		if (strcmp(rel, args.tarcmd) == 0 ||
+		    strcmp(rel, args.manifest) == 0)
+			m->class = CLASS_COMMAND;
+		else if (args.stream_min && m->size >= args.stream_min)
+			m->class = CLASS_LARGE;
+		return scan_data(m);
+	case S_IFLNK:
+		m->type = '2';
+		len = readlink(fpath, target, sizeof(target) - 1);
+		if (len == -1) {
+			PERROR(fpath, errno);
+			return errno;
+		}
+		target[len] = '\0';
+		m->linkname = strdup(target);
+		if (!m->linkname)
+			return ENOMEM;
+		break;
+	case S_IFCHR:
+		m->type = '3';
+		break;
+	case S_IFBLK:
+		m->type = '4';
+		break;
+	case S_IFIFO:
+		m->type = '6';
+		break;
+	default:
+		INFO("skipping %s", fpath);
+		num_members--;
+		free(m->name);
+		break;
+	}
+
+	return 0;
+}
+
+static int compare_members(const void *a, const void *b)
+{
+	const struct member *ma = a, *mb = b;
+
+	if (ma->class != mb->class)
+		return ma->class < mb->class ? -1 : 1;
+	if (ma->class == CLASS_LARGE && ma->size != mb->size)
+		return ma->size > mb->size ? -1 : 1;
+	return strcmp(ma->name, mb->name);
+}
+
+/* Later links to the same file become hard links to the first */
+static int link_members(void)
+{
+	size_t i, j;
+
+	for (i = 0 ; i < num_members ; i++) {
+		if (members[i].type != '0' || members[i].st.st_nlink < 2)
+			continue;
+		for (j = i + 1 ; j < num_members ; j++) {
+			if (members[j].type != '0' ||
+			    members[j].st.st_dev != members[i].st.st_dev ||
+			    members[j].st.st_ino != members[i].st.st_ino)
+				continue;
+			members[j].type = '1';
+			members[j].size = 0;
+			members[j].stored = 0;
+			members[j].linkname = strdup(members[i].name);
+			if (!members[j].linkname)
+				return ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static int scan_tree(void)
+{
+	size_t i, n;
+	int err;
+
+	walk_root_len = strlen(args.dir);
+	err = nftw(args.dir, scan_entry, 16, FTW_PHYS);
+	if (err == -1) {
+		PERROR("nftw", errno);
+		return errno;
+	}
+	if (err)
+		return err;
+
+	if (args.chunkstore) {
+		err = chunk_store_open(&store, args.chunkstore);
+		if (err)
+			return err;
+
+		/* Hard linked files must stay whole to be linked to */
+		n = num_members;
+		for (i = 0 ; i < n && !err ; i++)
+			if (members[i].type == '0' &&
+			    members[i].st.st_nlink == 1 &&
+			    members[i].class != CLASS_COMMAND &&
+			    members[i].size >= args.chunk_min)
+				err = chunk_file(i);
+		if (err)
+			return err;
+
+		if (num_members > n) {
+			struct member *m = add_member(CHUNK_DIR);
+
+			if (!m)
+				return ENOMEM;
+			m->type = '5';
+			m->class = CLASS_DIR;
+			m->st.st_mode = S_IFDIR | 0755;
+			m->st.st_mtime = time(NULL);
+		}
+
+		chunk_store_close(store);
+		store = NULL;
+	}
+
+	qsort(members, num_members, sizeof(*members), compare_members);
+
+	return link_members();
+}
+
+/* Values that don't fit are kept out of the header by the caller */
+static void put_octal(char *field, size_t size, unsigned long long v)
+{
+	char buf[24];
+
+	snprintf(buf, sizeof(buf), "%0*llo", (int)size - 1, v);
+	memcpy(field, buf, size - 1);
+}
+
+/* Append a "<len> key=value\n" pax record */
+static size_t pax_record(char *buf, const char *key, const char *value)
+{
+	size_t len, n;
+
+	len = strlen(key) + strlen(value) + 3;
+	for (n = 1 ; ; n++) {
+		if (snprintf(NULL, 0, "%zu", len + n) == (int)n)
+			break;
+	}
+
+	return sprintf(buf, "%zu %s=%s\n", len + n, key, value);
+}
+
+static void finish_header(char *block)
+{
+	unsigned sum = 0;
+	int i;
+
+	memset(block + 148, ' ', 8);
+	for (i = 0 ; i < BLOCK_SIZE ; i++)
+		sum += (unsigned char)block[i];
+	snprintf(block + 148, 8, "%06o", sum);
+	block[155] = ' ';
+}
+
+/* Where a long name splits into ustar prefix and name, or 0 if it can't */
+static size_t name_split(const char *name)
+{
+	size_t len = strlen(name), split;
+
+	for (split = len > 101 ? len - 101 : 1 ; split < len && split <= 155 ;
+	     split++)
+		if (name[split] == '/')
+			return split;
+
+	return 0;
+}
+
+static void fill_header(char *block, const char *name, char type,
+			const struct stat *st, unsigned long long size,
+			const char *linkname)
+{
+	size_t len = strlen(name), split;
+
+	memset(block, 0, BLOCK_SIZE);
+
+	/* Long names are split into prefix and name where possible, and
+	 * otherwise left to a pax header */
+	split = len > 100 ? name_split(name) : 0;
+	if (split) {
+		memcpy(block + 345, name, split);
+		memcpy(block, name + split + 1, len - split - 1);
+	} else {
+		memcpy(block, name, len > 100 ? 100 : len);
+	}
+
+	put_octal(block + 100, 8, st->st_mode & 07777);
+	put_octal(block + 108, 8, st->st_uid & 07777777);
+	put_octal(block + 116, 8, st->st_gid & 07777777);
+	put_octal(block + 124, 12, size);
+	put_octal(block + 136, 12, st->st_mtime > 0 ? st->st_mtime : 0);
+	block[156] = type;
+	if (linkname)
+		strncpy(block + 157, linkname, 100);
+	memcpy(block + 257, "ustar\0" "00", 8);
+	if (type == '3' || type == '4') {
+		put_octal(block + 329, 8, major(st->st_rdev));
+		put_octal(block + 337, 8, minor(st->st_rdev));
+	}
+	finish_header(block);
+}
+
+/*
+ * Headers of a member, with a pax header in front for what ustar can't hold.
+ * Returns the length, a multiple of BLOCK_SIZE, or 0 when out of memory.
+ */
+static size_t build_header(struct member *m, char **header)
+{
+	size_t len, pax_len = 0;
+	char *pax, *h;
+	char num[24];
+
+	pax = malloc(2 * PATH_MAX + 128);
+	if (!pax)
+		return 0;
+
+	if (strlen(m->name) > 100 && !name_split(m->name))
+		pax_len += pax_record(pax + pax_len, "path", m->name);
+	if (m->linkname && strlen(m->linkname) > 100)
+		pax_len += pax_record(pax + pax_len, "linkpath", m->linkname);
+	if (m->size >= 077777777777ULL) {
+		sprintf(num, "%llu", m->size);
+		pax_len += pax_record(pax + pax_len, "size", num);
+	}
+
+	len = BLOCK_SIZE;
+	if (pax_len)
+		len += BLOCK_SIZE + (pax_len + BLOCK_SIZE - 1) /
+			BLOCK_SIZE * BLOCK_SIZE;
+
+	h = calloc(1, len);
+	if (!h) {
+		free(pax);
+		return 0;
+	}
+	if (pax_len) {
+		fill_header(h, "././@PaxHeader", 'x', &m->st, pax_len, NULL);
+		memcpy(h + BLOCK_SIZE, pax, pax_len);
+	}
+	fill_header(h + len - BLOCK_SIZE, m->name, m->type, &m->st,
+		    m->size >= 077777777777ULL ? 0 : m->size, m->linkname);
+
+	free(pax);
+	*header = h;
+	return len;
+}
+
+static unsigned long long member_len(struct member *m)
+{
+	unsigned long long len;
+	char *header;
+
+	len = build_header(m, &header);
+	if (!len)
+		return 0;
+	free(header);
+
+	return len + (m->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+/* Index of offset, size and digest of all members, of a fixed length */
+static int build_index(struct member *index)
+{
+	char hex[SHA256_HEX_LEN];
+	size_t i, len = 0, size = 0;
+	char *text;
+
+	for (i = 1 ; i < num_members ; i++)
+		size += strlen(members[i].name) + 32 + SHA256_HEX_LEN;
+
+	text = malloc(size + 1);
+	if (!text)
+		return ENOMEM;
+
+	for (i = 1 ; i < num_members ; i++) {
+		if (members[i].type == '0')
+			sha256_hex(members[i].digest, hex);
+		else
+			memset(hex, '-', SHA256_HEX_LEN - 1);
+		hex[SHA256_HEX_LEN - 1] = '\0';
+		len += sprintf(text + len, "%012llx %12llu %s %s\n",
+			       members[i].offset, members[i].size, hex,
+			       members[i].name);
+	}
+
+	free(index->data);
+	index->data = text;
+	index->size = len;
+
+	return 0;
+}
+
+static int layout(void)
+{
+	struct member *index;
+	unsigned long long offset = 0, len;
+	size_t i;
+	int err;
+
+	index = add_member(INDEX_NAME);
+	if (!index)
+		return ENOMEM;
+	index->type = '0';
+	index->class = CLASS_INDEX;
+	index->st.st_mode = S_IFREG | 0644;
+	index->st.st_mtime = time(NULL);
+	qsort(members, num_members, sizeof(*members), compare_members);
+
+	/* The index is the same length whatever the offsets */
+	err = build_index(&members[0]);
+	if (err)
+		return err;
+
+	for (i = 0 ; i < num_members ; i++) {
+		members[i].offset = offset;
+		len = member_len(&members[i]);
+		if (!len)
+			return ENOMEM;
+		offset += len;
+	}
+
+	return build_index(&members[0]);
+}
+
+static void put_le(unsigned char *p, unsigned long long v, int len)
+{
+	int i;
+
+	for (i = 0 ; i < len ; i++, v >>= 8)
+		p[i] = v;
+}
+
+/* Raw blocks in a zstd frame, which any zstd decoder just copies */
+static int write_raw_zstd(const unsigned char *buf, size_t len)
+{
+	unsigned char header[13], block[3];
+	size_t n;
+	int err;
+
+	memcpy(header, "\x28\xb5\x2f\xfd", 4);
+	/* Single segment, 8 byte content size */
+	header[4] = 0xe0;
+	put_le(header + 5, len, 8);
+	err = write_full(image_fd, header, sizeof(header));
+
+	do {
+		n = len < ZSTD_BLOCK_MAX ? len : ZSTD_BLOCK_MAX;
+		put_le(block, (n << 3) | (n == len), 3);
+		if (!err)
+			err = write_full(image_fd, block, sizeof(block));
+		if (!err)
+			err = write_full(image_fd, buf, n);
+		image_size += sizeof(block) + n;
+		buf += n;
+		len -= n;
+	} while (len && !err);
+	image_size += sizeof(header);
+
+	return err;
+}
+
+static int start_compressor(struct frame *f)
+{
+	char level[8];
+	int in;
+
+	in = memfd_create("frame", MFD_CLOEXEC);
+	f->out = memfd_create("compressed", MFD_CLOEXEC);
+	if (in == -1 || f->out == -1) {
+		PERROR("memfd_create", errno);
+		return errno;
+	}
+	if (write_full(in, f->buf, f->len) ||
+	    lseek(in, 0, SEEK_SET) == -1) {
+		close(in);
+		return EIO;
+	}
+	free(f->buf);
+	f->buf = NULL;
+
+	/* Only xz frames are compressed when stored */
+	if (f->stored)
+		strcpy(level, "-0");
+	else if (args.level)
+		sprintf(level, "-%d", args.level);
+	else
+		strcpy(level, args.compress == COMPRESS_XZ ? "-6" : "-3");
+
+	f->pid = fork();
+	if (f->pid == -1) {
+		PERROR("fork", errno);
+		close(in);
+		return errno;
+	}
+	if (f->pid == 0) {
+		dup2(in, STDIN_FILENO);
+		dup2(f->out, STDOUT_FILENO);
+		if (args.compress == COMPRESS_XZ)
+			execlp("xz", "xz", "-q", "-c", "-T1", level, NULL);
+		else
+			execlp("zstd", "zstd", "-q", "-c", "-T1", level, NULL);
+		_exit(127);
+	}
+
+	close(in);
+	return 0;
+}
+
+static int finish_frame(struct frame *f)
+{
+	struct stat st;
+	int status, err = 0;
+
+	if (f->pid) {
+		if (waitpid(f->pid, &status, 0) == -1) {
+			PERROR("waitpid", errno);
+			return errno;
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			ERROR("%s failed", compress_names[args.compress]);
+			return EIO;
+		}
+		if (fstat(f->out, &st) == -1 ||
+		    lseek(f->out, 0, SEEK_SET) == -1) {
+			PERROR("memfd", errno);
+			return errno;
+		}
+		err = copy_stream(f->out, image_fd);
+		image_size += st.st_size;
+		close(f->out);
+	} else if (args.compress == COMPRESS_ZSTD) {
+		err = write_raw_zstd(f->buf, f->len);
+	} else {
+		err = write_full(image_fd, f->buf, f->len);
+		image_size += f->len;
+	}
+
+	free(f->buf);
+	memset(f, 0, sizeof(*f));
+	return err;
+}
+
+/* Hand the current frame over for compression */
+static int submit_frame(void)
+{
+	struct frame *f;
+	int err;
+
+	if (!cur.len)
+		return 0;
+
+	if (frame_count == (unsigned)args.jobs) {
+		err = finish_frame(&frames[frame_head]);
+		frame_head = (frame_head + 1) % args.jobs;
+		frame_count--;
+		if (err)
+			return err;
+	}
+
+	f = &frames[(frame_head + frame_count++) % args.jobs];
+	*f = cur;
+	memset(&cur, 0, sizeof(cur));
+	num_frames++;
+	if (f->stored)
+		num_stored++;
+
+	/* Stored frames are written as they are, when their turn comes */
+	if (args.compress == COMPRESS_NONE ||
+	    (f->stored && args.compress == COMPRESS_ZSTD))
+		return 0;
+
+	return start_compressor(f);
+}
+
+static int drain_frames(void)
+{
+	int err = submit_frame();
+
+	while (frame_count) {
+		if (!err)
+			err = finish_frame(&frames[frame_head]);
+		else
+			finish_frame(&frames[frame_head]);
+		frame_head = (frame_head + 1) % args.jobs;
+		frame_count--;
+	}
+
+	return err;
+}
+
+/* Room for at least one more byte in the current frame */
+static int frame_room(void)
+{
+	int stored = cur.stored, err;
+
+	if (cur.buf && cur.len < args.frame_size)
+		return 0;
+
+	if (cur.buf) {
+		err = submit_frame();
+		if (err)
+			return err;
+		cur.stored = stored;
+	}
+
+	cur.buf = malloc(args.frame_size);
+	if (!cur.buf) {
+		ERROR("out of memory");
+		return ENOMEM;
+	}
+
+	return 0;
+}
+
+static int emit(const void *data, size_t len)
+{
+	size_t n;
+	int err;
+
+	while (len) {
+		err = frame_room();
+		if (err)
+			return err;
+		n = args.frame_size - cur.len;
+		if (n > len)
+			n = len;
+		memcpy(cur.buf + cur.len, data, n);
+		cur.len += n;
+		data = (const char *)data + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int emit_file(struct member *m)
+{
+	unsigned long long done = 0;
+	size_t n;
+	int fd, err = 0;
+
+	fd = open(m->src, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		PERROR(m->src, errno);
+		return errno;
+	}
+	posix_fadvise(fd, m->src_offset, m->size, POSIX_FADV_SEQUENTIAL);
+
+	/* Read straight into the frames */
+	while (!err && done < m->size) {
+		err = frame_room();
+		if (err)
+			break;
+		n = args.frame_size - cur.len;
+		if (n > m->size - done)
+			n = m->size - done;
+		err = pread_full(fd, cur.buf + cur.len, n,
+				 m->src_offset + done);
+		cur.len += n;
+		done += n;
+	}
+
+	close(fd);
+	return err;
+}
+
+static int write_member(struct member *m)
+{
+	static const char zeros[BLOCK_SIZE];
+	char *header;
+	size_t len;
+	int err;
+
+	/* Incompressible data gets frames of its own */
+	if (m->stored) {
+		err = submit_frame();
+		if (err)
+			return err;
+		cur.stored = 1;
+	}
+
+	len = build_header(m, &header);
+	if (!len)
+		return ENOMEM;
+	err = emit(header, len);
+	free(header);
+
+	if (!err && m->data)
+		err = emit(m->data, m->size);
+	else if (!err && m->size)
+		err = emit_file(m);
+	if (!err && m->size % BLOCK_SIZE)
+		err = emit(zeros, BLOCK_SIZE - m->size % BLOCK_SIZE);
+
+	if (!err && m->stored) {
+		err = submit_frame();
+		cur.stored = 0;
+	}
+
+	return err;
+}
+
+static int write_image(void)
+{
+	static const char zeros[2 * BLOCK_SIZE];
+	size_t i;
+	int err = 0;
+
+	frames = calloc(args.jobs, sizeof(*frames));
+	if (!frames)
+		return ENOMEM;
+
+	image_fd = open(args.image, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (image_fd == -1) {
+		PERROR(args.image, errno);
+		return errno;
+	}
+
+	for (i = 0 ; i < num_members && !err ; i++)
+		err = write_member(&members[i]);
+	if (!err)
+		err = emit(zeros, sizeof(zeros));
+
+	if (!err)
+		err = drain_frames();
+	else
+		drain_frames();
+
+	if (close(image_fd) == -1 && !err) {
+		PERROR("close", errno);
+		err = errno;
+	}
+	if (err)
+		unlink(args.image);
+
+	return err;
+}
+
+/* What installing the image takes on the target, at the rates given */
+static void report(void)
+{
+	unsigned long long data = 0, space = 0, stream = 2 * BLOCK_SIZE;
+	unsigned long files = 0;
+	double write_secs, ops_secs;
+	size_t i;
+
+	for (i = 0 ; i < num_members ; i++) {
+		files++;
+		stream += member_len(&members[i]);
+		if (members[i].type != '0')
+			continue;
+		data += members[i].size;
+		space += (members[i].size + 4095) / 4096 * 4096;
+	}
+
+	write_secs = (double)data / args.target_rate;
+	ops_secs = (double)files / args.target_ops;
+
+	INFO("%s: %lu members, %llu bytes in %u frames (%u stored), "
+	     "%llu bytes %s (%.1f%%)", args.image, files, stream, num_frames,
+	     num_stored, image_size, compress_names[args.compress],
+	     stream ? 100.0 * image_size / stream : 0);
+	if (args.chunkstore) {
+		INFO("chunks: %lu in files, %zu carried in the image",
+		     chunks_total, num_carried);
+	}
+	INFO("estimated install: %.1f s (%.1f s writing %llu bytes, "
+	     "%.1f s creating %lu files), taking %llu bytes",
+	     write_secs + ops_secs, write_secs, data, ops_secs, files, space);
+}
+
+static const char *usage = "\
+Usage: %s [OPTIONS] <DIR> <IMAGE>\n\n\
+Arguments:\n\
+  <DIR>                 Directory to pack\n\
+  <IMAGE>               dupdate tar image to write\n\
+Options:\n\
+  -c, --compress=<PROG> Compressor of frames: zstd, xz or none\n\
+			[default: zstd]\n\
+  -L, --level=<N>       Compression level [default: that of PROG]\n\
+  -j, --jobs=<N>        Number of frames compressed in parallel\n\
+			[default: number of CPUs]\n\
+  --frame-size=<SIZE>   Uncompressed size of independently compressed\n\
+			frames [default: 4M]\n\
+  --stream-min=<SIZE>   Put files of at least SIZE bytes first, largest\n\
+			first, for dupdate --stream-min [default: 1M]\n\
+  -x, --tarcmd=<FILE>   Command of the image, put ahead of all files\n\
+			[default: run]\n\
+  --manifest=<FILE>     Manifest of the image, put ahead of all files\n\
+			[default: dupdate.manifest]\n\
+  --chunk-store=<DIR>   Replace files of at least --chunk-min bytes by\n\
+			indexes of their chunks, and carry only the chunks\n\
+			not in DIR, the chunk store of the target\n\
+  --chunk-min=<SIZE>    Smallest file to replace by chunks [default: 1M]\n\
+  --target-rate=<SIZE>  Bytes per second the target writes, for the\n\
+			install estimate [default: 20M]\n\
+  --target-ops=<N>      Files per second the target creates, for the\n\
+			install estimate [default: 1000]\n\
+  -h, --help            Display help\n\
+";
+
+/* Long-only options */
+enum {
+	OPT_FRAME_SIZE = 256,
+	OPT_STREAM_MIN,
+	OPT_MANIFEST,
+	OPT_CHUNK_STORE,
+	OPT_CHUNK_MIN,
+	OPT_TARGET_RATE,
+	OPT_TARGET_OPS,
+};
+
+static const struct option longopts[] = {
+	{"compress",	required_argument,	NULL, 'c'},
+	{"level",	required_argument,	NULL, 'L'},
+	{"jobs",	required_argument,	NULL, 'j'},
+	{"frame-size",	required_argument,	NULL, OPT_FRAME_SIZE},
+	{"stream-min",	required_argument,	NULL, OPT_STREAM_MIN},
+	{"tarcmd",	required_argument,	NULL, 'x'},
+	{"manifest",	required_argument,	NULL, OPT_MANIFEST},
+	{"chunk-store",	required_argument,	NULL, OPT_CHUNK_STORE},
+	{"chunk-min",	required_argument,	NULL, OPT_CHUNK_MIN},
+	{"target-rate",	required_argument,	NULL, OPT_TARGET_RATE},
+	{"target-ops",	required_argument,	NULL, OPT_TARGET_OPS},
+	{"help",	no_argument,		NULL, 'h'},
+	{NULL,		0,			NULL,  0 }
+};
+
+static const char *optstring = "c:L:j:x:h";
+
+static int parse_compress(const char *str)
+{
+	int i;
+
+	for (i = 0 ; i <= COMPRESS_NONE ; i++) {
+		if (strcmp(str, compress_names[i]) == 0) {
+			args.compress = i;
+			return 0;
+		}
+	}
+
+	return EINVAL;
+}
+
+static void parse_args(int argc, char *argv[])
+{
+	int opt, longindex, err;
+
+	args.frame_size = DEFAULT_FRAME_SIZE;
+	args.stream_min = DEFAULT_STREAM_MIN;
+	args.chunk_min = DEFAULT_CHUNK_MIN;
+	args.target_rate = DEFAULT_TARGET_RATE;
+	args.target_ops = DEFAULT_TARGET_OPS;
+
+	while ((opt = getopt_long(argc, argv, optstring, longopts,
+				  &longindex)) != -1) {
+		err = 0;
+
+		switch (opt) {
+
+		case 'c':
+			err = parse_compress(optarg);
+			break;
+
+		case 'L':
+			args.level = atoi(optarg);
+			if (args.level < 1 || args.level > 19)
+				err = EINVAL;
+			break;
+
+		case 'j':
+			args.jobs = atoi(optarg);
+			if (args.jobs < 1)
+				err = EINVAL;
+			break;
+
+		case OPT_FRAME_SIZE:
+			err = parse_size(optarg, &args.frame_size);
+			if (!err && (args.frame_size < BLOCK_SIZE ||
+				     args.frame_size > SIZE_MAX / 2))
+				err = EINVAL;
+			break;
+
+		case OPT_STREAM_MIN:
+			err = parse_size(optarg, &args.stream_min);
+			break;
+
+		case 'x':
+			err = strset(&args.tarcmd, optarg, PATH_MAX);
+			break;
+
+		case OPT_MANIFEST:
+			err = strset(&args.manifest, optarg, PATH_MAX);
+			break;
+
+		case OPT_CHUNK_STORE:
+			err = strset(&args.chunkstore, optarg,
+				     PATH_MAX - NAME_MAX - 16);
+			break;
+
+		case OPT_CHUNK_MIN:
+			err = parse_size(optarg, &args.chunk_min);
+			break;
+
+		case OPT_TARGET_RATE:
+			err = parse_size(optarg, &args.target_rate);
+			if (!err && !args.target_rate)
+				err = EINVAL;
+			break;
+
+		case OPT_TARGET_OPS:
+			err = parse_size(optarg, &args.target_ops);
+			if (!err && !args.target_ops)
+				err = EINVAL;
+			break;
+
+		case 'h':
+			printf(usage, argv[0]);
+			exit(EXIT_SUCCESS);
+			break;
+
+		default:
+			exit(EXIT_FAILURE);
+		}
+
+		if (err) {
+			ERROR("invalid argument to option %s",
+			      argv[optind - 1]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (argc - optind != 2) {
+		ERROR("directory and image arguments required");
+		exit(EXIT_FAILURE);
+	}
+	args.dir = argv[optind];
+	args.image = argv[optind + 1];
+
+	if (!args.tarcmd)
+		args.tarcmd = "run";
+	if (!args.manifest)
+		args.manifest = "dupdate.manifest";
+	if (!args.jobs)
+		args.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (args.jobs < 1)
+		args.jobs = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	parse_args(argc, argv);
+
+	log_start();
+
+	if (scan_tree() || layout() || write_image())
+		exit(EXIT_FAILURE);
+
+	report();
+
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "progress.h"
+
+/*
+ * Progress reporting.
+ *
+ * Events are sent as JSON objects, one per datagram, to a Unix datagram
+ * socket bound by whoever wants to follow along, such as
+ *
+ *   {"pid":123,"image":"/tmp/a.dupdate","event":"phase","phase":"extract"}
+ *   {"pid":123,"image":"/tmp/a.dupdate","event":"progress",
+ *    "phase":"extract","done":1048576,"total":4194304,"rate":2097152,
+ *    "eta":1.5}
+ *   {"pid":123,"image":"/tmp/a.dupdate","event":"result","error":0,
+ *    "message":"Success"}
+ *
+ * with total and eta left out when the size is not known up front.  The
+ * image is left out of events sent by inotifyd, which instead tells what
+ * it dispatched, and the result of that.  Events are never waited for:
+ * when nobody listens, or the listener falls behind, they are dropped.
+ */
+
+#define PROGRESS_INTERVAL_MS		250
+#define PROGRESS_MSG_MAX		(2 * PATH_MAX)
+
+static struct {
+	int fd;
+	struct sockaddr_un addr;
+	char image[PATH_MAX + 64];	/* JSON escaped */
+	const char *phase;
+	struct timespec start;		/* Of the phase */
+	struct timespec last;		/* Progress sent */
+} p = { .fd = -1 };
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void send_event(const char *format, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static void send_event(const char *format, ...)
+{
+	char msg[PROGRESS_MSG_MAX];
+	va_list ap;
+	int len;
+
+	len = snprintf(msg, sizeof(msg), "{\"pid\":%d,", getpid());
+	if (p.image[0])
+		len += snprintf(msg + len, sizeof(msg) - len,
+				"\"image\":\"%s\",", p.image);
+	va_start(ap, format);
+	len += vsnprintf(msg + len, sizeof(msg) - len, format, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(msg) - 1)
+		return;
+	msg[len++] = '}';
+
+	sendto(p.fd, msg, len, MSG_DONTWAIT|MSG_NOSIGNAL,
+	       (struct sockaddr *)&p.addr, sizeof(p.addr));
+}
+
+int progress_open(const char *path)
+{
+	if (strlen(path) >= sizeof(p.addr.sun_path)) {
+		ERROR("socket path too long: %s", path);
+		return ENAMETOOLONG;
+	}
+
+	p.fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (p.fd == -1) {
+		PERROR("socket", errno);
+		return errno;
+	}
+
+	p.addr.sun_family = AF_UNIX;
+	strcpy(p.addr.sun_path, path);
+
+	return 0;
+}
+
+void progress_begin(const char *image)
+{
+	json_escape(p.image, sizeof(p.image), image);
+	p.phase = NULL;
+}
+
+void progress_phase(const char *phase)
+{
+	if (p.fd == -1)
+		return;
+
+	p.phase = phase;
+	clock_gettime(CLOCK_MONOTONIC, &p.start);
+	p.last = p.start;
+	send_event("\"event\":\"phase\",\"phase\":\"%s\"", phase);
+}
+
+/* Bytes done in the current phase, out of total if not 0 */
+void progress_bytes(unsigned long long done, unsigned long long total)
+{
+	struct timespec now;
+	double secs, rate;
+
+	if (p.fd == -1 || !p.phase)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (elapsed(&p.last, &now) * 1000 < PROGRESS_INTERVAL_MS)
+		return;
+	p.last = now;
+
+	secs = elapsed(&p.start, &now);
+	rate = secs > 0 ? done / secs : 0;
+
+	if (total && rate > 0 && done <= total)
+		send_event("\"event\":\"progress\",\"phase\":\"%s\","
+			   "\"done\":%llu,\"total\":%llu,\"rate\":%.0f,"
+			   "\"eta\":%.1f", p.phase, done, total, rate,
+			   (total - done) / rate);
+	else
+		send_event("\"event\":\"progress\",\"phase\":\"%s\","
+			   "\"done\":%llu,\"rate\":%.0f", p.phase, done, rate);
+}
+
+/* An event handed to a command by inotifyd */
+void progress_dispatch(const char *watch, const char *events,
+		       const char *name)
+{
+	char watch_json[PATH_MAX + 64], name_json[NAME_MAX * 6 + 1];
+
+	if (p.fd == -1)
+		return;
+
+	json_escape(watch_json, sizeof(watch_json), watch);
+	json_escape(name_json, sizeof(name_json), name ? name : "");
+	send_event("\"event\":\"dispatch\",\"watch\":\"%s\","
+		   "\"events\":\"%s\",\"name\":\"%s\"", watch_json, events,
+		   name_json);
+}
+
+void progress_result(int err)
+{
+	if (p.fd == -1)
+		return;
+
+	send_event("\"event\":\"result\",\"error\":%d,\"message\":\"%s\"",
+		   err, strerror(err));
+	p.phase = NULL;
+}
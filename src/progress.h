@@ -0,0 +1,32 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PROGRESS_H_
+#define _PROGRESS_H_
+
+int progress_open(const char *path);
+void progress_begin(const char *image);
+void progress_phase(const char *phase);
+void progress_bytes(unsigned long long done, unsigned long long total);
+void progress_dispatch(const char *watch, const char *events,
+		       const char *name);
+void progress_result(int err);
+
+#endif /* _PROGRESS_H_ */
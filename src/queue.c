@@ -0,0 +1,394 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+
+#include "common.h"
+#include "sha256.h"
+#include "queue.h"
+
+/*
+ * Update queue.
+ *
+ * Images arriving in the queue directory are collected until the directory
+ * has been quiet for a moment, and then processed one at a time, each in a
+ * child process.  Before each image is processed, the queue is pruned:
+ *
+ *  - Images with identical content are collapsed into one.
+ *  - Image names are split into a group and a version, as in
+ *    "rootfs-1.2.3.dupdate", and only the newest version within each group
+ *    is kept.  Older versions are cancelled, as they would be overwritten
+ *    right away anyway.
+ *
+ * The remaining images are processed in version order, lowest first, across
+ * groups, and in order of arrival for equal versions.  When the inotify event
+ * queue overflows, the directory is scanned again, so no image is missed.
+ */
+
+#define QUEUE_SUFFIX			".dupdate"
+#define QUEUE_SETTLE_MS			1000
+
+struct queue_entry {
+	char *name;
+	char *group;
+	const char *version;
+	unsigned char digest[SHA256_DIGEST_LEN];
+	unsigned long seq;
+	struct queue_entry *next;
+};
+
+struct queue {
+	const char *dir;
+	const struct queue_ops *ops;
+	int fd;
+	unsigned long seq;
+	struct queue_entry *entries;
+};
+
+static int is_image_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > strlen(QUEUE_SUFFIX) &&
+		strcmp(name + len - strlen(QUEUE_SUFFIX), QUEUE_SUFFIX) == 0;
+}
+
+static char *entry_path(struct queue *q, const char *name)
+{
+	static char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", q->dir, name);
+	return path;
+}
+
+/* Split "<group>-<version>.dupdate" (or '_' separated) */
+static int split_name(struct queue_entry *e)
+{
+	size_t len = strlen(e->name) - strlen(QUEUE_SUFFIX);
+	char *p;
+
+	e->group = strndup(e->name, len);
+	if (!e->group)
+		return ENOMEM;
+
+	e->version = "";
+	for (p = e->group ; *p ; p++) {
+		if ((*p == '-' || *p == '_') && isdigit((unsigned char)p[1])) {
+			*p = '\0';
+			e->version = p + 1;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void free_entry(struct queue_entry *e)
+{
+	free(e->name);
+	free(e->group);
+	free(e);
+}
+
+static void add_entry(struct queue *q, const char *name)
+{
+	struct queue_entry *e, **pp;
+	struct stat st;
+
+	if (!is_image_name(name))
+		return;
+
+	if (stat(entry_path(q, name), &st) == -1 || !S_ISREG(st.st_mode))
+		return;
+
+	/* A rewritten image replaces the queued one */
+	for (pp = &q->entries ; *pp ; pp = &(*pp)->next) {
+		if (strcmp((*pp)->name, name) == 0) {
+			e = *pp;
+			*pp = e->next;
+			free_entry(e);
+			break;
+		}
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e || !(e->name = strdup(name)) || split_name(e)) {
+		ERROR("out of memory");
+		if (e)
+			free_entry(e);
+		return;
+	}
+
+	if (sha256_file(entry_path(q, name), e->digest)) {
+		free_entry(e);
+		return;
+	}
+
+	e->seq = q->seq++;
+
+	/* Keep the list in order of arrival */
+	for (pp = &q->entries ; *pp ; pp = &(*pp)->next)
+		;
+	*pp = e;
+
+	INFO("queued: %s", name);
+}
+
+static void remove_entry(struct queue *q, struct queue_entry *e)
+{
+	struct queue_entry **pp;
+
+	for (pp = &q->entries ; *pp ; pp = &(*pp)->next) {
+		if (*pp == e) {
+			*pp = e->next;
+			free_entry(e);
+			return;
+		}
+	}
+}
+
+static void cancel_entry(struct queue *q, struct queue_entry *e,
+			 const char *reason, const struct queue_entry *by)
+{
+	INFO("cancelled: %s (%s %s)", e->name, reason, by->name);
+	q->ops->cancel(entry_path(q, e->name), reason);
+	remove_entry(q, e);
+}
+
+static void prune(struct queue *q)
+{
+	struct queue_entry *a, *b, *next;
+	int again;
+
+	do {
+		again = 0;
+		for (a = q->entries ; a && !again ; a = a->next) {
+			for (b = a->next ; b ; b = next) {
+				next = b->next;
+
+				if (memcmp(a->digest, b->digest,
+					   sizeof(a->digest)) == 0) {
+					/* Keep the first arrived */
+					cancel_entry(q, b, "duplicate of", a);
+					continue;
+				}
+
+				if (strcmp(a->group, b->group) != 0)
+					continue;
+
+				if (strverscmp(a->version, b->version) > 0) {
+					cancel_entry(q, b, "superseded by", a);
+				} else {
+					/* Newer image takes the place of the
+					 * older one in the queue */
+					b->seq = a->seq;
+					cancel_entry(q, a, "superseded by", b);
+					again = 1;
+					break;
+				}
+			}
+		}
+	} while (again);
+}
+
+static struct queue_entry *next_entry(struct queue *q)
+{
+	struct queue_entry *e, *first = NULL;
+	int cmp;
+
+	for (e = q->entries ; e ; e = e->next) {
+		if (!first) {
+			first = e;
+			continue;
+		}
+		cmp = strverscmp(e->version, first->version);
+		if (cmp < 0 || (cmp == 0 && e->seq < first->seq))
+			first = e;
+	}
+
+	return first;
+}
+
+static int scan_dir(struct queue *q)
+{
+	DIR *dir;
+	struct dirent *de;
+
+	dir = opendir(q->dir);
+	if (!dir) {
+		PERROR("opendir", errno);
+		return errno;
+	}
+
+	while ((de = readdir(dir)))
+		add_entry(q, de->d_name);
+
+	closedir(dir);
+	return 0;
+}
+
+/* Read available inotify events, waiting at most timeout ms for the first */
+static int read_events(struct queue *q, int timeout)
+{
+	char buf[16 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	struct inotify_event *event;
+	struct pollfd pfd = { .fd = q->fd, .events = POLLIN };
+	ssize_t len;
+	char *p;
+	int ret, overflow = 0;
+
+	ret = poll(&pfd, 1, timeout);
+	if (ret == -1) {
+		if (errno == EINTR)
+			return 0;
+		PERROR("poll", errno);
+		return -1;
+	}
+	if (ret == 0)
+		return 0;
+
+	len = read(q->fd, buf, sizeof(buf));
+	if (len == -1) {
+		PERROR("read", errno);
+		return -1;
+	}
+
+	for (p = buf ; p < buf + len ; p += sizeof(*event) + event->len) {
+		event = (struct inotify_event *)p;
+		if (event->mask & IN_Q_OVERFLOW) {
+			ERROR("inotify event queue overflow");
+			overflow = 1;
+			continue;
+		}
+		if (event->len)
+			add_entry(q, event->name);
+	}
+
+	/* Images may have arrived without an event */
+	if (overflow && scan_dir(q))
+		return -1;
+
+	return 1;
+}
+
+static int process_entry(struct queue *q, struct queue_entry *e)
+{
+	char *path = entry_path(q, e->name);
+	int status;
+	pid_t pid;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork", errno);
+		return errno;
+	}
+
+	if (pid == 0) {
+		close(q->fd);
+		log_start();
+		exit(q->ops->process(path));
+	}
+
+	if (waitpid(pid, &status, 0) == -1) {
+		PERROR("waitpid", errno);
+		return errno;
+	}
+
+	if (WIFSIGNALED(status)) {
+		ERROR("%s terminated by signal %d", e->name, WTERMSIG(status));
+		return EINTR;
+	}
+
+	return WEXITSTATUS(status);
+}
+
+int queue_run(const char *dir, const struct queue_ops *ops)
+{
+	struct queue q = { .dir = dir, .ops = ops };
+	struct queue_entry *e;
+	int lockfd, ret;
+
+	/* Only one queue per directory */
+	lockfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (lockfd == -1) {
+		PERROR("open", errno);
+		return errno;
+	}
+	if (flock(lockfd, LOCK_EX|LOCK_NB) == -1) {
+		ERROR("%s is already handled by another queue", dir);
+		return EBUSY;
+	}
+
+	q.fd = inotify_init1(IN_CLOEXEC);
+	if (q.fd == -1) {
+		PERROR("inotify_init1", errno);
+		return errno;
+	}
+
+	if (inotify_add_watch(q.fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO) == -1) {
+		PERROR("inotify_add_watch", errno);
+		return errno;
+	}
+
+	/* Pick up images dropped while we were not running */
+	if (scan_dir(&q))
+		return errno;
+
+	for (;;) {
+		/* Wait for the queue directory to settle */
+		do {
+			ret = read_events(&q, q.entries ? QUEUE_SETTLE_MS : -1);
+			if (ret == -1)
+				return EIO;
+		} while (ret);
+
+		prune(&q);
+
+		e = next_entry(&q);
+		if (!e)
+			continue;
+
+		INFO("processing: %s (%s %s)", e->name, e->group,
+		     e->version);
+		ret = process_entry(&q, e);
+		if (ret) {
+			ERROR("%s failed: %d", e->name, ret);
+		}
+		remove_entry(&q, e);
+	}
+
+	return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+struct queue_ops {
+	/* Process image, called in a child process */
+	int (*process)(const char *path);
+	/* Drop image without processing it */
+	void (*cancel)(const char *path, const char *reason);
+};
+
+int queue_run(const char *dir, const struct queue_ops *ops);
+
+#endif /* _QUEUE_H_ */
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "common.h"
+#include "sha256.h"
+
+/*
+ * Plain FIPS 180-4 SHA-256, used for identifying images and their members.
+ */
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256 *ctx, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0 ; i < 16 ; i++, p += 4)
+		w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+			(uint32_t)p[2] << 8 | p[3];
+	for ( ; i < 64 ; i++)
+		w[i] = (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10)) +
+			w[i-7] +
+			(ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3)) +
+			w[i-16];
+
+	a = ctx->state[0]; b = ctx->state[1];
+	c = ctx->state[2]; d = ctx->state[3];
+	e = ctx->state[4]; f = ctx->state[5];
+	g = ctx->state[6]; h = ctx->state[7];
+
+	for (i = 0 ; i < 64 ; i++) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+			((e & f) ^ (~e & g)) + k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	ctx->state[0] += a; ctx->state[1] += b;
+	ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f;
+	ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->len = 0;
+	ctx->buf_len = 0;
+}
+
+void sha256_update(struct sha256 *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	ctx->len += len;
+
+	if (ctx->buf_len) {
+		n = sizeof(ctx->buf) - ctx->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buf_len, p, n);
+		ctx->buf_len += n;
+		p += n;
+		len -= n;
+		if (ctx->buf_len < sizeof(ctx->buf))
+			return;
+		sha256_block(ctx, ctx->buf);
+		ctx->buf_len = 0;
+	}
+
+	for ( ; len >= sizeof(ctx->buf) ; p += 64, len -= 64)
+		sha256_block(ctx, p);
+
+	memcpy(ctx->buf, p, len);
+	ctx->buf_len = len;
+}
+
+void sha256_final(struct sha256 *ctx, unsigned char *digest)
+{
+	uint64_t bits = ctx->len * 8;
+	int i;
+
+	ctx->buf[ctx->buf_len++] = 0x80;
+	if (ctx->buf_len > 56) {
+		memset(ctx->buf + ctx->buf_len, 0, 64 - ctx->buf_len);
+		sha256_block(ctx, ctx->buf);
+		ctx->buf_len = 0;
+	}
+	memset(ctx->buf + ctx->buf_len, 0, 56 - ctx->buf_len);
+	for (i = 0 ; i < 8 ; i++)
+		ctx->buf[56 + i] = bits >> (56 - 8 * i);
+	sha256_block(ctx, ctx->buf);
+
+	for (i = 0 ; i < 32 ; i++)
+		digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void sha256_hex(const unsigned char *digest, char *hex)
+{
+	int i;
+
+	for (i = 0 ; i < SHA256_DIGEST_LEN ; i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+int sha256_fd(int fd, unsigned char *digest)
+{
+	struct sha256 ctx;
+	char buf[65536];
+	ssize_t len;
+
+	sha256_init(&ctx);
+	while ((len = read(fd, buf, sizeof(buf))) != 0) {
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("read", errno);
+			return errno;
+		}
+		sha256_update(&ctx, buf, len);
+	}
+	sha256_final(&ctx, digest);
+
+	return 0;
+}
+
+int sha256_file(const char *path, unsigned char *digest)
+{
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		PERROR("open", errno);
+		return errno;
+	}
+
+	err = sha256_fd(fd, digest);
+	close(fd);
+
+	return err;
+}
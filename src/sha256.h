@@ -0,0 +1,44 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN		32
+#define SHA256_HEX_LEN			(2 * SHA256_DIGEST_LEN + 1)
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t len;
+	unsigned char buf[64];
+	size_t buf_len;
+};
+
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, unsigned char *digest);
+
+void sha256_hex(const unsigned char *digest, char *hex);
+int sha256_fd(int fd, unsigned char *digest);
+int sha256_file(const char *path, unsigned char *digest);
+
+#endif /* _SHA256_H_ */
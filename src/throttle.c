@@ -0,0 +1,231 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "throttle.h"
+
+/*
+ * I/O throttle.
+ *
+ * All I/O done by dupdate itself is accounted here, and delayed as needed
+ * to stay within a byte rate and an operation rate, using token buckets
+ * holding up to THROTTLE_BURST_MS worth of I/O.
+ *
+ * With a pressure limit, the kernel's I/O pressure stall information is
+ * sampled every THROTTLE_SAMPLE_MS.  When the share of time where some
+ * task was stalled on I/O exceeds the limit, the byte rate is halved, and
+ * while it stays below, the rate is raised again in steps, up to the
+ * configured rate.  Without a configured rate, extraction runs at full
+ * speed until pressure is first seen.
+ *
+ * The buckets are shared by all threads, such as the workers of a tree
+ * sync, so accounting is done under a lock, while the sleep is not.
+ */
+
+#define THROTTLE_BURST_MS		100
+#define THROTTLE_SAMPLE_MS		250
+#define THROTTLE_MIN_RATE		(256 * 1024ULL)
+#define PSI_IO_FILE			"/proc/pressure/io"
+
+struct bucket {
+	double rate;			/* Per second, 0 is unlimited */
+	double tokens;
+};
+
+static struct throttle {
+	int enabled;
+	pthread_mutex_t lock;
+	struct bucket bytes;
+	struct bucket ops;
+	struct timespec last;
+	/* Adaptive rate */
+	unsigned pressure;		/* Max. stall percentage, 0 is off */
+	unsigned long long max_rate;
+	unsigned long long psi_total;
+	unsigned long long sample_bytes;
+	struct timespec sample;
+	/* Statistics */
+	unsigned long long total_bytes;
+	double delayed;
+	unsigned backoffs;
+} t = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* Cumulative microseconds some task was stalled on I/O */
+static int read_psi(unsigned long long *total)
+{
+	FILE *f;
+	int ret;
+
+	f = fopen(PSI_IO_FILE, "r");
+	if (!f)
+		return errno;
+	ret = fscanf(f, "some avg10=%*f avg60=%*f avg300=%*f total=%llu",
+		     total);
+	fclose(f);
+
+	return ret == 1 ? 0 : EINVAL;
+}
+
+static void fill(struct bucket *b, double secs)
+{
+	b->tokens += secs * b->rate;
+	if (b->tokens > b->rate * THROTTLE_BURST_MS / 1000)
+		b->tokens = b->rate * THROTTLE_BURST_MS / 1000;
+}
+
+static void adapt(const struct timespec *now)
+{
+	unsigned long long total, rate;
+	double secs, stall;
+
+	secs = elapsed(&t.sample, now);
+	if (secs * 1000 < THROTTLE_SAMPLE_MS)
+		return;
+
+	if (read_psi(&total))
+		return;
+	stall = (total - t.psi_total) / (secs * 1e4);
+	rate = t.bytes.rate;
+
+	if (stall > t.pressure) {
+		/* Back off, from what we actually did when unlimited */
+		if (!rate)
+			rate = t.sample_bytes / secs;
+		rate /= 2;
+		if (rate < THROTTLE_MIN_RATE)
+			rate = THROTTLE_MIN_RATE;
+		t.backoffs++;
+	} else if (rate) {
+		rate += rate / 4;
+		if (t.max_rate && rate >= t.max_rate)
+			rate = t.max_rate;
+		/* Back at full speed */
+		else if (!t.max_rate && rate > 4 * t.sample_bytes / secs)
+			rate = 0;
+	}
+
+	if (rate != (unsigned long long)t.bytes.rate) {
+		INFO("io pressure %.1f%%: rate %llu kB/s", stall, rate / 1024);
+		t.bytes.rate = rate;
+		t.bytes.tokens = 0;
+	}
+
+	t.psi_total = total;
+	t.sample_bytes = 0;
+	t.sample = *now;
+}
+
+static double take(struct bucket *b, double n)
+{
+	if (!b->rate)
+		return 0;
+
+	b->tokens -= n;
+	return b->tokens < 0 ? -b->tokens / b->rate : 0;
+}
+
+int throttle_init(unsigned long long rate, unsigned long iops,
+		  unsigned pressure)
+{
+	int err;
+
+	if (!rate && !iops && !pressure)
+		return 0;
+
+	memset(&t, 0, sizeof(t));
+	t.bytes.rate = rate;
+	t.max_rate = rate;
+	t.ops.rate = iops;
+	t.pressure = pressure;
+
+	if (pressure) {
+		err = read_psi(&t.psi_total);
+		if (err) {
+			PERROR(PSI_IO_FILE, err);
+			return err;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t.last);
+	t.sample = t.last;
+	t.enabled = 1;
+
+	return 0;
+}
+
+/* Account for I/O done, and sleep if ahead of the allowed rates */
+void throttle_io(size_t bytes, unsigned ops)
+{
+	struct timespec now, delay;
+	double secs, wait, w;
+
+	if (!t.enabled)
+		return;
+
+	pthread_mutex_lock(&t.lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = elapsed(&t.last, &now);
+	t.last = now;
+	t.total_bytes += bytes;
+	t.sample_bytes += bytes;
+
+	if (t.pressure)
+		adapt(&now);
+
+	fill(&t.bytes, secs);
+	fill(&t.ops, secs);
+	wait = take(&t.bytes, bytes);
+	w = take(&t.ops, ops);
+	if (w > wait)
+		wait = w;
+	if (wait > 0)
+		t.delayed += wait;
+	pthread_mutex_unlock(&t.lock);
+	if (wait <= 0)
+		return;
+
+	delay.tv_sec = wait;
+	delay.tv_nsec = (wait - delay.tv_sec) * 1e9;
+	while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+		;
+}
+
+void throttle_report(void)
+{
+	if (!t.enabled)
+		return;
+
+	INFO("throttled %llu kB: delayed %.1f s, %u backoffs",
+	     t.total_bytes / 1024, t.delayed, t.backoffs);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _THROTTLE_H_
+#define _THROTTLE_H_
+
+#include <stddef.h>
+
+int throttle_init(unsigned long long rate, unsigned long iops,
+		  unsigned pressure);
+void throttle_io(size_t bytes, unsigned ops);
+void throttle_report(void);
+
+#endif /* _THROTTLE_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "trace.h"
+
+/*
+ * Tracing.
+ *
+ * Spans are appended to a file in the Chrome trace event format, which
+ * Perfetto and chrome://tracing read, as a JSON array left open so that
+ * any number of processes can append to it.  Timestamps are taken from
+ * CLOCK_MONOTONIC, so spans of inotifyd, the agent and dupdate line up on
+ * one timeline.
+ *
+ * The trace file is passed on to children in $DUPDATE_TRACE, along with
+ * an ID in $DUPDATE_TRACE_ID, which inotifyd sets anew for each event it
+ * dispatches.  Every span carries the ID, and a flow arrow is drawn from
+ * the dispatch in inotifyd to the dupdate run it caused.
+ */
+
+#define TRACE_EVENT_MAX			(2 * PATH_MAX)
+
+static struct {
+	int fd;
+	unsigned long long id;
+} tr = { .fd = -1 };
+
+static void write_event(const char *event, size_t len)
+{
+	/* A single append, so events of processes don't interleave */
+	if (write(tr.fd, event, len) == -1) {
+		PERROR("write", errno);
+	}
+}
+
+unsigned long long trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int trace_open(const char *path, const char *process)
+{
+	char event[256];
+	const char *id;
+	int len;
+
+	/* Whoever creates the file starts the array */
+	tr.fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+	if (tr.fd != -1) {
+		write_event("[\n", 2);
+	} else if (errno == EEXIST) {
+		tr.fd = open(path, O_WRONLY|O_APPEND|O_CLOEXEC);
+	}
+	if (tr.fd == -1) {
+		PERROR(path, errno);
+		return errno;
+	}
+
+	setenv("DUPDATE_TRACE", path, 1);
+	id = getenv("DUPDATE_TRACE_ID");
+	if (id)
+		tr.id = strtoull(id, NULL, 10);
+
+	len = snprintf(event, sizeof(event),
+		       "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		       "\"args\":{\"name\":\"%s\"}},\n", getpid(), process);
+	write_event(event, len);
+
+	return 0;
+}
+
+/* Start a new trace, for what is about to be dispatched */
+void trace_new_id(void)
+{
+	static unsigned count;
+	char id[24];
+
+	if (tr.fd == -1)
+		return;
+
+	tr.id = (unsigned long long)getpid() << 32 | ++count;
+	sprintf(id, "%llu", tr.id);
+	setenv("DUPDATE_TRACE_ID", id, 1);
+}
+
+static int event_head(char *event, const char *ph, const char *name,
+		      unsigned long long ts, long tid)
+{
+	char name_json[PATH_MAX];
+
+	json_escape(name_json, sizeof(name_json), name);
+	return snprintf(event, TRACE_EVENT_MAX,
+			"{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%llu,"
+			"\"pid\":%d,\"tid\":%ld,", name_json, ph, ts,
+			getpid(), tid);
+}
+
+static void event_args(char *event, int len, const char *detail, int err)
+{
+	char detail_json[PATH_MAX];
+
+	json_escape(detail_json, sizeof(detail_json), detail ? detail : "");
+	len += snprintf(event + len, TRACE_EVENT_MAX - len,
+			"\"args\":{\"trace_id\":%llu,\"detail\":\"%s\","
+			"\"error\":%d}},\n", tr.id, detail_json, err);
+	if (len < TRACE_EVENT_MAX)
+		write_event(event, len);
+}
+
+static void span(const char *name, unsigned long long start, long tid,
+		 const char *detail, int err)
+{
+	char event[TRACE_EVENT_MAX];
+	unsigned long long now;
+	int len;
+
+	if (tr.fd == -1)
+		return;
+
+	now = trace_now();
+	len = event_head(event, "X", name, start, tid);
+	len += snprintf(event + len, sizeof(event) - len, "\"dur\":%llu,",
+			now - start);
+	event_args(event, len, detail, err);
+}
+
+/* Complete span from start until now */
+void trace_span(const char *name, unsigned long long start,
+		const char *detail, int err)
+{
+	span(name, start, syscall(SYS_gettid), detail, err);
+}
+
+/* Span of a child process, which may run alongside others */
+void trace_child_span(const char *name, pid_t pid, unsigned long long start,
+		      const char *detail, int err)
+{
+	span(name, start, pid, detail, err);
+}
+
+void trace_instant(const char *name, const char *detail)
+{
+	char event[TRACE_EVENT_MAX];
+	int len;
+
+	if (tr.fd == -1)
+		return;
+
+	len = event_head(event, "i", name, trace_now(), syscall(SYS_gettid));
+	len += snprintf(event + len, sizeof(event) - len, "\"s\":\"t\",");
+	event_args(event, len, detail, 0);
+}
+
+/* Start a flow to another process, or end the one leading here */
+void trace_flow(int start)
+{
+	char event[256];
+	int len;
+
+	if (tr.fd == -1 || !tr.id)
+		return;
+
+	len = snprintf(event, sizeof(event),
+		       "{\"name\":\"dispatch\",\"cat\":\"flow\",\"ph\":\"%s\","
+		       "\"id\":%llu,\"ts\":%llu,\"pid\":%d,\"tid\":%ld%s},\n",
+		       start ? "s" : "f", tr.id, trace_now(), getpid(),
+		       (long)syscall(SYS_gettid), start ? "" : ",\"bp\":\"e\"");
+	write_event(event, len);
+}
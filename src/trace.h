@@ -0,0 +1,36 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <sys/types.h>
+
+int trace_open(const char *path, const char *process);
+void trace_new_id(void);
+unsigned long long trace_now(void);
+void trace_span(const char *name, unsigned long long start,
+		const char *detail, int err);
+void trace_child_span(const char *name, pid_t pid, unsigned long long start,
+		      const char *detail, int err);
+void trace_instant(const char *name, const char *detail);
+void trace_flow(int start);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,849 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "throttle.h"
+#include "treesync.h"
+
+/*
+ * Tree sync.
+ *
+ * Makes the destination tree a copy of the source tree, writing only what
+ * differs.  Files of the same size and mtime are taken to be unchanged, as
+ * by rsync.  Files of the same size but another mtime are compared, and only
+ * have their metadata updated if the contents are the same.  Anything else
+ * is written to a temporary file, and renamed into place.  Entries not in the
+ * source are removed.
+ *
+ * Files with several links in the source are copied once, the first time
+ * one of them is seen, and linked to that copy wherever else they are.
+ *
+ * Directories are handed out to a pool of threads, each syncing one
+ * directory at a time.  The mode and times of directories are set at the
+ * end, deepest first, once nothing more is written into them.  Data is not
+ * synced per file, but with a single syncfs() when done.
+ */
+
+#define SYNC_MAX_THREADS		16
+#define SYNC_TMP_NAME			".dupdate-sync.%u"
+#define COMPARE_BUF_SIZE		(256 * 1024)
+#define COPY_CHUNK			(4 * 1024 * 1024)
+
+struct sync_dir {
+	char *rel;			/* Relative to both roots */
+	struct stat st;			/* Of the source directory */
+};
+
+struct sync_link {
+	dev_t dev;			/* Of the source file */
+	ino_t ino;
+	char *rel;			/* First copy, relative to the roots */
+	int done;			/* First copy is in place */
+	int err;
+};
+
+struct treesync {
+	int src;			/* Root directories */
+	int dst;
+	int root;			/* Running as root, so sync owners */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct sync_dir *dirs;		/* All directories, in order found */
+	size_t num_dirs;
+	size_t max_dirs;
+	size_t next;			/* First directory not yet taken */
+	unsigned busy;			/* Threads syncing a directory */
+	pthread_cond_t link_cond;	/* A first copy is in place */
+	struct sync_link *links;	/* Files with st_nlink > 1 */
+	size_t num_links;
+	size_t max_links;
+	int err;
+};
+
+struct sync_worker {
+	struct treesync *ts;
+	unsigned id;
+	pthread_t thread;
+	char *buf;			/* 2 * COMPARE_BUF_SIZE */
+	unsigned long written;
+	unsigned long unchanged;
+	unsigned long removed;
+};
+
+static int add_dir(struct treesync *ts, char *rel, const struct stat *st)
+{
+	struct sync_dir *dirs;
+	int err = 0;
+
+	pthread_mutex_lock(&ts->lock);
+	if (ts->num_dirs == ts->max_dirs) {
+		dirs = realloc(ts->dirs, (ts->max_dirs * 2 + 64) *
+			       sizeof(*dirs));
+		if (!dirs) {
+			err = ENOMEM;
+			goto out;
+		}
+		ts->dirs = dirs;
+		ts->max_dirs = ts->max_dirs * 2 + 64;
+	}
+	ts->dirs[ts->num_dirs].rel = rel;
+	ts->dirs[ts->num_dirs].st = *st;
+	ts->num_dirs++;
+	pthread_cond_signal(&ts->cond);
+out:
+	pthread_mutex_unlock(&ts->lock);
+	if (err) {
+		PERROR("realloc", err);
+		free(rel);
+	}
+	return err;
+}
+
+static char *join(const char *rel, const char *name)
+{
+	char *path;
+
+	if (strcmp(rel, ".") == 0)
+		return strdup(name);
+
+	path = malloc(strlen(rel) + strlen(name) + 2);
+	if (path)
+		sprintf(path, "%s/%s", rel, name);
+	return path;
+}
+
+/* Remove an entry, and everything in it if it is a directory */
+static int remove_at(int dfd, const char *name)
+{
+	struct dirent *de;
+	DIR *dir;
+	int fd, err = 0;
+
+	if (unlinkat(dfd, name, 0) == 0)
+		return 0;
+	if (errno != EISDIR) {
+		PERROR(name, errno);
+		return errno;
+	}
+
+	fd = openat(dfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1 || !(dir = fdopendir(fd))) {
+		PERROR(name, errno);
+		if (fd != -1)
+			close(fd);
+		return errno;
+	}
+
+	while (!err && (de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		err = remove_at(fd, de->d_name);
+	}
+	closedir(dir);
+
+	if (!err && unlinkat(dfd, name, AT_REMOVEDIR) == -1) {
+		PERROR(name, errno);
+		err = errno;
+	}
+
+	return err;
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Update owner, mode and mtime, where they differ from dst (if any) */
+static int set_attrs(struct treesync *ts, int dfd, const char *name,
+		     const struct stat *st, const struct stat *dst)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+	if (ts->root && (!dst || dst->st_uid != st->st_uid ||
+			 dst->st_gid != st->st_gid) &&
+	    fchownat(dfd, name, st->st_uid, st->st_gid,
+		     AT_SYMLINK_NOFOLLOW) == -1) {
+		PERROR("chown", errno);
+		return errno;
+	}
+
+	/* chown clears set-id bits, so the mode is set after it */
+	if (!S_ISLNK(st->st_mode) &&
+	    (!dst || (dst->st_mode & 07777) != (st->st_mode & 07777) ||
+	     (ts->root && (st->st_mode & (S_ISUID|S_ISGID)))) &&
+	    fchmodat(dfd, name, st->st_mode & 07777, 0) == -1) {
+		PERROR("chmod", errno);
+		return errno;
+	}
+
+	if ((!dst || !same_time(&dst->st_mtim, &st->st_mtim)) &&
+	    utimensat(dfd, name, times, AT_SYMLINK_NOFOLLOW) == -1) {
+		PERROR("utimensat", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+static int read_full(int fd, char *buf, size_t len, size_t *got)
+{
+	ssize_t n;
+
+	for (*got = 0 ; *got < len ; *got += n) {
+		n = read(fd, buf + *got, len - *got);
+		if (n == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			PERROR("read", errno);
+			return errno;
+		}
+		if (n == 0)
+			break;
+	}
+
+	return 0;
+}
+
+/* Compare the contents of two files of the same size */
+static int same_content(struct sync_worker *w, int sfd, int dfd,
+			const char *name, int *same)
+{
+	char *a = w->buf, *b = w->buf + COMPARE_BUF_SIZE;
+	size_t len_a, len_b;
+	int in_a, in_b, err;
+
+	in_a = openat(sfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (in_a == -1) {
+		PERROR(name, errno);
+		return errno;
+	}
+	in_b = openat(dfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (in_b == -1) {
+		/* Not readable, so it is replaced */
+		close(in_a);
+		*same = 0;
+		return 0;
+	}
+	posix_fadvise(in_a, 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(in_b, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	*same = 1;
+	do {
+		err = read_full(in_a, a, COMPARE_BUF_SIZE, &len_a);
+		if (!err)
+			err = read_full(in_b, b, COMPARE_BUF_SIZE, &len_b);
+		if (err)
+			break;
+		if (len_a != len_b || memcmp(a, b, len_a) != 0)
+			*same = 0;
+	} while (*same && len_a == COMPARE_BUF_SIZE);
+
+	close(in_a);
+	close(in_b);
+	return err;
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("write", errno);
+			return errno;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int copy_data(struct sync_worker *w, int in, int out)
+{
+	size_t len;
+	ssize_t n;
+	int err;
+
+	/* In the kernel if possible, which may also share the blocks */
+	while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+		throttle_io(n, 0);
+	if (n == 0)
+		return 0;
+	if (errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP &&
+	    errno != ENOSYS) {
+		PERROR("copy_file_range", errno);
+		return errno;
+	}
+
+	do {
+		err = read_full(in, w->buf, 2 * COMPARE_BUF_SIZE, &len);
+		if (!err)
+			err = write_full(out, w->buf, len);
+		if (err)
+			return err;
+		throttle_io(len, 0);
+	} while (len);
+
+	return 0;
+}
+
+/* Write a new copy of a file, and rename it into place */
+static int write_file(struct sync_worker *w, int sfd, int dfd,
+		      const char *name, const struct stat *st)
+{
+	char tmp[32];
+	int in, out, err;
+
+	snprintf(tmp, sizeof(tmp), SYNC_TMP_NAME, w->id);
+
+	in = openat(sfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (in == -1) {
+		PERROR(name, errno);
+		return errno;
+	}
+
+	unlinkat(dfd, tmp, 0);
+	out = openat(dfd, tmp, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+	if (out == -1) {
+		PERROR(name, errno);
+		close(in);
+		return errno;
+	}
+
+	err = copy_data(w, in, out);
+	close(in);
+	if (close(out) == -1 && !err) {
+		PERROR("close", errno);
+		err = errno;
+	}
+	if (!err)
+		err = set_attrs(w->ts, dfd, tmp, st, NULL);
+
+	if (!err && renameat(dfd, tmp, dfd, name) == -1) {
+		PERROR("renameat", errno);
+		err = errno;
+	}
+	if (err) {
+		unlinkat(dfd, tmp, 0);
+		return err;
+	}
+
+	throttle_io(0, 1);
+	w->written++;
+	return 0;
+}
+
+static int sync_file(struct sync_worker *w, int sfd, int dfd,
+		     const char *name, const struct stat *st,
+		     const struct stat *dst)
+{
+	int same = 0, err;
+
+	if (dst && dst->st_size == st->st_size) {
+		if (same_time(&dst->st_mtim, &st->st_mtim)) {
+			same = 1;
+		} else {
+			err = same_content(w, sfd, dfd, name, &same);
+			if (err)
+				return err;
+		}
+	}
+
+	if (!same)
+		return write_file(w, sfd, dfd, name, st);
+
+	w->unchanged++;
+	return set_attrs(w->ts, dfd, name, st, dst);
+}
+
+static int sync_link(struct sync_worker *w, int sfd, int dfd,
+		     const char *name, const struct stat *st,
+		     const struct stat *dst)
+{
+	char target[PATH_MAX], old[PATH_MAX];
+	ssize_t len, old_len = -1;
+
+	len = readlinkat(sfd, name, target, sizeof(target) - 1);
+	if (len == -1) {
+		PERROR("readlinkat", errno);
+		return errno;
+	}
+	target[len] = '\0';
+
+	if (dst)
+		old_len = readlinkat(dfd, name, old, sizeof(old) - 1);
+	if (old_len == len && memcmp(old, target, len) == 0) {
+		w->unchanged++;
+		return set_attrs(w->ts, dfd, name, st, dst);
+	}
+
+	if (dst && unlinkat(dfd, name, 0) == -1) {
+		PERROR(name, errno);
+		return errno;
+	}
+	if (symlinkat(target, dfd, name) == -1) {
+		PERROR("symlinkat", errno);
+		return errno;
+	}
+
+	w->written++;
+	return set_attrs(w->ts, dfd, name, st, NULL);
+}
+
+static int sync_node(struct sync_worker *w, int sfd, int dfd,
+		     const char *name, const struct stat *st,
+		     const struct stat *dst)
+{
+	if (dst && dst->st_rdev == st->st_rdev) {
+		w->unchanged++;
+		return set_attrs(w->ts, dfd, name, st, dst);
+	}
+
+	if (dst && unlinkat(dfd, name, 0) == -1) {
+		PERROR(name, errno);
+		return errno;
+	}
+	if (mknodat(dfd, name, st->st_mode, st->st_rdev) == -1) {
+		PERROR("mknodat", errno);
+		return errno;
+	}
+
+	w->written++;
+	return set_attrs(w->ts, dfd, name, st, NULL);
+}
+
+/*
+ * Look up the first copy of a file with several links, waiting for it to be
+ * in place.  If there is none, this is it: *first is NULL, and the caller
+ * calls link_done() once it is copied.
+ */
+static int find_link(struct treesync *ts, const struct stat *st,
+		     char *path, size_t *idx, const char **first)
+{
+	struct sync_link *links;
+	size_t i;
+	int err = 0;
+
+	*first = NULL;
+	pthread_mutex_lock(&ts->lock);
+	for (i = 0 ; i < ts->num_links ; i++)
+		if (ts->links[i].dev == st->st_dev &&
+		    ts->links[i].ino == st->st_ino)
+			break;
+
+	if (i < ts->num_links) {
+		while (!ts->links[i].done)
+			pthread_cond_wait(&ts->link_cond, &ts->lock);
+		err = ts->links[i].err;
+		*first = ts->links[i].rel;
+		free(path);
+		goto out;
+	}
+
+	if (ts->num_links == ts->max_links) {
+		links = realloc(ts->links, (ts->max_links * 2 + 64) *
+				sizeof(*links));
+		if (!links) {
+			PERROR("realloc", ENOMEM);
+			free(path);
+			err = ENOMEM;
+			goto out;
+		}
+		ts->links = links;
+		ts->max_links = ts->max_links * 2 + 64;
+	}
+	ts->links[i].dev = st->st_dev;
+	ts->links[i].ino = st->st_ino;
+	ts->links[i].rel = path;
+	ts->links[i].done = 0;
+	ts->links[i].err = 0;
+	ts->num_links++;
+	*idx = i;
+out:
+	pthread_mutex_unlock(&ts->lock);
+	return err;
+}
+
+static void link_done(struct treesync *ts, size_t idx, int err)
+{
+	pthread_mutex_lock(&ts->lock);
+	ts->links[idx].done = 1;
+	/* Those waiting for it fail too, without saying so again */
+	ts->links[idx].err = err ? EIO : 0;
+	pthread_cond_broadcast(&ts->link_cond);
+	pthread_mutex_unlock(&ts->lock);
+}
+
+/* Make name another link to the first copy, unless it already is one */
+static int sync_hardlink(struct sync_worker *w, int dfd, const char *name,
+			 const char *first, const struct stat *dst)
+{
+	struct treesync *ts = w->ts;
+	struct stat fst;
+	char tmp[32];
+
+	if (fstatat(ts->dst, first, &fst, AT_SYMLINK_NOFOLLOW) == -1) {
+		PERROR(first, errno);
+		return errno;
+	}
+	if (dst && dst->st_dev == fst.st_dev && dst->st_ino == fst.st_ino) {
+		w->unchanged++;
+		return 0;
+	}
+
+	snprintf(tmp, sizeof(tmp), SYNC_TMP_NAME, w->id);
+	unlinkat(dfd, tmp, 0);
+	if (linkat(ts->dst, first, dfd, tmp, 0) == -1) {
+		PERROR("linkat", errno);
+		return errno;
+	}
+	if (renameat(dfd, tmp, dfd, name) == -1) {
+		PERROR("renameat", errno);
+		unlinkat(dfd, tmp, 0);
+		return errno;
+	}
+
+	w->written++;
+	return 0;
+}
+
+static int sync_entry(struct sync_worker *w, int sfd, int dfd,
+		      const char *rel, const char *name)
+{
+	struct stat st, dst;
+	const char *first;
+	char *path;
+	size_t idx = 0;
+	int exists, linked = 0, err;
+
+	if (fstatat(sfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+		PERROR(name, errno);
+		return errno;
+	}
+	exists = fstatat(dfd, name, &dst, AT_SYMLINK_NOFOLLOW) == 0;
+
+	/* Entries changing type are replaced */
+	if (exists && (dst.st_mode & S_IFMT) != (st.st_mode & S_IFMT)) {
+		if (remove_at(dfd, name))
+			return errno;
+		exists = 0;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		/* Writable until its own mode is set at the end */
+		if (!exists && mkdirat(dfd, name, S_IRWXU) == -1) {
+			PERROR("mkdirat", errno);
+			return errno;
+		}
+		path = join(rel, name);
+		if (!path) {
+			PERROR("malloc", ENOMEM);
+			return ENOMEM;
+		}
+		return add_dir(w->ts, path, &st);
+	}
+
+	if (st.st_nlink > 1) {
+		path = join(rel, name);
+		if (!path) {
+			PERROR("malloc", ENOMEM);
+			return ENOMEM;
+		}
+		err = find_link(w->ts, &st, path, &idx, &first);
+		if (err)
+			return err;
+		if (first)
+			return sync_hardlink(w, dfd, name, first,
+					     exists ? &dst : NULL);
+		linked = 1;
+	}
+
+	switch (st.st_mode & S_IFMT) {
+	case S_IFREG:
+		err = sync_file(w, sfd, dfd, name, &st, exists ? &dst : NULL);
+		break;
+	case S_IFLNK:
+		err = sync_link(w, sfd, dfd, name, &st, exists ? &dst : NULL);
+		break;
+	default:
+		err = sync_node(w, sfd, dfd, name, &st, exists ? &dst : NULL);
+		break;
+	}
+
+	if (linked)
+		link_done(w->ts, idx, err);
+	return err;
+}
+
+/* Read a directory, keeping fd for the *at() calls */
+static int open_dir(int fd, DIR **dir)
+{
+	int copy;
+
+	*dir = NULL;
+	copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (copy == -1 || !(*dir = fdopendir(copy))) {
+		PERROR("fdopendir", errno);
+		if (copy != -1)
+			close(copy);
+		return EIO;
+	}
+
+	return 0;
+}
+
+static int sync_dir(struct sync_worker *w, const char *rel)
+{
+	struct treesync *ts = w->ts;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int sfd, dfd, err;
+
+	sfd = openat(ts->src, rel, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (sfd == -1) {
+		PERROR(rel, errno);
+		return errno;
+	}
+	dfd = openat(ts->dst, rel, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (dfd == -1) {
+		PERROR(rel, errno);
+		close(sfd);
+		return EIO;
+	}
+
+	err = open_dir(sfd, &dir);
+	while (!err && (de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		err = sync_entry(w, sfd, dfd, rel, de->d_name);
+	}
+	if (dir)
+		closedir(dir);
+	dir = NULL;
+
+	/* Remove what is no longer in the source */
+	if (!err)
+		err = open_dir(dfd, &dir);
+	while (!err && (de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0 ||
+		    fstatat(sfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			continue;
+		err = remove_at(dfd, de->d_name);
+		if (!err)
+			w->removed++;
+	}
+	if (dir)
+		closedir(dir);
+
+	close(sfd);
+	close(dfd);
+	return err;
+}
+
+static void *sync_thread(void *arg)
+{
+	struct sync_worker *w = arg;
+	struct treesync *ts = w->ts;
+	const char *rel;
+	int err;
+
+	pthread_mutex_lock(&ts->lock);
+	for (;;) {
+		while (ts->next == ts->num_dirs && ts->busy && !ts->err)
+			pthread_cond_wait(&ts->cond, &ts->lock);
+		if (ts->next == ts->num_dirs || ts->err)
+			break;
+
+		rel = ts->dirs[ts->next++].rel;
+		ts->busy++;
+		pthread_mutex_unlock(&ts->lock);
+
+		err = sync_dir(w, rel);
+
+		pthread_mutex_lock(&ts->lock);
+		ts->busy--;
+		if (err && !ts->err)
+			ts->err = err;
+	}
+	/* Done, or failed: either way the others are too */
+	pthread_cond_broadcast(&ts->cond);
+	pthread_mutex_unlock(&ts->lock);
+
+	return NULL;
+}
+
+/* Set directory modes and times, deepest first */
+static int finish_dirs(struct treesync *ts)
+{
+	struct stat dst;
+	size_t i;
+	int err;
+
+	for (i = ts->num_dirs ; i-- ; ) {
+		if (fstatat(ts->dst, ts->dirs[i].rel, &dst,
+			    AT_SYMLINK_NOFOLLOW) == -1) {
+			PERROR(ts->dirs[i].rel, errno);
+			return errno;
+		}
+		err = set_attrs(ts, ts->dst, ts->dirs[i].rel,
+				&ts->dirs[i].st, &dst);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+int treesync_run(const char *src, const char *dst, int jobs)
+{
+	struct treesync ts;
+	struct sync_worker *workers;
+	unsigned long written = 0, unchanged = 0, removed = 0;
+	struct stat st;
+	char *rel;
+	int i, started = 0, err;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.dst = -1;
+	ts.root = geteuid() == 0;
+	pthread_mutex_init(&ts.lock, NULL);
+	pthread_cond_init(&ts.cond, NULL);
+	pthread_cond_init(&ts.link_cond, NULL);
+
+	if (jobs > SYNC_MAX_THREADS)
+		jobs = SYNC_MAX_THREADS;
+	if (jobs < 1)
+		jobs = 1;
+	workers = calloc(jobs, sizeof(*workers));
+	if (!workers) {
+		PERROR("calloc", ENOMEM);
+		return ENOMEM;
+	}
+
+	ts.src = open(src, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (ts.src == -1 || fstat(ts.src, &st) == -1) {
+		PERROR(src, errno);
+		err = errno;
+		goto out;
+	}
+	if (mkdir(dst, S_IRWXU) == -1 && errno != EEXIST) {
+		PERROR("mkdir", errno);
+		err = errno;
+		goto out;
+	}
+	ts.dst = open(dst, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (ts.dst == -1) {
+		PERROR(dst, errno);
+		err = errno;
+		goto out;
+	}
+
+	rel = strdup(".");
+	if (!rel) {
+		err = ENOMEM;
+		goto out;
+	}
+	err = add_dir(&ts, rel, &st);
+	if (err)
+		goto out;
+
+	INFO("+ sync %s -> %s with %d threads", src, dst, jobs);
+	for (i = 0 ; i < jobs ; i++) {
+		workers[i].ts = &ts;
+		workers[i].id = i;
+		workers[i].buf = malloc(2 * COMPARE_BUF_SIZE);
+		if (!workers[i].buf) {
+			err = ENOMEM;
+			break;
+		}
+		err = pthread_create(&workers[i].thread, NULL, sync_thread,
+				     &workers[i]);
+		if (err) {
+			PERROR("pthread_create", err);
+			break;
+		}
+		started++;
+	}
+	/* Fewer threads will do, but not none */
+	if (started)
+		err = 0;
+
+	for (i = 0 ; i < started ; i++) {
+		pthread_join(workers[i].thread, NULL);
+		written += workers[i].written;
+		unchanged += workers[i].unchanged;
+		removed += workers[i].removed;
+	}
+	if (!err)
+		err = ts.err;
+
+	if (!err)
+		err = finish_dirs(&ts);
+	if (!err && syncfs(ts.dst) == -1) {
+		PERROR("syncfs", errno);
+		err = errno;
+	}
+
+	INFO("sync: %lu written, %lu unchanged, %lu removed", written,
+	     unchanged, removed);
+
+out:
+	for (i = 0 ; i < jobs ; i++)
+		free(workers[i].buf);
+	free(workers);
+	for (i = 0 ; i < (int)ts.num_dirs ; i++)
+		free(ts.dirs[i].rel);
+	free(ts.dirs);
+	for (i = 0 ; i < (int)ts.num_links ; i++)
+		free(ts.links[i].rel);
+	free(ts.links);
+	if (ts.src != -1)
+		close(ts.src);
+	if (ts.dst != -1)
+		close(ts.dst);
+	pthread_mutex_destroy(&ts.lock);
+	pthread_cond_destroy(&ts.cond);
+	pthread_cond_destroy(&ts.link_cond);
+	return err;
+}
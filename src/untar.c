@@ -0,0 +1,2045 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sysmacros.h>
+#include <linux/falloc.h>
+
+#include "common.h"
+#include "untar.h"
+#include "throttle.h"
+#include "arena.h"
+#include "writer.h"
+
+/*
+ * Tar extraction, supporting the ustar, pax and GNU formats.  Compressed
+ * images are piped through the matching external decompressor, the same way
+ * tar itself does it.
+ *
+ * Files are preallocated to their final size, and blocks of zeros are not
+ * written, but punched out as holes, the same as the holes of GNU and pax
+ * sparse members.
+ *
+ * Large files can be streamed instead: a FIFO is created in place of the
+ * file, and the data is written to it as it is decompressed, for a command
+ * that is already running to read.
+ */
+
+#define BLOCK_SIZE			512
+#define DEFAULT_BUF_SIZE		(64 * 1024)
+#define SYNC_PENDING_MAX		64
+#define ZERO_BLOCK			4096
+#define PREALLOC_MIN			(64 * 1024)
+#define SPARSE_MAX_ENTRIES		(1024 * 1024)
+#define STREAM_POLL_US			(10 * 1000)
+#define XZ_FOOTER_SIZE			12
+#define GZIP_MAX_RATIO			1032
+#define GZIP_SCAN_CHUNK			(64 * 1024)
+#define DROP_CHUNK			(8 * 1024 * 1024)
+#define CACHE_PAGE			4096
+#define PROGRESS_CHUNK			(1024 * 1024)
+
+/* Old GNU header fields, overlapping the ustar prefix */
+#define GNU_SPARSE_OFFSET		386
+#define GNU_SPARSE_ENTRIES		4
+#define GNU_ISEXTENDED_OFFSET		482
+#define GNU_REALSIZE_OFFSET		483
+#define GNU_EXT_SPARSE_ENTRIES		21
+#define GNU_EXT_ISEXTENDED_OFFSET	504
+
+enum sparse_format {
+	SPARSE_NONE,
+	SPARSE_MAP,			/* Map in headers */
+	SPARSE_MAP_IN_DATA,		/* pax 1.0, map in front of data */
+};
+
+/* Output file state while writing member data */
+struct file_out {
+	int fd;
+	int prealloc;			/* Preallocated by fallocate() */
+	unsigned long long hole_start;	/* Pending range to punch */
+	unsigned long long hole_end;
+	unsigned long long end;		/* Data written up to */
+	unsigned long long wb_start;	/* Writeback started from */
+	unsigned long long wb_end;	/* and up to */
+};
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+struct untar_dir {
+	char *name;
+	time_t mtime;
+	struct untar_dir *next;
+};
+
+static const struct {
+	const char *magic;
+	size_t len;
+	const char *prog;
+	const char *memlimit;		/* Option limiting memory use */
+} decompressors[] = {
+	{ "\x1f\x8b",			2, "gzip", NULL },
+	{ "BZh",			3, "bzip2", NULL },
+	{ "\xfd" "7zXZ\0",		6, "xz", "-M%lluKiB" },
+	{ "\x28\xb5\x2f\xfd",		4, "zstd", "-M%lluKiB" },
+	{ "\x04\x22\x4d\x18",		4, "lz4", NULL },
+	{ NULL, 0, NULL, NULL }
+};
+
+/*
+ * Bytes already read from a stream are fed to the decompressor ahead of the
+ * rest of it, through a pipe.
+ */
+static int spawn_feeder(struct untar *u, int *fd)
+{
+	int pipefd[2];
+	pid_t pid;
+
+	if (pipe2(pipefd, O_CLOEXEC) == -1) {
+		PERROR("pipe", errno);
+		return errno;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork", errno);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return errno;
+	}
+
+	if (pid == 0) {
+		signal(SIGPIPE, SIG_DFL);
+		close(pipefd[0]);
+		if (write(pipefd[1], u->head, u->head_len) !=
+		    (ssize_t)u->head_len)
+			_exit(1);
+		_exit(copy_stream(*fd, pipefd[1]) ? 1 : 0);
+	}
+
+	/* The pipe takes the place of the stream, which may be stdin */
+	close(pipefd[1]);
+	if (dup3(pipefd[0], *fd, O_CLOEXEC) == -1) {
+		PERROR("dup3", errno);
+		close(pipefd[0]);
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return errno;
+	}
+	close(pipefd[0]);
+	u->feeder = pid;
+	u->head_len = 0;
+
+	return 0;
+}
+
+static int spawn_decompressor(struct untar *u, int fd, const char *prog,
+			      const char *memlimit)
+{
+	char memopt[32] = "";
+	int pipefd[2], err;
+	pid_t pid;
+
+	/* Large dictionaries must fail cleanly instead of OOM-killing */
+	if (u->mem_limit && memlimit)
+		snprintf(memopt, sizeof(memopt), memlimit,
+			 u->mem_limit / 1024);
+
+	if (u->head_len) {
+		err = spawn_feeder(u, &fd);
+		if (err) {
+			close(fd);
+			return err;
+		}
+	}
+
+	/* Not to be inherited by streaming commands */
+	if (pipe2(pipefd, O_CLOEXEC) == -1) {
+		PERROR("pipe", errno);
+		close(fd);
+		return errno;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		PERROR("fork", errno);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		close(fd);
+		return errno;
+	}
+
+	if (pid == 0) {
+		if (fd == STDIN_FILENO) {
+			fcntl(fd, F_SETFD, 0);
+		} else {
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		if (memopt[0])
+			execlp(prog, prog, "-d", "-c", memopt, NULL);
+		else
+			execlp(prog, prog, "-d", "-c", NULL);
+		PERROR(prog, errno);
+		_exit(127);
+	}
+
+	close(pipefd[1]);
+	close(fd);
+	u->in = pipefd[0];
+	u->decompressor = pid;
+	INFO("+ %s -d -c%s%s", prog, memopt[0] ? " " : "", memopt);
+
+	return 0;
+}
+
+static int open_dir(struct untar *u, const char *dir)
+{
+	u->in = -1;
+	u->dirfd = -1;
+	u->writer = NULL;
+	u->decompressor = 0;
+	u->feeder = 0;
+	u->image_fd = -1;
+	u->image_dropped = 0;
+	u->drop_pos = 0;
+	u->progress_pos = 0;
+	u->pos = 0;
+	u->dirs = NULL;
+
+	if (!u->buf_size)
+		u->buf_size = DEFAULT_BUF_SIZE;
+	u->buf = arena_alloc(u->buf_size);
+	if (!u->buf) {
+		PERROR("arena_alloc", ENOMEM);
+		return ENOMEM;
+	}
+
+	u->dirfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (u->dirfd == -1) {
+		PERROR("open", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+/* Read from fd, decompressing it first if the magic says so */
+static int open_input(struct untar *u, int fd, const unsigned char *magic,
+		      size_t len)
+{
+	int i;
+
+	/* Have the image read ahead further, and keep it at hand for
+	 * dropping what has been read, be it by us or a decompressor */
+	if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL) == 0 &&
+	    (u->flags & UNTAR_FLAG_DROP_CACHE))
+		u->image_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+	for (i = 0 ; decompressors[i].magic ; i++) {
+		if (len >= decompressors[i].len &&
+		    memcmp(magic, decompressors[i].magic,
+			   decompressors[i].len) == 0)
+			return spawn_decompressor(u, fd, decompressors[i].prog,
+						  decompressors[i].memlimit);
+	}
+
+	u->in = fd;
+	return 0;
+}
+
+int untar_open(struct untar *u, const char *image, const char *dir)
+{
+	unsigned char magic[6];
+	ssize_t len;
+	int fd, err;
+
+	u->head_len = 0;
+	err = open_dir(u, dir);
+	if (err)
+		return err;
+
+	fd = open(image, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		PERROR("open", errno);
+		return errno;
+	}
+
+	len = pread(fd, magic, sizeof(magic), 0);
+	if (len == -1) {
+		PERROR("pread", errno);
+		close(fd);
+		return errno;
+	}
+
+	return open_input(u, fd, magic, len);
+}
+
+/*
+ * Extract from a stream that cannot be rewound, such as a pipe or socket,
+ * with the first head_len bytes of it already read into head.
+ */
+int untar_open_fd(struct untar *u, int fd, const void *head, size_t head_len,
+		  const char *dir)
+{
+	int err;
+
+	u->head_len = 0;
+	err = open_dir(u, dir);
+	if (!err && head_len > sizeof(u->head)) {
+		ERROR("read ahead of %zu bytes", head_len);
+		err = EINVAL;
+	}
+	if (err) {
+		close(fd);
+		return err;
+	}
+
+	memcpy(u->head, head, head_len);
+	u->head_len = head_len;
+
+	return open_input(u, fd, u->head, u->head_len);
+}
+
+/* Drop the image from the page cache up to where it has been read */
+static void drop_image(struct untar *u)
+{
+	off_t pos;
+
+	u->drop_pos = u->pos;
+
+	/* The file offset is shared with the decompressor */
+	pos = lseek(u->image_fd, 0, SEEK_CUR);
+	if (pos == (off_t)-1)
+		return;
+	pos -= pos % CACHE_PAGE;
+	if ((unsigned long long)pos <= u->image_dropped)
+		return;
+
+	posix_fadvise(u->image_fd, u->image_dropped, pos - u->image_dropped,
+		      POSIX_FADV_DONTNEED);
+	u->image_dropped = pos;
+}
+
+static int read_full(struct untar *u, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	/* Read ahead when telling the compression of a stream */
+	if (u->head_len) {
+		n = len < u->head_len ? len : u->head_len;
+		memcpy(p, u->head, n);
+		memmove(u->head, u->head + n, u->head_len - n);
+		u->head_len -= n;
+		p += n;
+		len -= n;
+		u->pos += n;
+	}
+
+	while (len) {
+		n = read(u->in, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("read", errno);
+			return errno;
+		}
+		if (n == 0) {
+			ERROR("unexpected end of archive");
+			return EIO;
+		}
+		p += n;
+		len -= n;
+		u->pos += n;
+	}
+
+	if (u->image_fd != -1 && u->pos - u->drop_pos >= DROP_CHUNK)
+		drop_image(u);
+	if (u->ops && u->ops->progress &&
+	    u->pos - u->progress_pos >= PROGRESS_CHUNK) {
+		u->progress_pos = u->pos;
+		u->ops->progress(u->pos, u->priv);
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("write", errno);
+			return errno;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Skip stream data, seeking when reading directly from the image */
+static int skip_data(struct untar *u, unsigned long long len)
+{
+	size_t n;
+	int err;
+
+	if (!len)
+		return 0;
+
+	if (!u->decompressor && !u->head_len &&
+	    lseek(u->in, len, SEEK_CUR) != (off_t)-1) {
+		u->pos += len;
+		return 0;
+	}
+
+	while (len) {
+		n = len < u->buf_size ? len : u->buf_size;
+		err = read_full(u, u->buf, n);
+		if (err)
+			return err;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static unsigned long long padded(unsigned long long len)
+{
+	return (len + BLOCK_SIZE - 1) & ~(unsigned long long)(BLOCK_SIZE - 1);
+}
+
+static unsigned long long parse_number(const char *p, size_t len)
+{
+	unsigned long long val = 0;
+
+	/* GNU base-256 encoding of large values */
+	if (*p & 0x80) {
+		val = *p & 0x3f;
+		while (--len)
+			val = (val << 8) | (unsigned char)*++p;
+		return val;
+	}
+
+	while (len && (*p == ' ' || *p == '\0')) {
+		p++;
+		len--;
+	}
+	while (len && *p >= '0' && *p <= '7') {
+		val = (val << 3) | (*p++ - '0');
+		len--;
+	}
+
+	return val;
+}
+
+static int verify_checksum(const struct tar_header *h)
+{
+	const unsigned char *p = (const unsigned char *)h;
+	unsigned long sum = 0;
+	long ssum = 0;
+	unsigned long chksum;
+	int i;
+
+	for (i = 0 ; i < BLOCK_SIZE ; i++) {
+		if (i >= 148 && i < 156) {
+			sum += ' ';
+			ssum += ' ';
+		} else {
+			sum += p[i];
+			ssum += (signed char)p[i];
+		}
+	}
+
+	chksum = parse_number(h->chksum, sizeof(h->chksum));
+
+	return chksum == sum || (long)chksum == ssum;
+}
+
+static int is_zero_block(const char *p)
+{
+	int i;
+
+	for (i = 0 ; i < BLOCK_SIZE ; i++)
+		if (p[i])
+			return 0;
+	return 1;
+}
+
+static char *strndup_field(const char *p, size_t len)
+{
+	return strndup(p, strnlen(p, len));
+}
+
+/* Read data of GNU long name and pax extended headers */
+static int read_ext_data(struct untar *u, unsigned long long size,
+			 char **data)
+{
+	int err;
+
+	if (size > 1024 * 1024) {
+		ERROR("extended header too large: %llu", size);
+		return EINVAL;
+	}
+
+	free(*data);
+	*data = malloc(padded(size) + 1);
+	if (!*data) {
+		PERROR("malloc", ENOMEM);
+		return ENOMEM;
+	}
+
+	err = read_full(u, *data, padded(size));
+	if (err)
+		return err;
+	(*data)[size] = '\0';
+
+	return 0;
+}
+
+static int add_sparse(struct untar *u, unsigned long long offset,
+		      unsigned long long size)
+{
+	unsigned long long *sparse;
+
+	sparse = realloc(u->sparse, (u->num_sparse + 1) * 2 * sizeof(*sparse));
+	if (!sparse) {
+		PERROR("realloc", ENOMEM);
+		return ENOMEM;
+	}
+	u->sparse = sparse;
+	u->sparse[u->num_sparse * 2] = offset;
+	u->sparse[u->num_sparse * 2 + 1] = size;
+	u->num_sparse++;
+
+	return 0;
+}
+
+/* GNU.sparse.map of pax 0.1, "offset,size[,offset,size...]" */
+static int parse_sparse_map(struct untar *u, const char *map)
+{
+	unsigned long long offset, size;
+	char *end;
+	int err;
+
+	while (*map) {
+		offset = strtoull(map, &end, 10);
+		if (*end != ',')
+			return EINVAL;
+		size = strtoull(end + 1, &end, 10);
+		if (*end && *end != ',')
+			return EINVAL;
+		err = add_sparse(u, offset, size);
+		if (err)
+			return err;
+		map = *end ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+static int parse_pax(struct untar *u, char *data, unsigned long long size,
+		     struct untar_member *m, int *have)
+{
+	char *p = data, *end = data + size, *key, *val, *rec_end;
+	unsigned long len;
+	int err = 0;
+
+	while (p < end) {
+		len = strtoul(p, &key, 10);
+		if (len == 0 || *key != ' ' || p + len > end) {
+			ERROR("invalid pax header");
+			return EINVAL;
+		}
+		rec_end = p + len;
+		key++;
+		val = memchr(key, '=', rec_end - key);
+		if (!val || rec_end[-1] != '\n') {
+			ERROR("invalid pax record");
+			return EINVAL;
+		}
+		*val++ = '\0';
+		rec_end[-1] = '\0';
+
+		if (strcmp(key, "path") == 0) {
+			free(m->name);
+			m->name = strdup(val);
+		} else if (strcmp(key, "linkpath") == 0) {
+			free(m->linkname);
+			m->linkname = strdup(val);
+		} else if (strcmp(key, "size") == 0) {
+			m->size = strtoull(val, NULL, 10);
+			*have |= 1;
+		} else if (strcmp(key, "mtime") == 0) {
+			m->mtime = strtoll(val, NULL, 10);
+			*have |= 2;
+		} else if (strcmp(key, "uid") == 0) {
+			m->uid = strtoul(val, NULL, 10);
+			*have |= 4;
+		} else if (strcmp(key, "gid") == 0) {
+			m->gid = strtoul(val, NULL, 10);
+			*have |= 8;
+		} else if (strcmp(key, "GNU.sparse.name") == 0) {
+			free(m->name);
+			m->name = strdup(val);
+		} else if (strcmp(key, "GNU.sparse.realsize") == 0 ||
+			   strcmp(key, "GNU.sparse.size") == 0) {
+			m->realsize = strtoull(val, NULL, 10);
+		} else if (strcmp(key, "GNU.sparse.major") == 0) {
+			if (strcmp(val, "1") == 0)
+				u->sparse_format = SPARSE_MAP_IN_DATA;
+		} else if (strcmp(key, "GNU.sparse.offset") == 0) {
+			u->sparse_format = SPARSE_MAP;
+			err = add_sparse(u, strtoull(val, NULL, 10), 0);
+		} else if (strcmp(key, "GNU.sparse.numbytes") == 0) {
+			if (u->num_sparse)
+				u->sparse[u->num_sparse * 2 - 1] =
+					strtoull(val, NULL, 10);
+		} else if (strcmp(key, "GNU.sparse.map") == 0) {
+			u->sparse_format = SPARSE_MAP;
+			err = parse_sparse_map(u, val);
+		}
+		if (err) {
+			ERROR("invalid pax record %s", key);
+			return err;
+		}
+
+		p = rec_end;
+	}
+
+	return 0;
+}
+
+/* Sparse map of an old GNU 'S' header, and its extension headers */
+static int read_gnu_sparse(struct untar *u, const struct tar_header *h,
+			   struct untar_member *m)
+{
+	const char *entry = (const char *)h + GNU_SPARSE_OFFSET;
+	char ext[BLOCK_SIZE];
+	int i, n = GNU_SPARSE_ENTRIES, extended, err;
+
+	m->realsize = parse_number((const char *)h + GNU_REALSIZE_OFFSET, 12);
+	extended = ((const char *)h)[GNU_ISEXTENDED_OFFSET];
+	u->sparse_format = SPARSE_MAP;
+
+	for (;;) {
+		for (i = 0 ; i < n && entry[i * 24] ; i++) {
+			err = add_sparse(u, parse_number(entry + i * 24, 12),
+					 parse_number(entry + i * 24 + 12, 12));
+			if (err)
+				return err;
+		}
+		if (!extended)
+			break;
+
+		err = read_full(u, ext, sizeof(ext));
+		if (err)
+			return err;
+		entry = ext;
+		n = GNU_EXT_SPARSE_ENTRIES;
+		extended = ext[GNU_EXT_ISEXTENDED_OFFSET];
+	}
+
+	return 0;
+}
+
+/* Strip leading slashes and refuse to go outside the destination */
+static int sanitize_name(char **name)
+{
+	char *p = *name;
+	const char *c;
+
+	while (*p == '/')
+		p++;
+	while (p[0] == '.' && p[1] == '/')
+		p += 2;
+
+	for (c = p ; c ; c = strchr(c, '/')) {
+		if (*c == '/')
+			c++;
+		if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || !c[2])) {
+			ERROR("refusing member outside destination: %s",
+			      *name);
+			return EINVAL;
+		}
+	}
+
+	memmove(*name, p, strlen(p) + 1);
+
+	/* Drop trailing slash of directory names */
+	p = *name + strlen(*name);
+	while (p > *name + 1 && p[-1] == '/')
+		*--p = '\0';
+
+	return 0;
+}
+
+static int make_parents(struct untar *u, const char *name)
+{
+	char path[PATH_MAX];
+	char *p;
+
+	if (strlen(name) >= sizeof(path))
+		return ENAMETOOLONG;
+	strcpy(path, name);
+
+	for (p = strchr(path, '/') ; p ; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdirat(u->dirfd, path, 0777) == -1 && errno != EEXIST) {
+			PERROR("mkdirat", errno);
+			return errno;
+		}
+		*p = '/';
+	}
+
+	return 0;
+}
+
+/* Create a new (non-directory) entry, replacing whatever was there */
+#define CREATE_RETRY(u, name, call)					\
+	({								\
+		int __ret = (call);					\
+		if (__ret == -1 && errno == EEXIST) {			\
+			unlinkat((u)->dirfd, (name), 0);		\
+			__ret = (call);					\
+		}							\
+		if (__ret == -1 && errno == ENOENT &&			\
+		    make_parents((u), (name)) == 0)			\
+			__ret = (call);					\
+		__ret;							\
+	})
+
+static int set_owner(struct untar *u, struct untar_member *m, int fd)
+{
+	int ret;
+
+	if (geteuid() != 0)
+		return 0;
+
+	if (fd != -1)
+		ret = fchown(fd, m->uid, m->gid);
+	else
+		ret = fchownat(u->dirfd, m->name, m->uid, m->gid,
+			       AT_SYMLINK_NOFOLLOW);
+	if (ret == -1) {
+		PERROR("chown", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+/* Apply owner, mode and mtime to a written file */
+static int finish_file(struct untar *u, struct untar_member *m, int fd)
+{
+	struct timespec times[2];
+	int err;
+
+	err = set_owner(u, m, fd);
+	if (err)
+		return err;
+
+	if (fchmod(fd, m->mode) == -1) {
+		PERROR("fchmod", errno);
+		return errno;
+	}
+
+	times[0].tv_sec = times[1].tv_sec = m->mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if (futimens(fd, times) == -1) {
+		PERROR("futimens", errno);
+	}
+
+	return 0;
+}
+
+/* Wait for the data of the oldest file with writeback started */
+static int sync_oldest(struct untar *u)
+{
+	int fd = u->sync_fds[u->sync_head];
+	int err = 0;
+
+	u->sync_head = (u->sync_head + 1) % SYNC_PENDING_MAX;
+	u->sync_count--;
+
+	if (u->flags & UNTAR_FLAG_DATASYNC) {
+		if (fdatasync(fd) == -1) {
+			PERROR("fdatasync", errno);
+			err = errno;
+		}
+	} else if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE|
+				   SYNC_FILE_RANGE_WRITE|
+				   SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+		PERROR("sync_file_range", errno);
+		err = errno;
+	}
+
+	/* Only pages written back can be dropped */
+	if (!err && (u->flags & UNTAR_FLAG_DROP_CACHE))
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	return err;
+}
+
+static int sync_all(struct untar *u)
+{
+	int err = 0;
+
+	while (u->sync_count && !err)
+		err = sync_oldest(u);
+
+	return err;
+}
+
+/*
+ * Close a written file.  With UNTAR_FLAG_DATASYNC, writeback is started
+ * right away, and the file is kept open until SYNC_PENDING_MAX later files
+ * have been written, by when fdatasync is usually cheap.  The same goes for
+ * UNTAR_FLAG_DROP_CACHE, which waits for writeback to drop the pages.
+ */
+static int close_file(struct untar *u, int fd)
+{
+	int err = 0;
+
+	if (u->flags & (UNTAR_FLAG_WRITEBACK|UNTAR_FLAG_DATASYNC|
+			UNTAR_FLAG_DROP_CACHE))
+		sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+	if (u->flags & (UNTAR_FLAG_DATASYNC|UNTAR_FLAG_DROP_CACHE)) {
+		if (!u->sync_fds) {
+			u->sync_fds = calloc(SYNC_PENDING_MAX,
+					     sizeof(*u->sync_fds));
+			if (!u->sync_fds) {
+				PERROR("calloc", ENOMEM);
+				close(fd);
+				return ENOMEM;
+			}
+		}
+		if (u->sync_count == SYNC_PENDING_MAX)
+			err = sync_oldest(u);
+		u->sync_fds[(u->sync_head + u->sync_count++) %
+			    SYNC_PENDING_MAX] = fd;
+		return err;
+	}
+
+	if (close(fd) == -1) {
+		PERROR("close", errno);
+		return errno;
+	}
+
+	return 0;
+}
+
+static int create_file(struct untar *u, struct untar_member *m)
+{
+	int fd;
+
+	fd = CREATE_RETRY(u, m->name,
+			  openat(u->dirfd, m->name,
+				 O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+				 0600));
+	if (fd == -1) {
+		PERROR(m->name, errno);
+	}
+
+	return fd;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len,
+		       unsigned long long offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, offset);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("pwrite", errno);
+			return errno;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+static int is_zero(const char *buf, size_t len)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+static void hash_zeros(struct sha256 *ctx, unsigned long long len)
+{
+	static const char zeros[ZERO_BLOCK];
+	size_t n;
+
+	for ( ; len ; len -= n) {
+		n = len < sizeof(zeros) ? len : sizeof(zeros);
+		sha256_update(ctx, zeros, n);
+	}
+}
+
+/* Punch out the pending hole, if it was preallocated */
+static int punch_hole(struct file_out *f)
+{
+	if (f->prealloc && f->hole_end > f->hole_start &&
+	    fallocate(f->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+		      f->hole_start, f->hole_end - f->hole_start) == -1 &&
+	    errno != EOPNOTSUPP) {
+		PERROR("fallocate", errno);
+		return errno;
+	}
+
+	f->hole_start = f->hole_end = 0;
+	return 0;
+}
+
+static int add_hole(struct file_out *f, unsigned long long start,
+		    unsigned long long end)
+{
+	int err;
+
+	if (end <= start)
+		return 0;
+
+	if (f->hole_end != start) {
+		err = punch_hole(f);
+		if (err)
+			return err;
+		f->hole_start = start;
+	}
+	f->hole_end = end;
+
+	return 0;
+}
+
+/* Write data at offset, leaving holes for whole blocks of zeros */
+static int write_out(struct file_out *f, const char *buf, size_t len,
+		     unsigned long long offset)
+{
+	size_t n, run;
+	int err;
+
+	while (len) {
+		n = ZERO_BLOCK - offset % ZERO_BLOCK;
+		if (n > len)
+			n = len;
+
+		if (n == ZERO_BLOCK && is_zero(buf, n)) {
+			err = add_hole(f, offset, offset + n);
+			if (err)
+				return err;
+		} else {
+			/* Write everything up to the next block of zeros */
+			for (run = n ; run < len ; run += n) {
+				n = len - run < ZERO_BLOCK ?
+					len - run : ZERO_BLOCK;
+				if (n == ZERO_BLOCK && is_zero(buf + run, n))
+					break;
+			}
+			n = run;
+
+			err = punch_hole(f);
+			if (!err)
+				err = pwrite_full(f->fd, buf, n, offset);
+			if (err)
+				return err;
+			throttle_io(n, 0);
+			f->end = offset + n;
+		}
+
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop large files from the page cache while they are written, a chunk
+ * behind: by the time a chunk is filled, the one before it has mostly been
+ * written back.
+ */
+static void drop_written(struct file_out *f)
+{
+	if (f->wb_end > f->wb_start) {
+		sync_file_range(f->fd, f->wb_start, f->wb_end - f->wb_start,
+				SYNC_FILE_RANGE_WAIT_BEFORE|
+				SYNC_FILE_RANGE_WRITE|
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(f->fd, f->wb_start, f->wb_end - f->wb_start,
+			      POSIX_FADV_DONTNEED);
+	}
+
+	sync_file_range(f->fd, f->wb_end, f->end - f->wb_end,
+			SYNC_FILE_RANGE_WRITE);
+	f->wb_start = f->wb_end;
+	f->wb_end = f->end;
+}
+
+/*
+ * Copy len bytes of member data to offset.  With pad set, this is the
+ * last of the data, and the padding is read along with it when it fits.
+ */
+static int copy_data(struct untar *u, struct file_out *f,
+		     unsigned long long offset, unsigned long long len,
+		     int pad, struct sha256 *ctx)
+{
+	size_t n;
+	int err;
+
+	for ( ; len ; len -= n, offset += n) {
+		n = len < u->buf_size ? len : u->buf_size;
+		err = read_full(u, u->buf, pad && padded(n) <= u->buf_size ?
+				padded(n) : n);
+		if (err)
+			return err;
+		if (ctx)
+			sha256_update(ctx, u->buf, n);
+		err = write_out(f, u->buf, n, offset);
+		if (err)
+			return err;
+		if ((u->flags & UNTAR_FLAG_DROP_CACHE) &&
+		    f->end >= f->wb_end + DROP_CHUNK)
+			drop_written(f);
+	}
+
+	return 0;
+}
+
+/* Sparse map of pax 1.0, as decimal lines in front of the data */
+static int read_sparse_map(struct untar *u, unsigned long long *map_size)
+{
+	char *text = NULL, *p, *end;
+	unsigned long long count = 0, offset, size, i;
+	size_t len = 0, lines = 0, need = 1;
+	int err = 0;
+
+	while (lines < need) {
+		p = realloc(text, len + BLOCK_SIZE + 1);
+		if (!p) {
+			err = ENOMEM;
+			goto out;
+		}
+		text = p;
+		err = read_full(u, text + len, BLOCK_SIZE);
+		if (err)
+			goto out;
+		text[len + BLOCK_SIZE] = '\0';
+		for (p = text + len ; p < text + len + BLOCK_SIZE ; p++)
+			if (*p == '\n')
+				lines++;
+		len += BLOCK_SIZE;
+
+		if (lines && need == 1) {
+			count = strtoull(text, NULL, 10);
+			if (count > SPARSE_MAX_ENTRIES) {
+				err = EINVAL;
+				goto out;
+			}
+			need = 1 + 2 * count;
+		}
+	}
+	*map_size = len;
+
+	p = strchr(text, '\n') + 1;
+	for (i = 0 ; i < count ; i++) {
+		offset = strtoull(p, &end, 10);
+		if (*end != '\n')
+			break;
+		size = strtoull(end + 1, &end, 10);
+		if (*end != '\n')
+			break;
+		p = end + 1;
+		err = add_sparse(u, offset, size);
+		if (err)
+			goto out;
+	}
+	if (i < count)
+		err = EINVAL;
+
+out:
+	if (err) {
+		ERROR("invalid sparse map");
+	}
+	free(text);
+	return err;
+}
+
+static int copy_sparse_data(struct untar *u, struct untar_member *m,
+			    struct file_out *f, struct sha256 *ctx)
+{
+	unsigned long long left = m->size, map_size = 0, offset, len;
+	unsigned long long done = 0;
+	unsigned i;
+	int err;
+
+	if (u->sparse_format == SPARSE_MAP_IN_DATA) {
+		err = read_sparse_map(u, &map_size);
+		if (err)
+			return err;
+		left -= map_size < left ? map_size : left;
+	}
+
+	for (i = 0 ; i < u->num_sparse ; i++) {
+		offset = u->sparse[i * 2];
+		len = u->sparse[i * 2 + 1];
+		if (len > left || offset < done) {
+			ERROR("%s: invalid sparse map", m->name);
+			return EINVAL;
+		}
+
+		err = add_hole(f, done, offset);
+		if (err)
+			return err;
+		if (ctx)
+			hash_zeros(ctx, offset - done);
+
+		err = copy_data(u, f, offset, len, 0, ctx);
+		if (err)
+			return err;
+		left -= len;
+		done = offset + len;
+	}
+
+	if (m->realsize > done) {
+		err = add_hole(f, done, m->realsize);
+		if (err)
+			return err;
+		if (ctx)
+			hash_zeros(ctx, m->realsize - done);
+	}
+
+	return 0;
+}
+
+static int extract_file(struct untar *u, struct untar_member *m)
+{
+	struct file_out f;
+	struct sha256 ctx, *hash = NULL;
+	unsigned long long size;
+	int fd, err = 0;
+
+	fd = create_file(u, m);
+	if (fd == -1)
+		return errno;
+
+	memset(&f, 0, sizeof(f));
+	f.fd = fd;
+
+	/* Allocate in one go, for less fragmentation, and to fail early
+	 * when out of space */
+	size = u->sparse_format ? m->realsize : m->size;
+	if (size >= PREALLOC_MIN) {
+		if (fallocate(fd, 0, 0, size) == 0) {
+			f.prealloc = 1;
+		} else if (errno != EOPNOTSUPP) {
+			PERROR("fallocate", errno);
+			err = errno;
+			goto out;
+		}
+	}
+
+	if (u->flags & UNTAR_FLAG_HASH) {
+		sha256_init(&ctx);
+		hash = &ctx;
+	}
+
+	if (u->sparse_format)
+		err = copy_sparse_data(u, m, &f, hash);
+	else
+		err = copy_data(u, &f, 0, m->size, 1, hash);
+	if (err)
+		goto out;
+
+	/* Remaining padding, if not read along with the data */
+	if (u->pos < m->end) {
+		err = skip_data(u, m->end - u->pos);
+		if (err)
+			goto out;
+	}
+
+	err = punch_hole(&f);
+	if (err)
+		goto out;
+
+	/* Trailing holes */
+	if (!f.prealloc && f.end < size && ftruncate(fd, size) == -1) {
+		PERROR("ftruncate", errno);
+		err = errno;
+		goto out;
+	}
+
+	if (hash)
+		sha256_final(&ctx, m->digest);
+
+	err = finish_file(u, m, fd);
+
+out:
+	if (err) {
+		close(fd);
+		return err;
+	}
+	return close_file(u, fd);
+}
+
+/* Wait for the FIFO of a streamed file to be opened for reading */
+static int open_stream(struct untar *u, struct untar_member *m, int *fd)
+{
+	for (;;) {
+		*fd = openat(u->dirfd, m->name,
+			     O_WRONLY|O_NONBLOCK|O_NOFOLLOW|O_CLOEXEC);
+		if (*fd != -1)
+			break;
+		if (errno != ENXIO) {
+			PERROR(m->name, errno);
+			return errno;
+		}
+		if (!u->ops->stream_alive(u->priv)) {
+			ERROR("%s: command exited without reading it",
+			      m->name);
+			return EPIPE;
+		}
+		usleep(STREAM_POLL_US);
+	}
+
+	if (fcntl(*fd, F_SETFL, 0) == -1) {
+		PERROR("fcntl", errno);
+		close(*fd);
+		return errno;
+	}
+
+	return 0;
+}
+
+static int stream_file(struct untar *u, struct untar_member *m)
+{
+	struct sha256 ctx;
+	unsigned long long left;
+	size_t n;
+	int fd, err;
+
+	if (CREATE_RETRY(u, m->name,
+			 mkfifoat(u->dirfd, m->name, 0600)) == -1) {
+		PERROR(m->name, errno);
+		return errno;
+	}
+
+	err = open_stream(u, m, &fd);
+	if (err)
+		goto out;
+
+	if (u->flags & UNTAR_FLAG_HASH)
+		sha256_init(&ctx);
+
+	for (left = m->size ; left ; left -= n) {
+		n = left < u->buf_size ? left : u->buf_size;
+		err = read_full(u, u->buf, n);
+		if (err)
+			break;
+		if (u->flags & UNTAR_FLAG_HASH)
+			sha256_update(&ctx, u->buf, n);
+		err = write_full(fd, u->buf, n);
+		if (err)
+			break;
+	}
+
+	if (!err && (u->flags & UNTAR_FLAG_HASH))
+		sha256_final(&ctx, m->digest);
+
+	close(fd);
+out:
+	unlinkat(u->dirfd, m->name, 0);
+	return err;
+}
+
+/* Write a file the writer failed to, as done without a writer */
+static int retry_file(struct untar_member *m, const void *data, void *priv)
+{
+	struct untar *u = priv;
+	int fd, err;
+
+	fd = create_file(u, m);
+	if (fd == -1)
+		return errno;
+
+	err = write_full(fd, data, m->size);
+	if (!err)
+		err = finish_file(u, m, fd);
+
+	if (err) {
+		close(fd);
+		return err;
+	}
+	return close_file(u, fd);
+}
+
+static int file_written(struct untar_member *m, void *priv)
+{
+	struct untar *u = priv;
+
+	if (u->ops && u->ops->done)
+		return u->ops->done(m, u->priv);
+
+	return 0;
+}
+
+static const struct writer_ops writer_ops = {
+	.done = file_written,
+	.retry = retry_file,
+};
+
+/* Read a small file into a writer buffer, and leave the rest to it */
+static int queue_file(struct untar *u, struct untar_member *m)
+{
+	struct sha256 ctx;
+	void *buf;
+	int err;
+
+	err = writer_buf(u->writer, &buf);
+	if (err)
+		return err;
+
+	err = read_full(u, buf, padded(m->size));
+	if (err)
+		return err;
+
+	if (u->flags & UNTAR_FLAG_HASH) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, buf, m->size);
+		sha256_final(&ctx, m->digest);
+	}
+	throttle_io(m->size, 1);
+
+	return writer_queue(u->writer, m);
+}
+
+static int extract_dir(struct untar *u, struct untar_member *m)
+{
+	struct untar_dir *dir;
+	int ret, err;
+
+	ret = mkdirat(u->dirfd, m->name, 0700);
+	if (ret == -1 && errno == ENOENT && make_parents(u, m->name) == 0)
+		ret = mkdirat(u->dirfd, m->name, 0700);
+	if (ret == -1 && errno != EEXIST) {
+		PERROR(m->name, errno);
+		return errno;
+	}
+
+	err = set_owner(u, m, -1);
+	if (err)
+		return err;
+
+	if (fchmodat(u->dirfd, m->name, m->mode, 0) == -1) {
+		PERROR("fchmodat", errno);
+		return errno;
+	}
+
+	/* Directory mtime is set when done, as extracting into it changes
+	 * it */
+	dir = malloc(sizeof(*dir));
+	if (!dir)
+		return ENOMEM;
+	dir->name = strdup(m->name);
+	dir->mtime = m->mtime;
+	dir->next = u->dirs;
+	u->dirs = dir;
+
+	return 0;
+}
+
+static int extract_link(struct untar *u, struct untar_member *m)
+{
+	struct timespec times[2];
+	int ret, err;
+
+	if (!m->linkname) {
+		ERROR("link without target: %s", m->name);
+		return EINVAL;
+	}
+
+	if (m->type == '1') {
+		if (sanitize_name(&m->linkname))
+			return EINVAL;
+		ret = CREATE_RETRY(u, m->name,
+				   linkat(u->dirfd, m->linkname,
+					  u->dirfd, m->name, 0));
+		if (ret == -1) {
+			PERROR(m->name, errno);
+			return errno;
+		}
+		return 0;
+	}
+
+	ret = CREATE_RETRY(u, m->name,
+			   symlinkat(m->linkname, u->dirfd, m->name));
+	if (ret == -1) {
+		PERROR(m->name, errno);
+		return errno;
+	}
+
+	err = set_owner(u, m, -1);
+	if (err)
+		return err;
+
+	times[0].tv_sec = times[1].tv_sec = m->mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	utimensat(u->dirfd, m->name, times, AT_SYMLINK_NOFOLLOW);
+
+	return 0;
+}
+
+static int extract_special(struct untar *u, struct untar_member *m)
+{
+	struct timespec times[2];
+	mode_t mode = m->mode;
+	int ret, err;
+
+	switch (m->type) {
+	case '3':
+		mode |= S_IFCHR;
+		break;
+	case '4':
+		mode |= S_IFBLK;
+		break;
+	default:
+		mode |= S_IFIFO;
+		break;
+	}
+
+	ret = CREATE_RETRY(u, m->name,
+			   mknodat(u->dirfd, m->name, mode, m->rdev));
+	if (ret == -1) {
+		PERROR(m->name, errno);
+		return errno;
+	}
+
+	err = set_owner(u, m, -1);
+	if (err)
+		return err;
+
+	times[0].tv_sec = times[1].tv_sec = m->mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	utimensat(u->dirfd, m->name, times, 0);
+
+	return 0;
+}
+
+static int extract_member(struct untar *u, struct untar_member *m)
+{
+	int stream = 0, err;
+
+	if (u->stream_min && m->size >= u->stream_min &&
+	    (m->type == '0' || m->type == '\0' || m->type == '7') &&
+	    !u->sparse_format && u->ops && u->ops->stream) {
+		/* Everything before must be complete, as the reader of the
+		 * stream may be started right away */
+		err = u->writer ? writer_flush(u->writer) : 0;
+		if (!err)
+			err = sync_all(u);
+		if (err)
+			return err;
+		stream = u->ops->stream(m, u->priv);
+	}
+
+	if (u->writer && !stream) {
+		if ((m->type == '0' || m->type == '\0' || m->type == '7') &&
+		    !u->sparse_format &&
+		    padded(m->size) <= writer_max_size(u->writer))
+			return queue_file(u, m);
+
+		/* Everything else is done in order with the queued files */
+		err = writer_flush(u->writer);
+		if (err)
+			return err;
+	}
+
+	switch (m->type) {
+	case '0':
+	case '\0':
+	case '7':
+	case 'S':
+		if (stream)
+			err = stream_file(u, m);
+		else
+			err = extract_file(u, m);
+		break;
+	case '1':
+	case '2':
+		err = extract_link(u, m);
+		break;
+	case '3':
+	case '4':
+	case '6':
+		err = extract_special(u, m);
+		break;
+	case '5':
+		err = extract_dir(u, m);
+		break;
+	case 'V':
+		/* Volume label */
+		err = 0;
+		break;
+	default:
+		INFO("skipping %s: unsupported type '%c'", m->name, m->type);
+		err = 0;
+		break;
+	}
+	if (err)
+		return err;
+	throttle_io(0, 1);
+
+	/* Skip data (and padding) not consumed above */
+	if (u->pos < m->end) {
+		err = skip_data(u, m->end - u->pos);
+		if (err)
+			return err;
+	}
+
+	if (u->ops && u->ops->done)
+		return u->ops->done(m, u->priv);
+
+	return 0;
+}
+
+static void free_member(struct untar_member *m)
+{
+	free(m->name);
+	free(m->linkname);
+	memset(m, 0, sizeof(*m));
+}
+
+static void set_dir_times(struct untar *u)
+{
+	struct untar_dir *dir;
+	struct timespec times[2];
+
+	while ((dir = u->dirs)) {
+		times[0].tv_sec = times[1].tv_sec = dir->mtime;
+		times[0].tv_nsec = times[1].tv_nsec = 0;
+		utimensat(u->dirfd, dir->name, times, 0);
+		u->dirs = dir->next;
+		free(dir->name);
+		free(dir);
+	}
+}
+
+int untar_extract(struct untar *u)
+{
+	struct tar_header h;
+	struct untar_member m;
+	char *longname = NULL, *longlink = NULL, *pax = NULL;
+	unsigned long long offset = 0;
+	int have_pax = 0, pending = 0;
+	mode_t umask_val;
+	int err = 0;
+
+	memset(&m, 0, sizeof(m));
+
+	umask_val = umask(0);
+	umask(umask_val);
+
+	/* With a memory budget too small for the writer, write in place */
+	if (u->engine != WRITER_ENGINE_SYNC && u->writer_mem &&
+	    u->writer_mem < writer_min_mem()) {
+		INFO("memory limit too low for background writes");
+		u->engine = WRITER_ENGINE_SYNC;
+	}
+
+	if (u->engine != WRITER_ENGINE_SYNC && !u->writer) {
+		err = writer_open(&u->writer, u->engine, u->dirfd,
+				  u->writer_mem,
+				  (u->flags & UNTAR_FLAG_DATASYNC ?
+				   WRITER_FLAG_DATASYNC : 0) |
+				  (u->flags & UNTAR_FLAG_DROP_CACHE ?
+				   WRITER_FLAG_DROP_CACHE : 0),
+				  &writer_ops, u);
+		if (err)
+			return err;
+	}
+
+	/* Resume after the last member completed by an earlier run */
+	if (u->resume) {
+		err = skip_data(u, u->resume);
+		if (err)
+			return err;
+	}
+
+	for (;;) {
+		if (!pending)
+			offset = u->pos;
+
+		err = read_full(u, &h, sizeof(h));
+		if (err)
+			break;
+
+		if (is_zero_block((char *)&h))
+			break;
+
+		if (!verify_checksum(&h)) {
+			ERROR("tar header checksum error at offset %llu",
+			      u->pos - BLOCK_SIZE);
+			err = EINVAL;
+			break;
+		}
+
+		/* Headers describing the following member */
+		if (h.typeflag == 'L' || h.typeflag == 'K' ||
+		    h.typeflag == 'x' || h.typeflag == 'g') {
+			unsigned long long size =
+				parse_number(h.size, sizeof(h.size));
+
+			if (h.typeflag == 'L')
+				err = read_ext_data(u, size, &longname);
+			else if (h.typeflag == 'K')
+				err = read_ext_data(u, size, &longlink);
+			else
+				err = read_ext_data(u, size, &pax);
+			if (err)
+				break;
+
+			if (h.typeflag == 'x') {
+				err = parse_pax(u, pax, size, &m, &have_pax);
+				if (err)
+					break;
+			}
+
+			pending = 1;
+			continue;
+		}
+
+		if (!m.name) {
+			if (longname) {
+				m.name = longname;
+				longname = NULL;
+			} else if (memcmp(h.magic, "ustar\0", 6) == 0 &&
+				   h.prefix[0]) {
+				m.name = malloc(sizeof(h.prefix) +
+						sizeof(h.name) + 2);
+				if (m.name)
+					sprintf(m.name, "%.*s/%.*s",
+						(int)strnlen(h.prefix,
+							     sizeof(h.prefix)),
+						h.prefix,
+						(int)strnlen(h.name,
+							     sizeof(h.name)),
+						h.name);
+			} else {
+				m.name = strndup_field(h.name, sizeof(h.name));
+			}
+		}
+		if (!m.linkname) {
+			if (longlink) {
+				m.linkname = longlink;
+				longlink = NULL;
+			} else if (h.linkname[0]) {
+				m.linkname = strndup_field(h.linkname,
+							   sizeof(h.linkname));
+			}
+		}
+		if (!m.name) {
+			err = ENOMEM;
+			break;
+		}
+
+		m.type = h.typeflag;
+		m.mode = parse_number(h.mode, sizeof(h.mode)) & 07777;
+		if (geteuid() != 0)
+			m.mode &= ~umask_val;
+		if (!(have_pax & 1))
+			m.size = parse_number(h.size, sizeof(h.size));
+		if (!(have_pax & 2))
+			m.mtime = parse_number(h.mtime, sizeof(h.mtime));
+		if (!(have_pax & 4))
+			m.uid = parse_number(h.uid, sizeof(h.uid));
+		if (!(have_pax & 8))
+			m.gid = parse_number(h.gid, sizeof(h.gid));
+		m.rdev = makedev(parse_number(h.devmajor, sizeof(h.devmajor)),
+				 parse_number(h.devminor, sizeof(h.devminor)));
+		m.offset = offset;
+
+		if (m.type == 'S') {
+			err = read_gnu_sparse(u, &h, &m);
+			if (err)
+				break;
+		}
+
+		/* Links, directories and devices carry no data */
+		if (m.type == '1' || m.type == '2' || m.type == '3' ||
+		    m.type == '4' || m.type == '5' || m.type == '6')
+			m.size = 0;
+		m.end = u->pos + padded(m.size);
+
+		err = sanitize_name(&m.name);
+		if (err)
+			break;
+
+		if (m.name[0] == '\0') {
+			/* The destination directory itself */
+			if (m.type == '5')
+				strcpy(m.name, ".");
+			else
+				m.type = 'V';
+		}
+
+		err = extract_member(u, &m);
+		if (err)
+			break;
+
+		free_member(&m);
+		have_pax = 0;
+		pending = 0;
+		u->num_sparse = 0;
+		u->sparse_format = SPARSE_NONE;
+	}
+
+	if (!err && u->writer)
+		err = writer_flush(u->writer);
+	if (!err)
+		err = sync_all(u);
+
+	/* Drain the decompressor or stream, so it does not fail with EPIPE */
+	if (!err && (u->decompressor || lseek(u->in, 0, SEEK_CUR) == -1))
+		while (read(u->in, u->buf, u->buf_size) > 0)
+			;
+
+	set_dir_times(u);
+
+	free_member(&m);
+	free(longname);
+	free(longlink);
+	free(pax);
+
+	return err;
+}
+
+/*
+ * Check a header block of an uncompressed tar stream, and find the size of
+ * the data following it, for following a stream without extracting it.
+ * Returns ENODATA at the end of the archive, and ENOTSUP for headers with
+ * more headers in place of data.
+ */
+int untar_check_header(const void *block, unsigned long long *data_size)
+{
+	const struct tar_header *h = block;
+
+	if (is_zero_block(block))
+		return ENODATA;
+	if (!verify_checksum(h))
+		return EINVAL;
+	if (h->typeflag == 'S')
+		return ENOTSUP;
+
+	if (h->typeflag == '1' || h->typeflag == '2' || h->typeflag == '3' ||
+	    h->typeflag == '4' || h->typeflag == '5' || h->typeflag == '6')
+		*data_size = 0;
+	else
+		*data_size = padded(parse_number(h->size, sizeof(h->size)));
+
+	return 0;
+}
+
+static unsigned long long get_le(const unsigned char *p, int len)
+{
+	unsigned long long v = 0;
+
+	while (len--)
+		v = v << 8 | p[len];
+	return v;
+}
+
+/* Multibyte integer of the xz index */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+		      unsigned long long *v)
+{
+	int shift;
+
+	*v = 0;
+	for (shift = 0 ; *p < end && shift < 63 ; shift += 7) {
+		*v |= (unsigned long long)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80))
+			return 0;
+	}
+
+	return EINVAL;
+}
+
+/*
+ * Uncompressed size of the xz stream ending at end, from its index, and the
+ * size of the stream itself.
+ */
+static int xz_stream_size(int fd, off_t end, unsigned long long *size,
+			  unsigned long long *stream_size)
+{
+	unsigned char footer[XZ_FOOTER_SIZE], *index = NULL;
+	const unsigned char *p, *index_end;
+	unsigned long long index_size, count, unpadded, usize, blocks = 0;
+	int err = ENODATA;
+
+	if (end < 2 * XZ_FOOTER_SIZE ||
+	    pread(fd, footer, sizeof(footer),
+		  end - sizeof(footer)) != sizeof(footer) ||
+	    memcmp(footer + 10, "YZ", 2) != 0)
+		return ENODATA;
+
+	index_size = (get_le(footer + 4, 4) + 1) * 4;
+	if (index_size > (unsigned long long)end - 2 * XZ_FOOTER_SIZE)
+		return ENODATA;
+
+	index = malloc(index_size);
+	if (!index)
+		return ENOMEM;
+	if (pread(fd, index, index_size,
+		  end - XZ_FOOTER_SIZE - index_size) !=
+	    (ssize_t)index_size || index[0] != 0)
+		goto out;
+
+	p = index + 1;
+	index_end = index + index_size;
+	*size = 0;
+	if (get_varint(&p, index_end, &count))
+		goto out;
+	while (count--) {
+		if (get_varint(&p, index_end, &unpadded) ||
+		    get_varint(&p, index_end, &usize))
+			goto out;
+		blocks += (unpadded + 3) & ~3ULL;
+		*size += usize;
+	}
+
+	*stream_size = 2 * XZ_FOOTER_SIZE + blocks + index_size;
+	if (*stream_size <= (unsigned long long)end)
+		err = 0;
+
+out:
+	free(index);
+	return err;
+}
+
+/* Sum of uncompressed sizes of the concatenated streams of an xz file */
+static int xz_size(int fd, off_t image_size, unsigned long long *size)
+{
+	unsigned long long stream_usize, stream_size;
+	unsigned char padding[4];
+	off_t end = image_size;
+	int err;
+
+	*size = 0;
+	while (end > 0) {
+		/* Stream padding, in multiples of four zero bytes */
+		if (pread(fd, padding, sizeof(padding),
+			  end - sizeof(padding)) != sizeof(padding))
+			return ENODATA;
+		if (!memcmp(padding, "\0\0\0\0", sizeof(padding))) {
+			end -= sizeof(padding);
+			continue;
+		}
+
+		err = xz_stream_size(fd, end, &stream_usize, &stream_size);
+		if (err)
+			return err;
+		*size += stream_usize;
+		end -= stream_size;
+	}
+
+	return 0;
+}
+
+/*
+ * The gzip trailer only records the size of the last member, modulo 2^32.
+ * That is the whole size only if the image is small enough that deflate
+ * can't have expanded it past 4 GiB, and if no second member follows the
+ * first.  Anything that looks like a member header is taken to be one,
+ * which at worst leaves the size unknown.
+ */
+static int gzip_size(int fd, off_t file_size, unsigned long long *size)
+{
+	unsigned char buf[GZIP_SCAN_CHUNK + 2], isize[4];
+	off_t pos;
+	ssize_t len;
+	size_t i;
+
+	if (file_size < 18 ||
+	    (unsigned long long)file_size * GZIP_MAX_RATIO >= 1ULL << 32)
+		return ENODATA;
+
+	for (pos = 1 ; pos < file_size ; pos += GZIP_SCAN_CHUNK) {
+		len = pread(fd, buf, sizeof(buf), pos);
+		if (len == -1) {
+			PERROR("pread", errno);
+			return errno;
+		}
+		for (i = 0 ; i + 2 < (size_t)len ; i++)
+			if (!memcmp(buf + i, "\x1f\x8b\x08", 3))
+				return ENODATA;
+	}
+
+	if (pread(fd, isize, sizeof(isize), file_size - sizeof(isize)) !=
+	    sizeof(isize))
+		return ENODATA;
+	*size = get_le(isize, 4);
+	return 0;
+}
+
+/*
+ * Size of the uncompressed tar stream, which is what extraction takes up at
+ * most, short of filesystem overhead.  Returns ENODATA when the size is not
+ * known up front, as with most compressors, and with gzip unless
+ * gzip_size() can prove it.
+ */
+int untar_size(const char *image, unsigned long long *size)
+{
+	unsigned char magic[6];
+	struct stat st;
+	int fd, i, err = ENODATA;
+
+	fd = open(image, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		PERROR("open", errno);
+		return errno;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		PERROR("fstat", errno);
+		err = errno;
+		goto out;
+	}
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		goto out;
+
+	if (memcmp(magic, "\x1f\x8b", 2) == 0) {
+		err = gzip_size(fd, st.st_size, size);
+	} else if (memcmp(magic, "\xfd" "7zXZ\0", 6) == 0) {
+		err = xz_size(fd, st.st_size, size);
+	} else {
+		for (i = 0 ; decompressors[i].magic ; i++)
+			if (memcmp(magic, decompressors[i].magic,
+				   decompressors[i].len) == 0)
+				goto out;
+		/* Not compressed */
+		*size = st.st_size;
+		err = 0;
+	}
+
+out:
+	close(fd);
+	return err;
+}
+
+int untar_close(struct untar *u)
+{
+	int status, err = 0;
+
+	if (u->writer) {
+		writer_close(u->writer);
+		u->writer = NULL;
+	}
+	while (u->sync_count) {
+		close(u->sync_fds[u->sync_head]);
+		u->sync_head = (u->sync_head + 1) % SYNC_PENDING_MAX;
+		u->sync_count--;
+	}
+	free(u->sync_fds);
+	u->sync_fds = NULL;
+	free(u->sparse);
+	u->sparse = NULL;
+	u->num_sparse = 0;
+	if (u->in != -1)
+		close(u->in);
+	if (u->image_fd != -1) {
+		posix_fadvise(u->image_fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(u->image_fd);
+		u->image_fd = -1;
+	}
+	if (u->dirfd != -1)
+		close(u->dirfd);
+	arena_free(u->buf);
+	u->buf = NULL;
+
+	if (u->decompressor) {
+		if (waitpid(u->decompressor, &status, 0) == -1) {
+			PERROR("waitpid", errno);
+			err = errno;
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			ERROR("decompressor failed");
+			err = EIO;
+		}
+		u->decompressor = 0;
+	}
+
+	/* Killed by SIGPIPE when the decompressor gave up */
+	if (u->feeder) {
+		if (waitpid(u->feeder, &status, 0) == -1) {
+			PERROR("waitpid", errno);
+			err = errno;
+		} else if (WIFEXITED(status) && WEXITSTATUS(status) && !err) {
+			ERROR("reading image failed");
+			err = EIO;
+		}
+		u->feeder = 0;
+	}
+
+	return err;
+}
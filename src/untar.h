@@ -0,0 +1,111 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UNTAR_H_
+#define _UNTAR_H_
+
+#include <sys/types.h>
+
+#include "sha256.h"
+
+struct untar_member {
+	char *name;			/* Path, relative to destination */
+	char *linkname;			/* Target of hard and symbolic links */
+	char type;			/* Tar typeflag */
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	time_t mtime;
+	dev_t rdev;
+	unsigned long long size;	/* Size of member data */
+	unsigned long long realsize;	/* File size if sparse, else 0 */
+	unsigned long long offset;	/* Stream offset of first header */
+	unsigned long long end;		/* Stream offset after member data */
+	unsigned char digest[SHA256_DIGEST_LEN]; /* With UNTAR_FLAG_HASH */
+};
+
+struct untar_ops {
+	/* Called when a member has been extracted */
+	int (*done)(struct untar_member *member, void *priv);
+	/* Called for files of at least stream_min bytes, returns non-zero
+	 * to have the data fed through a FIFO in place of the file */
+	int (*stream)(struct untar_member *member, void *priv);
+	/* Returns non-zero while streamed files may still be opened */
+	int (*stream_alive)(void *priv);
+	/* Called every so often with the stream offset reached */
+	void (*progress)(unsigned long long pos, void *priv);
+};
+
+/* Bytes needed to tell the compression of an image */
+#define UNTAR_HEAD_SIZE			8
+
+struct untar_dir;
+struct writer;
+
+struct untar {
+	int in;				/* Uncompressed tar stream */
+	unsigned char head[UNTAR_HEAD_SIZE];	/* Read ahead of in */
+	size_t head_len;
+	int dirfd;			/* Destination directory */
+	int flags;
+	pid_t decompressor;		/* Decompressor process, or 0 */
+	pid_t feeder;			/* Feeding it from a stream, or 0 */
+	int image_fd;			/* Image, to drop from the page cache */
+	unsigned long long image_dropped;	/* Image dropped up to */
+	unsigned long long drop_pos;	/* Stream offset of last drop */
+	unsigned long long progress_pos;	/* Of last progress call */
+	unsigned long long pos;		/* Current stream offset */
+	unsigned long long resume;	/* Offset to resume extraction at */
+	char *buf;
+	size_t buf_size;
+	unsigned long long mem_limit;	/* Decompressor memory, 0 is any */
+	int engine;			/* Writer engine for small files */
+	size_t writer_mem;		/* Writer buffers, 0 for default */
+	struct writer *writer;
+	unsigned long long stream_min;	/* Files to stream, 0 is none */
+	unsigned long long *sparse;	/* Data offset and size pairs */
+	unsigned num_sparse;
+	int sparse_format;		/* Of the current member */
+	int *sync_fds;			/* Files with data sync pending */
+	unsigned sync_head;
+	unsigned sync_count;
+	const struct untar_ops *ops;
+	void *priv;
+	struct untar_dir *dirs;		/* Directories to set mtime on */
+};
+
+#define UNTAR_BLOCK_SIZE		512
+
+#define UNTAR_FLAG_HASH			(1 << 0)
+/* Start writeback of each file as soon as it is written */
+#define UNTAR_FLAG_WRITEBACK		(1 << 1)
+/* fdatasync each file, overlapped with extracting the following ones */
+#define UNTAR_FLAG_DATASYNC		(1 << 2)
+/* Drop the image and written files from the page cache once done with */
+#define UNTAR_FLAG_DROP_CACHE		(1 << 3)
+
+int untar_open(struct untar *u, const char *image, const char *dir);
+int untar_open_fd(struct untar *u, int fd, const void *head, size_t head_len,
+		  const char *dir);
+int untar_extract(struct untar *u);
+int untar_close(struct untar *u);
+int untar_size(const char *image, unsigned long long *size);
+int untar_check_header(const void *block, unsigned long long *data_size);
+
+#endif /* _UNTAR_H_ */
@@ -0,0 +1,434 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+
+#include "common.h"
+#include "sha256.h"
+#include "untar.h"
+#include "verify.h"
+
+/*
+ * Incremental image verification.
+ *
+ * Started as soon as an image starts to arrive, the verifier follows the
+ * growing file, hashing the data as it is written, and checking the headers
+ * of uncompressed tar images on the way.  When the image is complete, the
+ * result is left next to it as
+ *
+ *   <image>.verified	"<sha256> <size> <mtime> ok|bad"
+ *
+ * for dupdate to use instead of reading the whole image again.  The result
+ * only applies as long as size and mtime of the image match, so it is only
+ * good for images written sequentially.  Writes that do not grow the file,
+ * as when it is preallocated and then written in place, or a file that
+ * shrinks, may have changed data already hashed, so no result is left then.
+ * While the verifier runs, it holds a lock on <image>.verifying, which
+ * dupdate waits for.
+ *
+ * The image is taken to be complete when the data has been read up to the
+ * end, and nobody has it open for writing anymore, which a read lease tells.
+ */
+
+#define VERIFIED_SUFFIX			".verified"
+#define VERIFYING_SUFFIX		".verifying"
+#define VERIFY_IDLE_MS			1000
+#define VERIFY_BUF_SIZE			(256 * 1024)
+#define TAR_MAGIC_OFFSET		257
+
+struct verifier {
+	int fd;
+	struct sha256 ctx;
+	unsigned long long pos;		/* Data hashed up to */
+	unsigned long long seen;	/* Size when events were last read */
+	unsigned long long header;	/* Offset of next tar header */
+	int probed;			/* Image format known */
+	int check_tar;			/* Headers still being checked */
+	int bad;
+	char *buf;
+};
+
+static char *side_path(const char *image, const char *suffix)
+{
+	static char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s%s", image, suffix) >=
+	    (int)sizeof(path))
+		return NULL;
+	return path;
+}
+
+/* Check the tar headers within the data read so far */
+static void check_headers(struct verifier *v)
+{
+	char block[UNTAR_BLOCK_SIZE];
+	unsigned long long size;
+	int err;
+
+	/* Only uncompressed tar images can be followed header by header */
+	if (!v->probed && v->pos >= TAR_MAGIC_OFFSET + 5) {
+		v->probed = 1;
+		v->check_tar = pread(v->fd, block, 5, TAR_MAGIC_OFFSET) == 5 &&
+			memcmp(block, "ustar", 5) == 0;
+	}
+
+	while (v->check_tar && v->header + sizeof(block) <= v->pos) {
+		if (pread(v->fd, block, sizeof(block), v->header) !=
+		    sizeof(block))
+			return;
+
+		err = untar_check_header(block, &size);
+		if (err == EINVAL) {
+			ERROR("tar header checksum error at offset %llu",
+			      v->header);
+			v->bad = 1;
+		}
+		if (err) {
+			v->check_tar = 0;
+			return;
+		}
+		v->header += sizeof(block) + size;
+	}
+}
+
+/* Hash what has been written since last time */
+static int read_new(struct verifier *v)
+{
+	ssize_t n;
+
+	for (;;) {
+		n = read(v->fd, v->buf, VERIFY_BUF_SIZE);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("read", errno);
+			return errno;
+		}
+		if (n == 0)
+			break;
+		sha256_update(&v->ctx, v->buf, n);
+		v->pos += n;
+	}
+
+	check_headers(v);
+	return 0;
+}
+
+/* Whether anybody still has the image open for writing */
+static int has_writers(struct verifier *v, int closed)
+{
+	if (fcntl(v->fd, F_SETLEASE, F_RDLCK) == 0) {
+		fcntl(v->fd, F_SETLEASE, F_UNLCK);
+		return 0;
+	}
+	if (errno == EAGAIN)
+		return 1;
+
+	/* Leases not available, so go by close_write alone */
+	return !closed;
+}
+
+/*
+ * Each batch of modify events must come with growth of the file since the
+ * previous batch, or something already hashed may have been overwritten.
+ */
+static int check_appended(struct verifier *v, int modified)
+{
+	struct stat st;
+
+	if (fstat(v->fd, &st) == -1) {
+		PERROR("fstat", errno);
+		return errno;
+	}
+
+	/* Unless nothing has been hashed yet, as when truncated on open */
+	if ((unsigned long long)st.st_size < v->pos ||
+	    (modified && v->pos && (unsigned long long)st.st_size <= v->seen)) {
+		INFO("image not written sequentially, not verified");
+		return ECANCELED;
+	}
+
+	v->seen = st.st_size;
+	return 0;
+}
+
+static int write_result(struct verifier *v, const char *image)
+{
+	unsigned char digest[SHA256_DIGEST_LEN];
+	char hex[SHA256_HEX_LEN], tmp[PATH_MAX + 8], *path;
+	struct stat st;
+	FILE *f;
+
+	if (fstat(v->fd, &st) == -1) {
+		PERROR("fstat", errno);
+		return errno;
+	}
+
+	if ((unsigned long long)st.st_size != v->pos) {
+		INFO("image changed size, not verified");
+		return ECANCELED;
+	}
+
+	sha256_final(&v->ctx, digest);
+	sha256_hex(digest, hex);
+
+	path = side_path(image, VERIFIED_SUFFIX);
+	if (!path)
+		return ENAMETOOLONG;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		PERROR(tmp, errno);
+		return errno;
+	}
+	fprintf(f, "%s %llu %lld.%09ld %s\n", hex,
+		(unsigned long long)st.st_size, (long long)st.st_mtim.tv_sec,
+		st.st_mtim.tv_nsec, v->bad ? "bad" : "ok");
+	if (fclose(f) == EOF || rename(tmp, path) == -1) {
+		PERROR(path, errno);
+		unlink(tmp);
+		return errno;
+	}
+
+	INFO("verified %s: %s", image, v->bad ? "bad" : hex);
+	return 0;
+}
+
+static int follow(struct verifier *v, int ino)
+{
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	struct inotify_event *event;
+	struct pollfd pfd = { .fd = ino, .events = POLLIN };
+	int closed = 0, modified, ret, err;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		err = read_new(v);
+		if (err)
+			return err;
+
+		ret = poll(&pfd, 1, VERIFY_IDLE_MS);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("poll", errno);
+			return errno;
+		}
+
+		if (ret == 0) {
+			/* Idle: maybe the close was before the watch */
+			if (!has_writers(v, closed))
+				break;
+			continue;
+		}
+
+		len = read(ino, buf, sizeof(buf));
+		if (len == -1) {
+			PERROR("read", errno);
+			return errno;
+		}
+		modified = 0;
+		for (p = buf ; p < buf + len ;
+		     p += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)p;
+			if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) {
+				INFO("image moved away, not verified");
+				return ECANCELED;
+			}
+			if (event->mask & IN_MODIFY)
+				modified = 1;
+			if (event->mask & IN_CLOSE_WRITE)
+				closed = 1;
+		}
+
+		err = check_appended(v, modified);
+		if (err)
+			return err;
+
+		if (closed) {
+			err = read_new(v);
+			if (err)
+				return err;
+			if (!has_writers(v, closed))
+				break;
+		}
+	}
+
+	return read_new(v);
+}
+
+int verify_follow(const char *image)
+{
+	struct verifier v;
+	char *lock_path;
+	int lock = -1, ino = -1, err;
+
+	memset(&v, 0, sizeof(v));
+	sha256_init(&v.ctx);
+
+	/* Breaking the lease taken by has_writers() must not kill us */
+	signal(SIGIO, SIG_IGN);
+
+	v.fd = open(image, O_RDONLY|O_CLOEXEC);
+	if (v.fd == -1) {
+		PERROR(image, errno);
+		return errno;
+	}
+
+	lock_path = side_path(image, VERIFYING_SUFFIX);
+	if (!lock_path) {
+		err = ENAMETOOLONG;
+		goto out;
+	}
+	lock = open(lock_path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if (lock == -1) {
+		PERROR(lock_path, errno);
+		err = errno;
+		goto out;
+	}
+	if (flock(lock, LOCK_EX|LOCK_NB) == -1) {
+		ERROR("%s is already being verified", image);
+		close(lock);
+		lock = -1;
+		err = EBUSY;
+		goto out;
+	}
+
+	ino = inotify_init1(IN_CLOEXEC);
+	if (ino == -1 ||
+	    inotify_add_watch(ino, image, IN_MODIFY|IN_CLOSE_WRITE|
+			      IN_DELETE_SELF|IN_MOVE_SELF) == -1) {
+		PERROR("inotify", errno);
+		err = errno;
+		goto out;
+	}
+
+	v.buf = malloc(VERIFY_BUF_SIZE);
+	if (!v.buf) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	/* Writes from here on are seen as events */
+	err = check_appended(&v, 0);
+	if (err)
+		goto out;
+
+	INFO("following %s", image);
+	err = follow(&v, ino);
+	if (!err)
+		err = write_result(&v, image);
+
+out:
+	/* Removed while still locked, so waiters find the result */
+	if (lock != -1) {
+		unlink(side_path(image, VERIFYING_SUFFIX));
+		close(lock);
+	}
+	if (ino != -1)
+		close(ino);
+	close(v.fd);
+	free(v.buf);
+	return err;
+}
+
+static int parse_hex(const char *hex, unsigned char *digest)
+{
+	unsigned int byte;
+	int i;
+
+	for (i = 0 ; i < SHA256_DIGEST_LEN ; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			return EINVAL;
+		digest[i] = byte;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the result of verifying an image, waiting for a verifier still
+ * running.  Returns ENOENT if there is no result for the image as it is now,
+ * and EBADMSG if it was found to be broken.
+ */
+int verify_lookup(const char *image, unsigned char *digest)
+{
+	char hex[SHA256_HEX_LEN], result[4];
+	unsigned long long size;
+	long long sec;
+	long nsec;
+	struct stat st;
+	char *path;
+	FILE *f;
+	int lock, n;
+
+	path = side_path(image, VERIFYING_SUFFIX);
+	if (!path)
+		return ENOENT;
+	lock = open(path, O_RDONLY|O_CLOEXEC);
+	if (lock != -1) {
+		INFO("waiting for verification of %s", image);
+		flock(lock, LOCK_SH);
+		close(lock);
+	}
+
+	f = fopen(side_path(image, VERIFIED_SUFFIX), "r");
+	if (!f)
+		return ENOENT;
+	n = fscanf(f, "%64s %llu %lld.%ld %3s", hex, &size, &sec, &nsec,
+		   result);
+	fclose(f);
+	if (n != 5 || stat(image, &st) == -1)
+		return ENOENT;
+
+	if ((unsigned long long)st.st_size != size ||
+	    st.st_mtim.tv_sec != sec || st.st_mtim.tv_nsec != nsec) {
+		INFO("%s changed after verification", image);
+		return ENOENT;
+	}
+
+	if (strcmp(result, "ok") != 0)
+		return EBADMSG;
+
+	return parse_hex(hex, digest) ? ENOENT : 0;
+}
+
+void verify_forget(const char *image)
+{
+	char *path = side_path(image, VERIFIED_SUFFIX);
+
+	if (path)
+		unlink(path);
+}
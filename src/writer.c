@@ -0,0 +1,799 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "arena.h"
+#include "writer.h"
+
+/*
+ * Background writer for small files.
+ *
+ * Extracting many small files is dominated by the syscalls needed to
+ * create each of them, rather than by the data written.  The extractor
+ * therefore reads small files into writer buffers and queues them here,
+ * and they are written in the background, either
+ *
+ *  - by io_uring, submitting a linked openat, write, optional fdatasync
+ *    and close for each file, using direct descriptors and registered
+ *    buffers, in batches of WRITER_BATCH files per system call, or
+ *  - by a pool of threads, when io_uring is not available.
+ *
+ * Files are completed in the order they were queued, so the done callback
+ * sees members in archive order, as with synchronous extraction.  A file
+ * that could not be written in the background, because its directory is
+ * missing or it already exists, is handed back to the extractor to be
+ * written synchronously.  Any other failure to open a file by io_uring is
+ * taken to mean io_uring does not work here, and the threads take over.
+ */
+
+#define WRITER_FILE_SIZE		(64 * 1024)
+#define WRITER_DEFAULT_MEM		(4 * 1024 * 1024)
+#define WRITER_MIN_SLOTS		4
+#define WRITER_MAX_SLOTS		256
+#define WRITER_BATCH			16
+#define WRITER_MIN_THREADS		2
+#define WRITER_MAX_THREADS		4
+
+#define OPEN_FLAGS			\
+	(O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC)
+/* Direct descriptors are never inherited, and openat rejects O_CLOEXEC */
+#define URING_OPEN_FLAGS		(OPEN_FLAGS & ~O_CLOEXEC)
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_QUEUED,
+	SLOT_RUNNING,
+	SLOT_DONE,
+};
+
+struct slot {
+	struct untar_member m;
+	char *buf;
+	enum slot_state state;
+	int pending;			/* io_uring completions outstanding */
+	int err;
+};
+
+/* io_uring operations of a file, in user_data */
+enum {
+	URING_OPEN,
+	URING_WRITE,
+	URING_FSYNC,
+	URING_CLOSE,
+};
+
+struct uring {
+	int fd;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	struct io_uring_cqe *cqes;
+	unsigned to_submit;
+	int fixed_bufs;
+};
+
+struct writer {
+	enum writer_engine engine;
+	int dirfd;
+	int flags;
+	const struct writer_ops *ops;
+	void *priv;
+	mode_t umask;
+	char *bufs;
+	struct slot *slots;
+	unsigned num_slots;
+	unsigned long head;		/* Oldest queued slot */
+	unsigned long tail;		/* Next free slot */
+	struct uring ring;
+	int uring_err;			/* Unexpected openat error */
+	/* Thread pool */
+	pthread_t *threads;
+	int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	unsigned long next;		/* Next slot for a thread to write */
+	int stop;
+};
+
+static struct slot *slot_at(struct writer *w, unsigned long i)
+{
+	return &w->slots[i % w->num_slots];
+}
+
+/* Write a whole file synchronously, as done by the thread pool */
+static int write_file(struct writer *w, struct slot *s)
+{
+	struct timespec times[2];
+	const char *p = s->buf;
+	size_t len = s->m.size;
+	ssize_t n;
+	int fd, err = 0;
+
+	fd = openat(w->dirfd, s->m.name, OPEN_FLAGS, 0600);
+	if (fd == -1)
+		return errno;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			goto out;
+		}
+		p += n;
+		len -= n;
+	}
+
+	if (geteuid() == 0 && fchown(fd, s->m.uid, s->m.gid) == -1) {
+		err = errno;
+		goto out;
+	}
+	if (fchmod(fd, s->m.mode) == -1) {
+		err = errno;
+		goto out;
+	}
+	times[0].tv_sec = times[1].tv_sec = s->m.mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	futimens(fd, times);
+
+	if ((w->flags & WRITER_FLAG_DATASYNC) && fdatasync(fd) == -1)
+		err = errno;
+
+	/* Pages not written back yet are only queued for writeback */
+	if (!err && (w->flags & WRITER_FLAG_DROP_CACHE))
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+out:
+	if (close(fd) == -1 && !err)
+		err = errno;
+	return err;
+}
+
+static void *worker(void *arg)
+{
+	struct writer *w = arg;
+	struct slot *s;
+	int err;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->stop && w->next == w->tail)
+			pthread_cond_wait(&w->work, &w->lock);
+		if (w->next == w->tail)
+			break;
+
+		s = slot_at(w, w->next++);
+		s->state = SLOT_RUNNING;
+		pthread_mutex_unlock(&w->lock);
+
+		err = write_file(w, s);
+
+		pthread_mutex_lock(&w->lock);
+		s->err = err;
+		s->state = SLOT_DONE;
+		pthread_cond_broadcast(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+static int threads_init(struct writer *w)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int err;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work, NULL);
+	pthread_cond_init(&w->done, NULL);
+
+	w->threads = calloc(WRITER_MAX_THREADS, sizeof(*w->threads));
+	if (!w->threads)
+		return ENOMEM;
+	cpus = cpus < WRITER_MIN_THREADS ? WRITER_MIN_THREADS :
+		cpus > WRITER_MAX_THREADS ? WRITER_MAX_THREADS : cpus;
+
+	for ( ; w->num_threads < cpus ; w->num_threads++) {
+		err = pthread_create(&w->threads[w->num_threads], NULL,
+				     worker, w);
+		if (err) {
+			PERROR("pthread_create", err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static void threads_stop(struct writer *w)
+{
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->work);
+	pthread_mutex_unlock(&w->lock);
+
+	for (i = 0 ; i < w->num_threads ; i++)
+		pthread_join(w->threads[i], NULL);
+	free(w->threads);
+}
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+				 unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Direct descriptors for openat and close came with the same kernel as
+ * IORING_OP_LINKAT, which is thus used to probe for them.
+ */
+static int uring_probe(struct uring *r)
+{
+	static const int ops[] = {
+		IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_WRITE_FIXED,
+		IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_LINKAT,
+	};
+	struct io_uring_probe *probe;
+	size_t size;
+	int i, err = 0;
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (!probe)
+		return ENOMEM;
+
+	if (sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe,
+				  256) == -1) {
+		err = errno;
+		goto out;
+	}
+
+	for (i = 0 ; i < (int)(sizeof(ops) / sizeof(ops[0])) ; i++) {
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			err = ENOSYS;
+			break;
+		}
+	}
+
+out:
+	free(probe);
+	return err;
+}
+
+static int uring_init(struct writer *w)
+{
+	struct uring *r = &w->ring;
+	struct io_uring_params p;
+	struct iovec iov;
+	int *files;
+	unsigned i;
+	int err;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_io_uring_setup(w->num_slots * 4, &p);
+	if (r->fd == -1)
+		return errno;
+
+	err = uring_probe(r);
+	if (err)
+		return err;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		return errno;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ|PROT_WRITE,
+				  MAP_SHARED|MAP_POPULATE, r->fd,
+				  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED) {
+			r->cq_ring = NULL;
+			return errno;
+		}
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		return errno;
+	}
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+
+	/* One direct descriptor per slot */
+	files = malloc(w->num_slots * sizeof(*files));
+	if (!files)
+		return ENOMEM;
+	for (i = 0 ; i < w->num_slots ; i++)
+		files[i] = -1;
+	err = sys_io_uring_register(r->fd, IORING_REGISTER_FILES, files,
+				    w->num_slots) == -1 ? errno : 0;
+	free(files);
+	if (err)
+		return err;
+
+	/* Registered buffers count against RLIMIT_MEMLOCK, so they are
+	 * optional */
+	iov.iov_base = w->bufs;
+	iov.iov_len = w->num_slots * WRITER_FILE_SIZE;
+	r->fixed_bufs = sys_io_uring_register(r->fd, IORING_REGISTER_BUFFERS,
+					      &iov, 1) == 0;
+
+	return 0;
+}
+
+static void uring_exit(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->fd != -1)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+
+	return sqe;
+}
+
+static void uring_queue(struct writer *w, unsigned long i)
+{
+	struct uring *r = &w->ring;
+	struct slot *s = slot_at(w, i);
+	unsigned index = i % w->num_slots;
+	struct io_uring_sqe *sqe;
+	mode_t mode = s->m.mode;
+
+	/* Set-id bits are applied after chown, which would clear them */
+	if (geteuid() == 0)
+		mode &= ~(S_ISUID|S_ISGID);
+
+	/* Hard links, so the descriptor is closed even if writing fails */
+	sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->flags = IOSQE_IO_HARDLINK;
+	sqe->fd = w->dirfd;
+	sqe->addr = (uintptr_t)s->m.name;
+	sqe->len = mode;
+	sqe->open_flags = URING_OPEN_FLAGS;
+	sqe->file_index = index + 1;
+	sqe->user_data = (uint64_t)index << 2 | URING_OPEN;
+
+	sqe = uring_sqe(r);
+	sqe->opcode = r->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK;
+	sqe->fd = index;
+	sqe->addr = (uintptr_t)s->buf;
+	sqe->len = s->m.size;
+	sqe->off = 0;
+	sqe->buf_index = 0;
+	sqe->user_data = (uint64_t)index << 2 | URING_WRITE;
+	s->pending = 3;
+
+	if (w->flags & WRITER_FLAG_DATASYNC) {
+		sqe = uring_sqe(r);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->flags = IOSQE_FIXED_FILE|IOSQE_IO_HARDLINK;
+		sqe->fd = index;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->user_data = (uint64_t)index << 2 | URING_FSYNC;
+		s->pending++;
+	}
+
+	sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = index + 1;
+	sqe->user_data = (uint64_t)index << 2 | URING_CLOSE;
+
+	s->err = 0;
+}
+
+static void uring_reap(struct writer *w)
+{
+	struct uring *r = &w->ring;
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	struct slot *s;
+
+	for ( ; head != tail ; head++) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		s = &w->slots[cqe->user_data >> 2];
+
+		if (!s->err) {
+			if (cqe->res < 0)
+				s->err = -cqe->res;
+			if (cqe->res < 0 &&
+			    (cqe->user_data & 3) == URING_OPEN &&
+			    s->err != ENOENT && s->err != EEXIST &&
+			    s->err != ENOTDIR && s->err != ELOOP)
+				w->uring_err = s->err;
+			else if ((cqe->user_data & 3) == URING_WRITE &&
+				 (unsigned long long)cqe->res != s->m.size)
+				s->err = EIO;
+		}
+		if (--s->pending == 0)
+			s->state = SLOT_DONE;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submit queued operations, waiting for at least wait of them */
+static int uring_enter(struct writer *w, unsigned wait)
+{
+	struct uring *r = &w->ring;
+	int ret;
+
+	do {
+		ret = sys_io_uring_enter(r->fd, r->to_submit, wait,
+					 wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1) {
+		PERROR("io_uring_enter", errno);
+		return errno;
+	}
+	r->to_submit -= ret;
+
+	uring_reap(w);
+	return 0;
+}
+
+/* Apply what openat could not, after the file has been written */
+static int uring_finish(struct writer *w, struct slot *s)
+{
+	struct timespec times[2];
+	int root = geteuid() == 0;
+
+	if (root && fchownat(w->dirfd, s->m.name, s->m.uid, s->m.gid,
+			     AT_SYMLINK_NOFOLLOW) == -1)
+		return errno;
+
+	if ((root && (s->m.mode & (S_ISUID|S_ISGID))) ||
+	    (s->m.mode & w->umask)) {
+		if (fchmodat(w->dirfd, s->m.name, s->m.mode, 0) == -1)
+			return errno;
+	}
+
+	times[0].tv_sec = times[1].tv_sec = s->m.mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	utimensat(w->dirfd, s->m.name, times, AT_SYMLINK_NOFOLLOW);
+
+	return 0;
+}
+
+static int wait_slot(struct writer *w, struct slot *s)
+{
+	int err = 0;
+
+	if (w->engine == WRITER_ENGINE_IO_URING) {
+		while (s->state != SLOT_DONE && !err)
+			err = uring_enter(w, 1);
+		if (!err && !s->err)
+			s->err = uring_finish(w, s);
+	} else {
+		pthread_mutex_lock(&w->lock);
+		while (s->state != SLOT_DONE)
+			pthread_cond_wait(&w->done, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return err;
+}
+
+/* Complete the oldest queued file */
+static int complete_head(struct writer *w)
+{
+	struct slot *s = slot_at(w, w->head);
+	int err;
+
+	err = wait_slot(w, s);
+	if (err)
+		return err;
+
+	if (s->err)
+		err = w->ops->retry(&s->m, s->buf, w->priv);
+	if (!err && w->ops->done)
+		err = w->ops->done(&s->m, w->priv);
+
+	free(s->m.name);
+	s->m.name = NULL;
+	s->state = SLOT_FREE;
+	w->head++;
+
+	return err;
+}
+
+int writer_open(struct writer **writer, enum writer_engine engine,
+		int dirfd, size_t mem, int flags, const struct writer_ops *ops,
+		void *priv)
+{
+	struct writer *w;
+	unsigned i;
+	int err;
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		PERROR("calloc", ENOMEM);
+		return ENOMEM;
+	}
+	w->engine = engine;
+	w->dirfd = dirfd;
+	w->flags = flags;
+	w->ops = ops;
+	w->priv = priv;
+	w->ring.fd = -1;
+
+	w->umask = umask(0);
+	umask(w->umask);
+
+	/* Never more than mem, which must be at least writer_min_mem() */
+	if (!mem)
+		mem = WRITER_DEFAULT_MEM;
+	w->num_slots = mem / WRITER_FILE_SIZE;
+	if (w->num_slots < WRITER_MIN_SLOTS) {
+		ERROR("%zu bytes is too little for the writer", mem);
+		err = ENOBUFS;
+		goto err;
+	}
+	if (w->num_slots > WRITER_MAX_SLOTS)
+		w->num_slots = WRITER_MAX_SLOTS;
+
+	w->slots = calloc(w->num_slots, sizeof(*w->slots));
+	w->bufs = arena_alloc(w->num_slots * WRITER_FILE_SIZE);
+	if (!w->slots || !w->bufs) {
+		PERROR("alloc", ENOMEM);
+		err = ENOMEM;
+		goto err;
+	}
+	for (i = 0 ; i < w->num_slots ; i++)
+		w->slots[i].buf = w->bufs + i * WRITER_FILE_SIZE;
+
+	if (w->engine == WRITER_ENGINE_IO_URING) {
+		err = uring_init(w);
+		if (err) {
+			INFO("io_uring not available (%s), using threads",
+			     strerror(err));
+			uring_exit(&w->ring);
+			w->engine = WRITER_ENGINE_THREADS;
+		}
+	}
+
+	if (w->engine == WRITER_ENGINE_THREADS) {
+		err = threads_init(w);
+		if (err) {
+			threads_stop(w);
+			goto err;
+		}
+	}
+
+	*writer = w;
+	return 0;
+
+err:
+	free(w->slots);
+	arena_free(w->bufs);
+	free(w);
+	return err;
+}
+
+size_t writer_min_mem(void)
+{
+	return WRITER_MIN_SLOTS * WRITER_FILE_SIZE;
+}
+
+size_t writer_max_size(struct writer *w)
+{
+	return WRITER_FILE_SIZE;
+}
+
+/* Get the buffer for the next file, waiting for one to be free */
+int writer_buf(struct writer *w, void **buf)
+{
+	int err;
+
+	if (w->tail - w->head == w->num_slots) {
+		err = complete_head(w);
+		if (err)
+			return err;
+	}
+
+	*buf = slot_at(w, w->tail)->buf;
+	return 0;
+}
+
+/* Once io_uring fails to open files, let the files in it be retried, and
+ * leave the rest to threads */
+static int switch_to_threads(struct writer *w)
+{
+	int err;
+
+	INFO("io_uring openat failed (%s), using threads",
+	     strerror(w->uring_err));
+
+	err = writer_flush(w);
+	if (err)
+		return err;
+
+	uring_exit(&w->ring);
+	w->engine = WRITER_ENGINE_THREADS;
+
+	return threads_init(w);
+}
+
+/* Queue the file, with data in the buffer from writer_buf() */
+int writer_queue(struct writer *w, struct untar_member *m)
+{
+	struct slot *s = slot_at(w, w->tail);
+	unsigned long i;
+	int err;
+
+	if (w->engine == WRITER_ENGINE_IO_URING && w->uring_err) {
+		err = switch_to_threads(w);
+		if (err)
+			return err;
+	}
+
+	/* A file replacing one still being written has to wait for it */
+	for (i = w->head ; i != w->tail ; i++) {
+		if (strcmp(slot_at(w, i)->m.name, m->name) == 0) {
+			err = writer_flush(w);
+			if (err)
+				return err;
+			break;
+		}
+	}
+
+	s->m = *m;
+	s->m.linkname = NULL;
+	s->m.name = strdup(m->name);
+	if (!s->m.name) {
+		PERROR("strdup", ENOMEM);
+		return ENOMEM;
+	}
+	s->err = 0;
+
+	if (w->engine == WRITER_ENGINE_IO_URING) {
+		uring_queue(w, w->tail);
+		s->state = SLOT_QUEUED;
+		w->tail++;
+		if (w->ring.to_submit >= WRITER_BATCH * 4)
+			return uring_enter(w, 0);
+	} else {
+		pthread_mutex_lock(&w->lock);
+		s->state = SLOT_QUEUED;
+		w->tail++;
+		pthread_cond_signal(&w->work);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return 0;
+}
+
+/* Complete all queued files */
+int writer_flush(struct writer *w)
+{
+	int err;
+
+	while (w->head != w->tail) {
+		err = complete_head(w);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+void writer_close(struct writer *w)
+{
+	struct slot *s;
+
+	/* Let the files in flight land before releasing their buffers */
+	for ( ; w->head != w->tail ; w->head++) {
+		s = slot_at(w, w->head);
+		if (wait_slot(w, s))
+			break;
+		free(s->m.name);
+	}
+
+	if (w->engine == WRITER_ENGINE_IO_URING)
+		uring_exit(&w->ring);
+	else
+		threads_stop(w);
+
+	free(w->slots);
+	arena_free(w->bufs);
+	free(w);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WRITER_H_
+#define _WRITER_H_
+
+#include <stddef.h>
+
+#include "untar.h"
+
+enum writer_engine {
+	WRITER_ENGINE_SYNC,
+	WRITER_ENGINE_IO_URING,
+	WRITER_ENGINE_THREADS,
+};
+
+struct writer_ops {
+	/* Called in queue order, once a file has been written */
+	int (*done)(struct untar_member *member, void *priv);
+	/* Write a file the background write failed for, synchronously */
+	int (*retry)(struct untar_member *member, const void *data,
+		     void *priv);
+};
+
+struct writer;
+
+/* fdatasync each file before closing it */
+#define WRITER_FLAG_DATASYNC		(1 << 0)
+/* Drop each file from the page cache when closing it (threads only) */
+#define WRITER_FLAG_DROP_CACHE		(1 << 1)
+
+int writer_open(struct writer **writer, enum writer_engine engine,
+		int dirfd, size_t mem, int flags, const struct writer_ops *ops,
+		void *priv);
+size_t writer_min_mem(void);
+size_t writer_max_size(struct writer *writer);
+int writer_buf(struct writer *writer, void **buf);
+int writer_queue(struct writer *writer, struct untar_member *member);
+int writer_flush(struct writer *writer);
+void writer_close(struct writer *writer);
+
+#endif /* _WRITER_H_ */
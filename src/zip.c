@@ -0,0 +1,572 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "common.h"
+#include "throttle.h"
+#include "zip.h"
+
+/*
+ * Zip central directory reader.
+ *
+ * Members stored without compression can be used right where they are in
+ * the image: either extracted by copy_file_range(), or cloned with
+ * FICLONERANGE as far as the filesystem allows, or not extracted at all,
+ * but handed to the command as offset and length within the image.
+ * Anything compressed is still left to unzip.  Extracted members can be
+ * checked against the CRC-32 of the central directory, as unzip does.
+ */
+
+#define EOCD_SIG			0x06054b50
+#define EOCD_SIZE			22
+#define EOCD_SEARCH			(EOCD_SIZE + 0xffff)
+#define ZIP64_LOCATOR_SIG		0x07064b50
+#define ZIP64_LOCATOR_SIZE		20
+#define ZIP64_EOCD_SIG			0x06064b50
+#define ZIP64_EOCD_SIZE			56
+#define ZIP64_EXTRA_ID			0x0001
+#define CENTRAL_SIG			0x02014b50
+#define CENTRAL_SIZE			46
+#define LOCAL_SIG			0x04034b50
+#define LOCAL_SIZE			30
+#define HOST_UNIX			3
+#define CRC32_POLY			0xedb88320
+#define COPY_BUF_SIZE			(64 * 1024)
+
+static unsigned get16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static unsigned long long get64(const unsigned char *p)
+{
+	return get32(p) | (unsigned long long)get32(p + 4) << 32;
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	n = pread(fd, buf, len, offset);
+	if (n == -1) {
+		PERROR("pread", errno);
+		return errno;
+	}
+	if ((size_t)n != len) {
+		ERROR("unexpected end of zip image");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/* Locate the central directory, from the (zip64) end record */
+static int find_central(struct zip *z, unsigned long long *offset,
+			unsigned long long *size, unsigned long long *count)
+{
+	unsigned char *buf, *p;
+	unsigned char rec[ZIP64_EOCD_SIZE];
+	unsigned long long eocd64;
+	struct stat st;
+	size_t len;
+	int err;
+
+	if (fstat(z->fd, &st) == -1) {
+		PERROR("fstat", errno);
+		return errno;
+	}
+	if (st.st_size < EOCD_SIZE)
+		return EINVAL;
+
+	len = st.st_size < EOCD_SEARCH ? st.st_size : EOCD_SEARCH;
+	buf = malloc(len);
+	if (!buf)
+		return ENOMEM;
+
+	err = pread_full(z->fd, buf, len, st.st_size - len);
+	if (err)
+		goto out;
+
+	for (p = buf + len - EOCD_SIZE ; p >= buf ; p--)
+		if (get32(p) == EOCD_SIG &&
+		    p + EOCD_SIZE + get16(p + 20) == buf + len)
+			break;
+	if (p < buf) {
+		ERROR("zip end of central directory not found");
+		err = EINVAL;
+		goto out;
+	}
+
+	*count = get16(p + 10);
+	*size = get32(p + 12);
+	*offset = get32(p + 16);
+	if (*count != 0xffff && *offset != 0xffffffff)
+		goto out;
+
+	/* Zip64 */
+	if (p - buf < ZIP64_LOCATOR_SIZE ||
+	    get32(p - ZIP64_LOCATOR_SIZE) != ZIP64_LOCATOR_SIG) {
+		ERROR("zip64 locator not found");
+		err = EINVAL;
+		goto out;
+	}
+	eocd64 = get64(p - ZIP64_LOCATOR_SIZE + 8);
+
+	err = pread_full(z->fd, rec, sizeof(rec), eocd64);
+	if (err)
+		goto out;
+	if (get32(rec) != ZIP64_EOCD_SIG) {
+		ERROR("zip64 end of central directory not found");
+		err = EINVAL;
+		goto out;
+	}
+	*count = get64(rec + 32);
+	*size = get64(rec + 40);
+	*offset = get64(rec + 48);
+
+out:
+	free(buf);
+	return err;
+}
+
+/* Sizes and offset too large for the central record are in an extra field */
+static void parse_zip64_extra(struct zip_entry *e, const unsigned char *p,
+			      size_t len)
+{
+	const unsigned char *end = p + len, *f;
+	unsigned id, size;
+
+	for ( ; p + 4 <= end ; p += 4 + size) {
+		id = get16(p);
+		size = get16(p + 2);
+		if (id != ZIP64_EXTRA_ID || p + 4 + size > end)
+			continue;
+
+		f = p + 4;
+		if (e->size == 0xffffffff && f + 8 <= p + 4 + size) {
+			e->size = get64(f);
+			f += 8;
+		}
+		if (e->csize == 0xffffffff && f + 8 <= p + 4 + size) {
+			e->csize = get64(f);
+			f += 8;
+		}
+		if (e->header == 0xffffffff && f + 8 <= p + 4 + size)
+			e->header = get64(f);
+	}
+}
+
+static int valid_name(const char *name)
+{
+	const char *c;
+
+	if (!*name || *name == '/')
+		return 0;
+
+	for (c = name ; c ; c = strchr(c, '/')) {
+		if (*c == '/')
+			c++;
+		if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || !c[2]))
+			return 0;
+	}
+
+	return 1;
+}
+
+int zip_open(struct zip *z, const char *image)
+{
+	unsigned long long offset = 0, size = 0, count = 0, i;
+	unsigned char *cd = NULL, *p, *end;
+	struct zip_entry *e;
+	unsigned name_len, extra_len, comment_len;
+	int err;
+
+	memset(z, 0, sizeof(*z));
+
+	z->fd = open(image, O_RDONLY|O_CLOEXEC);
+	if (z->fd == -1) {
+		PERROR("open", errno);
+		return errno;
+	}
+
+	err = find_central(z, &offset, &size, &count);
+	if (err)
+		goto out;
+
+	cd = malloc(size ? size : 1);
+	z->entries = calloc(count ? count : 1, sizeof(*z->entries));
+	if (!cd || !z->entries) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	err = pread_full(z->fd, cd, size, offset);
+	if (err)
+		goto out;
+
+	p = cd;
+	end = cd + size;
+	for (i = 0 ; i < count ; i++) {
+		if (p + CENTRAL_SIZE > end || get32(p) != CENTRAL_SIG) {
+			ERROR("invalid zip central directory");
+			err = EINVAL;
+			goto out;
+		}
+		name_len = get16(p + 28);
+		extra_len = get16(p + 30);
+		comment_len = get16(p + 32);
+		if (p + CENTRAL_SIZE + name_len + extra_len + comment_len >
+		    end) {
+			ERROR("invalid zip central directory");
+			err = EINVAL;
+			goto out;
+		}
+
+		e = &z->entries[z->num_entries++];
+		e->encrypted = get16(p + 8) & 1;
+		e->method = get16(p + 10);
+		e->crc = get32(p + 16);
+		e->csize = get32(p + 20);
+		e->size = get32(p + 24);
+		e->header = get32(p + 42);
+		if (get16(p + 4) >> 8 == HOST_UNIX)
+			e->mode = get32(p + 38) >> 16;
+		e->name = strndup((char *)p + CENTRAL_SIZE, name_len);
+		if (!e->name) {
+			err = ENOMEM;
+			goto out;
+		}
+		parse_zip64_extra(e, p + CENTRAL_SIZE + name_len, extra_len);
+
+		p += CENTRAL_SIZE + name_len + extra_len + comment_len;
+	}
+
+out:
+	free(cd);
+	if (err)
+		zip_close(z);
+	return err;
+}
+
+struct zip_entry *zip_find(struct zip *z, const char *name)
+{
+	unsigned i;
+
+	for (i = 0 ; i < z->num_entries ; i++)
+		if (strcmp(z->entries[i].name, name) == 0)
+			return &z->entries[i];
+
+	return NULL;
+}
+
+/* Find the data offset, which depends on the local header */
+int zip_locate(struct zip *z, struct zip_entry *e)
+{
+	unsigned char local[LOCAL_SIZE];
+	int err;
+
+	if (e->offset)
+		return 0;
+
+	err = pread_full(z->fd, local, sizeof(local), e->header);
+	if (err)
+		return err;
+	if (get32(local) != LOCAL_SIG) {
+		ERROR("%s: invalid zip local header", e->name);
+		return EINVAL;
+	}
+
+	e->offset = e->header + LOCAL_SIZE + get16(local + 26) +
+		get16(local + 28);
+	return 0;
+}
+
+static int make_parents(int dirfd, const char *name)
+{
+	char path[PATH_MAX], *p;
+
+	snprintf(path, sizeof(path), "%s", name);
+	for (p = strchr(path, '/') ; p ; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdirat(dirfd, path, 0755) == -1 && errno != EEXIST) {
+			PERROR("mkdirat", errno);
+			return errno;
+		}
+		*p = '/';
+	}
+
+	return 0;
+}
+
+/* Copy through userspace, where the kernel cannot copy between the files */
+static int copy_plain(int in, loff_t off_in, int out, loff_t off_out,
+		      unsigned long long len)
+{
+	char buf[COPY_BUF_SIZE];
+	ssize_t n, w;
+	char *p;
+
+	while (len) {
+		n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf),
+			  off_in);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("pread", errno);
+			return errno;
+		}
+		if (n == 0) {
+			ERROR("unexpected end of zip image");
+			return EINVAL;
+		}
+		off_in += n;
+		len -= n;
+		throttle_io(n, 0);
+
+		for (p = buf ; n ; p += w, n -= w) {
+			w = pwrite(out, p, n, off_out);
+			if (w == -1) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				PERROR("pwrite", errno);
+				return errno;
+			}
+			off_out += w;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Clone as much as block alignment allows, and copy the rest in the
+ * kernel, or through userspace where the kernel cannot.  Zip data is rarely
+ * block aligned, so cloning mostly applies to images made with aligned
+ * members.
+ */
+static int copy_range(int in, int out, unsigned long long offset,
+		      unsigned long long len)
+{
+	struct file_clone_range clone;
+	unsigned long long done = 0;
+	loff_t off_in, off_out;
+	struct stat st;
+	ssize_t n;
+
+	if (fstat(out, &st) == 0 && st.st_blksize &&
+	    offset % st.st_blksize == 0 && len >= (unsigned)st.st_blksize) {
+		clone.src_fd = in;
+		clone.src_offset = offset;
+		clone.src_length = len - len % st.st_blksize;
+		clone.dest_offset = 0;
+		if (ioctl(out, FICLONERANGE, &clone) == 0)
+			done = clone.src_length;
+	}
+
+	off_in = offset + done;
+	off_out = done;
+	while (done < len) {
+		n = copy_file_range(in, &off_in, out, &off_out, len - done, 0);
+		if (n == -1 && (errno == EXDEV || errno == EINVAL ||
+				errno == EOPNOTSUPP || errno == ENOSYS))
+			return copy_plain(in, off_in, out, off_out, len - done);
+		if (n == -1) {
+			PERROR("copy_file_range", errno);
+			return errno;
+		}
+		if (n == 0) {
+			ERROR("unexpected end of zip image");
+			return EINVAL;
+		}
+		throttle_io(n, 0);
+		done += n;
+	}
+
+	return 0;
+}
+
+/* Extract a stored member, without its data passing through userspace */
+int zip_extract_stored(struct zip *z, struct zip_entry *e, int dirfd)
+{
+	size_t len = strlen(e->name);
+	int fd, err;
+
+	if (!valid_name(e->name)) {
+		ERROR("refusing zip member %s", e->name);
+		return EINVAL;
+	}
+	if (e->method != ZIP_METHOD_STORED || e->encrypted)
+		return EINVAL;
+
+	err = make_parents(dirfd, e->name);
+	if (err)
+		return err;
+
+	if (e->name[len - 1] == '/') {
+		if (mkdirat(dirfd, e->name, 0755) == -1 && errno != EEXIST) {
+			PERROR("mkdirat", errno);
+			return errno;
+		}
+		return 0;
+	}
+
+	err = zip_locate(z, e);
+	if (err)
+		return err;
+
+	unlinkat(dirfd, e->name, 0);
+	fd = openat(dirfd, e->name,
+		    O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+		    e->mode & 07777 ? e->mode & 07777 : 0644);
+	if (fd == -1) {
+		PERROR(e->name, errno);
+		return errno;
+	}
+
+	err = copy_range(z->fd, fd, e->offset, e->size);
+
+	if (close(fd) == -1 && !err) {
+		PERROR("close", errno);
+		err = errno;
+	}
+	return err;
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+	static uint32_t table[256];
+	uint32_t c;
+	int i, k;
+
+	if (!table[1]) {
+		for (i = 0 ; i < 256 ; i++) {
+			c = i;
+			for (k = 0 ; k < 8 ; k++)
+				c = c & 1 ? CRC32_POLY ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* Check an extracted member against its CRC-32 */
+int zip_check_crc(struct zip_entry *e, int dirfd)
+{
+	unsigned char buf[COPY_BUF_SIZE];
+	uint32_t crc = 0;
+	ssize_t n;
+	int fd, err = 0;
+
+	fd = openat(dirfd, e->name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd == -1) {
+		PERROR(e->name, errno);
+		return errno;
+	}
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			PERROR("read", errno);
+			err = errno;
+			break;
+		}
+		crc = crc32_update(crc, buf, n);
+	}
+	close(fd);
+
+	if (!err && crc != e->crc) {
+		ERROR("%s: CRC-32 %08x, expected %08x", e->name, crc, e->crc);
+		err = EBADMSG;
+	}
+
+	return err;
+}
+
+/*
+ * Write "<offset> <length> <name>" of each stored member, so the command
+ * can read them straight from the image.
+ */
+int zip_write_index(struct zip *z, const char *path)
+{
+	struct zip_entry *e;
+	FILE *f;
+	unsigned i;
+	int err = 0;
+
+	f = fopen(path, "w");
+	if (!f) {
+		PERROR(path, errno);
+		return errno;
+	}
+
+	for (i = 0 ; i < z->num_entries && !err ; i++) {
+		e = &z->entries[i];
+		if (e->method != ZIP_METHOD_STORED || e->encrypted ||
+		    strchr(e->name, '\n'))
+			continue;
+		err = zip_locate(z, e);
+		if (!err)
+			fprintf(f, "%llu %llu %s\n", e->offset, e->size,
+				e->name);
+	}
+
+	if (fclose(f) == EOF && !err) {
+		PERROR("fclose", errno);
+		err = errno;
+	}
+	return err;
+}
+
+void zip_close(struct zip *z)
+{
+	unsigned i;
+
+	for (i = 0 ; i < z->num_entries ; i++)
+		free(z->entries[i].name);
+	free(z->entries);
+	z->entries = NULL;
+	z->num_entries = 0;
+	if (z->fd != -1)
+		close(z->fd);
+	z->fd = -1;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2015 DEIF A/S.
+ *
+ * This file is part of dupdate.
+ *
+ * dupdate is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * dupdate is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with dupdate.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ZIP_H_
+#define _ZIP_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ZIP_METHOD_STORED		0
+#define ZIP_METHOD_DEFLATED		8
+
+struct zip_entry {
+	char *name;
+	int method;
+	int encrypted;
+	mode_t mode;			/* 0 unless made on unix */
+	uint32_t crc;
+	unsigned long long header;	/* Offset of local header */
+	unsigned long long offset;	/* Offset of data, see zip_locate() */
+	unsigned long long csize;	/* Size of data in image */
+	unsigned long long size;	/* Size when extracted */
+};
+
+struct zip {
+	int fd;
+	struct zip_entry *entries;
+	unsigned num_entries;
+};
+
+int zip_open(struct zip *z, const char *image);
+struct zip_entry *zip_find(struct zip *z, const char *name);
+int zip_locate(struct zip *z, struct zip_entry *e);
+int zip_extract_stored(struct zip *z, struct zip_entry *e, int dirfd);
+int zip_check_crc(struct zip_entry *e, int dirfd);
+int zip_write_index(struct zip *z, const char *path);
+void zip_close(struct zip *z);
+
+#endif /* _ZIP_H_ */